@@ -0,0 +1,23 @@
+#include "evolv.h"
+
+
+// Explicit instantiations declared extern in evolv.h
+
+namespace evolv {
+
+template class MarkovChain<int>;
+template class MarkovChain<int64_t>;
+template class MarkovChain<std::string>;
+
+namespace internal {
+
+template class FenwickTree<int64_t, int>;
+template class ForgorChain<int>;
+template class RemberChain<int>;
+template class StateCoder<int, int>;
+template class StateCoder<int64_t, int>;
+template class StateCoder<std::string, int>;
+
+}  // namespace internal
+
+}  // namespace evolv
@@ -1,27 +1,107 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <concepts>
+#include <cstdint>
 #include <deque>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <iterator>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <ostream>
+#include <shared_mutex>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "impl/base_chain.h"
+#include "impl/chain_snapshot.h"
+#include "impl/class_counters.h"
+#include "impl/count_import.h"
+#include "impl/delta_log.h"
 #include "impl/forgor_chain.h"
+#include "impl/frozen_rows.h"
+#include "impl/generator.h"
+#include "impl/integral_coders.h"
+#include "impl/metrics.h"
+#include "impl/quantized_rows.h"
+#include "impl/random.h"
 #include "impl/rember_chain.h"
+#include "impl/simulator.h"
+#include "impl/sorted_runs.h"
+#include "impl/spsc_queue.h"
 #include "impl/state_coder.h"
+#include "impl/tiered_rows.h"
 #include "impl/utils.h"
 
 
 //! Entry-point namespace for the library
 namespace evolv {
 
+/*!
+  \brief Aggregated statistics of walkers simulated by MarkovChain::Simulate
+
+  Statistics are accumulated, so the same instance may be passed into
+  several simulations. Set targets before simulating to track the steps
+  at which walkers first hit them.
+*/
+template <class StateT>
+struct SimulationStats {
+  //! States to track first hitting steps for
+  std::vector<StateT> targets;
+  //! How many walkers hit each of targets
+  std::vector<int64_t> hits;
+  //! Sum of first hitting steps over walkers that hit each of targets
+  std::vector<int64_t> hit_steps;
+  //! How many times each state was visited, including starting states
+  std::unordered_map<StateT, int64_t> visits;
+  //! How many walkers ended in each state
+  std::unordered_map<StateT, int64_t> end_states;
+
+  //! Mean first hitting step of targets[i] over walkers that hit it
+  double MeanHitStep(int i) const {
+    return hits[i] == 0 ? 0.0 : static_cast<double>(hit_steps[i]) / hits[i];
+  }
+};
+
+
+//! Order of states given by MarkovChain::Recode
+enum class RecodeOrder {
+  //! By descending frequency
+  kFrequency,
+  //! By descending frequency, clustering states that follow each other
+  kCoOccurrence,
+};
+
+
 /*!
   \brief Class representing the Markov chain
 
   Chain states have type StateT that must be copy-constructible.
   Internally states are coded as integral CodeT (int by default).
+  Predictions are drawn with RngT, which is xoshiro256++ by default and
+  may be replaced with any generator of full-range 64-bit values,
+  like std::mt19937_64. With MetricsT = internal::Metrics the chain
+  measures latencies and counts row resizes, reported by Stats().
+  Transition counters and coded states are allocated from the memory
+  resource given in constructor, which must outlive the chain.
+  States are coded with CoderT, which is hashing StateCoder by default or
+  TableCoder if utils::StateRange is specialized for StateT. Dense
+  integral states may be coded into themselves with IdentityCoder.
 
   By definition, Markov chain is memoryless,
   which means that chains memory is limited to only one current state.
@@ -34,26 +114,51 @@ namespace evolv {
   After learning from sequences given in FeedSequence,
   while keeping track on currect state, chain can predict the subsequent state.
 */
-template <class StateT, class CodeT = int>
-  requires std::copy_constructible<StateT> && std::integral<CodeT>
+template <class StateT, class CodeT = int,
+          class RngT = internal::Xoshiro256pp,
+          class MetricsT = internal::NoMetrics,
+          class CoderT = typename internal::DefaultCoderOf<StateT, CodeT>::Type>
+  requires std::copy_constructible<StateT> && std::integral<CodeT> &&
+           utils::is_random_generator<RngT> &&
+           utils::is_state_coder<CoderT, StateT, CodeT>
 class MarkovChain {
  public:
-  explicit MarkovChain(int memorize_previous = 0) {
-    int random_state =
-        std::chrono::steady_clock::now().time_since_epoch().count();
-    MarkovChain(memorize_previous, random_state);
+  using StateType = StateT;
+  //! Type of states yielded by Walk, referring to the stored ones
+  using StateView = typename internal::StateStorage<StateT>::View;
+  using CodeType = CodeT;
+
+  //! Instantiate chain seeded with the current time
+  explicit MarkovChain(int memorize_previous = 0)
+      : MarkovChain(memorize_previous,
+                    static_cast<uint64_t>(std::chrono::steady_clock::now()
+                                              .time_since_epoch()
+                                              .count())) {
   }
 
-  //! Instantiate chain tracking the given number of previous states
-  MarkovChain(int memorize_previous, int random_state) {
-    assert(memorize_previous >= 0);
-    if (memorize_previous == 0) {
-      chain_ = std::make_unique<internal::ForgorChain<CodeT>>(random_state);
-    } else {
-      chain_ = std::make_unique<internal::RemberChain<CodeT>>(memorize_previous,
-                                                              random_state);
-    }
-    state_coder_ = std::make_shared<internal::StateCoder<StateT, CodeT>>();
+  //! Instantiate chain tracking the given number of previous states,
+  //! allocating from the given resource, like arena for training
+  MarkovChain(int memorize_previous, uint64_t random_state,
+              std::pmr::memory_resource *resource =
+                  std::pmr::get_default_resource())
+      : chain_(MakeChain(memorize_previous, random_state, resource)),
+        state_coder_(std::make_shared<CoderT>(resource)) {
+  }
+
+  //! Instantiate chain over internal::SharedStateCoder shared with other
+  //! chains, so states are coded and stored once for all of them. The
+  //! chain holds only its counters and memory, and the vocabulary isn't
+  //! counted in its MemoryUsage. Only that coder may be shared, as it has
+  //! no Prune or Recode, that would change codes under other chains
+  MarkovChain(int memorize_previous, uint64_t random_state,
+              std::shared_ptr<CoderT> vocabulary,
+              std::pmr::memory_resource *resource =
+                  std::pmr::get_default_resource())
+    requires std::same_as<CoderT, internal::SharedStateCoder<StateT, CodeT>>
+      : chain_(MakeChain(memorize_previous, random_state, resource)),
+        state_coder_(std::move(vocabulary)),
+        shared_vocabulary_(true) {
+    assert(state_coder_ != nullptr);
   }
 
   ~MarkovChain() = default;
@@ -62,15 +167,169 @@ class MarkovChain {
   template <class IterT>
     requires utils::is_iterator<IterT, StateT>
   void FeedSequence(IterT it, IterT end, bool update_memory = false) {
-    chain_->FeedSequence(internal::EncodingIter<CodeT>(it, state_coder_),
-                         internal::EncodingIter<CodeT>(end, state_coder_),
-                         update_memory);
+    FeedSequenceWeighted(it, end, 1, update_memory);
+  }
+
+  //! Learn from sequence seen the given number of times, at the cost of
+  //! one feed: each transition is counted weight times. Named apart from
+  //! FeedSequence, so the weight isn't taken for update_memory. False and
+  //! nothing is fed if weight isn't positive
+  template <class IterT>
+    requires utils::is_iterator<IterT, StateT>
+  bool FeedSequenceWeighted(IterT it, IterT end, int64_t weight,
+                            bool update_memory = false) {
+    if constexpr (kStatesAreCodes && std::contiguous_iterator<IterT>) {
+      return FeedCodes(std::span<const CodeT>(std::to_address(it), end - it),
+                       update_memory, weight);
+    } else {
+      if (weight <= 0) {
+        return false;
+      }
+      auto start = chain_->GetMetrics().Now();
+      chain_->FeedSequence(internal::EncodingIter<CodeT>(it, state_coder_),
+                           internal::EncodingIter<CodeT>(end, state_coder_),
+                           update_memory, weight);
+      chain_->GetMetrics().RecordFeed(start);
+      return true;
+    }
+  }
+
+  //! Learn from sequence of codes, that are given by Encode or are states
+  //! themselves with IdentityCoder. This skips encoding and virtual call
+  //! per state, move to last state in sequence if needed. Each transition
+  //! is counted weight times. False and nothing is fed if weight isn't
+  //! positive
+  bool FeedCodes(std::span<const CodeT> codes, bool update_memory = false,
+                 int64_t weight = 1) {
+    if (weight <= 0) {
+      return false;
+    }
+    auto start = chain_->GetMetrics().Now();
+    state_coder_->Admit(codes);
+    chain_->FeedCodes(codes, update_memory, weight);
+    chain_->GetMetrics().RecordFeed(start);
+    return true;
+  }
+
+  //! Count transition from state into the state coming in depth + 1 steps
+  //! weight times, like the pre-aggregated one. Memory isn't changed.
+  //! False and nothing is counted if depth isn't less than
+  //! memorize_previous + 1 or weight isn't positive
+  bool AddTransition(const StateT &from, const StateT &to, int64_t weight = 1,
+                     int depth = 0) {
+    if (depth < 0 || depth >= chain_->GetMemorySize() || weight <= 0) {
+      return false;
+    }
+    CodeT from_code = state_coder_->Encode(from);
+    internal::TransitionDelta<CodeT> transition{
+        from_code, depth, state_coder_->Encode(to), weight};
+    chain_->AddTransitions(std::span(&transition, 1));
+    return true;
+  }
+
+  //! Add pre-aggregated counts from TSV stream, see internal::CountFormat.
+  //! Cost is proportional to the number of records, not to their counts.
+  //! Stops at the end or at the malformed line, leaving the stream at it,
+  //! records with depth beyond the memory or non-positive count are
+  //! malformed. Returns number of added records
+  std::size_t ImportCountsTsv(std::istream &is)
+    requires internal::is_parsable_state<StateT>
+  {
+    return ImportCounts(is, [](std::istream &is, int memory_size, auto fn) {
+      return internal::ReadTsvCounts<StateT>(is, memory_size, fn);
+    });
+  }
+
+  //! Add pre-aggregated counts from binary stream, see ImportCountsTsv
+  std::size_t ImportCountsBinary(std::istream &is)
+    requires internal::is_serializable_state<StateT>
+  {
+    return ImportCounts(is, [](std::istream &is, int memory_size, auto fn) {
+      return internal::ReadBinaryCounts<StateT>(is, memory_size, fn);
+    });
+  }
+
+  //! Learn from sequence like FeedSequence, but it may be called from many
+  //! threads at once, while other methods aren't called. States and rows
+  //! are locked by stripes, counters are incremented with atomics under
+  //! shared locks and only new states and rows are created under the
+  //! exclusive lock of their stripe. The first context states are only
+  //! remembered, transitions into them aren't counted, so a long sequence
+  //! may be fed by windows preceded by memorize_previous + 1 states of
+  //! the previous one. Memory isn't updated and latencies aren't recorded
+  template <class IterT>
+    requires utils::is_iterator<IterT, StateT> &&
+             requires(CoderT coder, IterT it, std::vector<CodeT> &codes) {
+               coder.EncodeConcurrent(it, it, codes);
+             }
+  void FeedSequenceConcurrent(IterT it, IterT end, std::size_t context = 0) {
+    std::vector<CodeT> codes;
+    state_coder_->EncodeConcurrent(it, end, codes);
+    chain_->FeedCodesConcurrent(codes, context);
+  }
+
+  //! Map state to code, that may be passed into FeedCodes
+  CodeT Encode(const StateT &state) {
+    return state_coder_->Encode(state);
+  }
+
+  //! Map code to state
+  StateT Decode(CodeT code) const {
+    return state_coder_->Decode(code);
   }
 
   //! Predict the subsequent state based on current state and possibly memory,
   //! move to predicted state if needed
   StateT PredictState(bool update_memory = false) {
-    return state_coder_->Decode(chain_->PredictState(update_memory));
+    auto start = chain_->GetMetrics().Now();
+    StateT state = state_coder_->Decode(chain_->PredictState(update_memory));
+    chain_->GetMetrics().RecordPredict(start);
+    return state;
+  }
+
+  //! Predict like PredictState, but nullopt if there are no transitions
+  //! from current memory, like for states never seen followed by others
+  std::optional<StateT> TryPredictState(bool update_memory = false) {
+    auto start = chain_->GetMetrics().Now();
+    std::optional<CodeT> code = chain_->TryPredictState(update_memory);
+    chain_->GetMetrics().RecordPredict(start);
+    return code ? std::optional<StateT>(state_coder_->Decode(*code))
+                : std::nullopt;
+  }
+
+  //! Append k samples of the subsequent state drawn independently from
+  //! current memory, like k calls of PredictState(false), but the counters
+  //! are looked up and traversed once for all of them. Samples come in
+  //! order of codes, so equal ones are adjacent. False with none appended
+  //! if there are no transitions from current memory
+  bool PredictStates(std::size_t k, std::vector<StateT> &out) {
+    auto start = chain_->GetMetrics().Now();
+    std::vector<CodeT> codes;
+    bool predicted = chain_->PredictStates(k, codes);
+    out.reserve(out.size() + codes.size());
+    for (CodeT code : codes) {
+      out.push_back(state_coder_->Decode(code));
+    }
+    chain_->GetMetrics().RecordPredict(start);
+    return predicted;
+  }
+
+  //! Lazily predict subsequent states moving to each of them, like
+  //! PredictState(true) in a loop. The returned input range ends when there
+  //! are no transitions from current memory and works with range adaptors,
+  //! like std::views::take_while. It yields references to states stored in
+  //! the coder, or std::string_view of them for strings, instead of
+  //! copying them, unless the vocabulary is shared. The chain must outlive
+  //! the range and states are valid until the next ones are coded
+  internal::Generator<StateView> Walk() {
+    for (CodeT code : chain_->WalkCodes()) {
+      if constexpr (requires { state_coder_->DecodeRef(code); }) {
+        co_yield state_coder_->DecodeRef(code);
+      } else {
+        // the copy lives until the walk is resumed
+        co_yield StateView(state_coder_->Decode(code));
+      }
+    }
   }
 
   //! Push a new state given as single value into memory forgetting the oldest
@@ -88,6 +347,290 @@ class MarkovChain {
                          internal::EncodingIter<CodeT>(end, state_coder_));
   }
 
+  //! Simulate independent walkers, one per given starting state, for given
+  //! number of steps and add their statistics into stats. Neither memory,
+  //! learned transitions nor coded states change: walkers aren't started
+  //! from unknown states and unknown targets are never hit, repeated ones
+  //! get the same hits. Returns the
+  //! number of walkers simulated. Uses all cores if threads <= 0
+  template <class IterT>
+    requires utils::is_iterator<IterT, StateT>
+  std::size_t Simulate(IterT it, IterT end, int steps,
+                       SimulationStats<StateT> &stats, int threads = 0) {
+    std::vector<CodeT> starts, targets;
+    // index in targets of each known one of stats.targets, simulated once
+    // if repeated
+    std::vector<std::pair<std::size_t, std::size_t>> target_slots;
+    for (; it != end; ++it) {
+      if (std::optional<CodeT> code = state_coder_->Find(*it)) {
+        starts.push_back(*code);
+      }
+    }
+    for (std::size_t i = 0; i < stats.targets.size(); ++i) {
+      if (std::optional<CodeT> code = state_coder_->Find(stats.targets[i])) {
+        auto target = std::find(targets.begin(), targets.end(), *code);
+        if (target == targets.end()) {
+          target = targets.insert(target, *code);
+        }
+        target_slots.emplace_back(i, target - targets.begin());
+      }
+    }
+    stats.hits.resize(stats.targets.size(), 0);
+    stats.hit_steps.resize(stats.targets.size(), 0);
+
+    std::size_t num_codes = state_coder_->Size();
+    internal::SimulationCounts counts(num_codes, targets.size());
+    chain_->Simulate(starts, steps, targets, num_codes, counts, threads);
+
+    for (std::size_t code = 0; code < num_codes; ++code) {
+      if (counts.visits[code] > 0) {
+        stats.visits[state_coder_->Decode(code)] += counts.visits[code];
+      }
+      if (counts.end_states[code] > 0) {
+        stats.end_states[state_coder_->Decode(code)] += counts.end_states[code];
+      }
+    }
+    for (auto [slot, target] : target_slots) {
+      stats.hits[slot] += counts.hits[target];
+      stats.hit_steps[slot] += counts.hit_steps[target];
+    }
+    return starts.size();
+  }
+
+  //! Snapshot of sizes, always available, and of activity and latencies,
+  //! available only if MetricsT is internal::Metrics
+  internal::ChainStats Stats() const {
+    internal::ChainStats stats;
+    stats.states = state_coder_->Size();
+    stats.bytes.coder = shared_vocabulary_ ? 0 : state_coder_->MemoryUsage();
+    chain_->FillStats(stats);
+    chain_->GetMetrics().Fill(stats);
+    return stats;
+  }
+
+  //! Bytes actually allocated by coder, transition counters and memory,
+  //! including hash table buckets and unused capacity of containers.
+  //! Shared vocabulary isn't counted
+  internal::MemoryReport MemoryUsage() const {
+    return Stats().bytes;
+  }
+
+  //! Give back unused capacity of all containers, call after learning
+  //! to keep only the memory that is actually used
+  void ShrinkToFit() {
+    chain_->ShrinkToFit();
+    state_coder_->ShrinkToFit();
+  }
+
+  //! Drop states seen less than min_count times and keep at most top_k
+  //! most frequent of the rest. Dropped states and the ones not seen before
+  //! are coded from now on as the reserved code 0, that is decoded into
+  //! unknown, like "<UNK>", and their transitions are merged. Kept states
+  //! are recoded densely in their order. Frequency of state is the number
+  //! of transitions into it or from it, whichever is larger. Checkpoints
+  //! start over with snapshot. Returns the number of kept states besides
+  //! the unknown one
+  std::size_t Prune(int64_t min_count, std::size_t top_k,
+                    const StateT &unknown)
+    requires requires(CoderT coder, std::span<const CodeT> new_codes) {
+      coder.Prune(new_codes, unknown);
+    }
+  {
+    std::size_t num_codes = state_coder_->Size();
+    std::vector<int64_t> frequency = StateFrequencies();
+
+    std::optional<CodeT> unknown_code = state_coder_->Find(unknown);
+    std::vector<CodeT> kept;
+    for (std::size_t code = 0; code < num_codes; ++code) {
+      if (unknown_code != static_cast<CodeT>(code) &&
+          frequency[code] >= min_count) {
+        kept.push_back(static_cast<CodeT>(code));
+      }
+    }
+    if (kept.size() > top_k) {
+      std::nth_element(kept.begin(), kept.begin() + top_k, kept.end(),
+                       [&frequency](CodeT lhs, CodeT rhs) {
+                         return frequency[lhs] != frequency[rhs]
+                                    ? frequency[lhs] > frequency[rhs]
+                                    : lhs < rhs;
+                       });
+      kept.resize(top_k);
+      std::sort(kept.begin(), kept.end());
+    }
+
+    std::vector<CodeT> new_codes(num_codes, CoderT::kUnknown);
+    for (std::size_t i = 0; i < kept.size(); ++i) {
+      new_codes[kept[i]] = static_cast<CodeT>(i + 1);
+    }
+    chain_->Recode(new_codes);
+    state_coder_->Prune(new_codes, unknown);
+    checkpointed_codes_ = 0;
+    return kept.size();
+  }
+
+  //! Renumber states by descending frequency, so frequent states get small
+  //! codes, rows of counters get shorter and their hot prefixes stay in
+  //! cache. With RecodeOrder::kCoOccurrence each state is followed by its
+  //! most frequent subsequent state, if it's not placed yet, otherwise by
+  //! the most frequent state left. The unknown state of Prune keeps code 0.
+  //! Codes given by Encode before are invalidated. Checkpoints start over
+  //! with snapshot
+  void Recode(RecodeOrder order = RecodeOrder::kFrequency)
+    requires requires(CoderT coder, std::span<const CodeT> new_codes) {
+      coder.Recode(new_codes);
+    }
+  {
+    std::size_t num_codes = state_coder_->Size();
+    std::vector<CodeT> successors;
+    std::vector<int64_t> frequency = StateFrequencies(
+        order == RecodeOrder::kCoOccurrence ? &successors : nullptr);
+    std::size_t first = state_coder_->Pruned() ? 1 : 0;
+    std::vector<CodeT> by_frequency;
+    for (std::size_t code = first; code < num_codes; ++code) {
+      by_frequency.push_back(static_cast<CodeT>(code));
+    }
+    std::stable_sort(by_frequency.begin(), by_frequency.end(),
+                     [&frequency](CodeT lhs, CodeT rhs) {
+                       return frequency[lhs] > frequency[rhs];
+                     });
+
+    std::vector<CodeT> new_codes(num_codes);
+    std::vector<bool> placed(num_codes, false);
+    auto next_code = static_cast<CodeT>(first);
+    for (CodeT seed : by_frequency) {
+      for (CodeT code = seed; !placed[code];) {
+        placed[code] = true;
+        new_codes[code] = next_code++;
+        if (successors.empty() ||
+            successors[code] == static_cast<CodeT>(num_codes) ||
+            successors[code] < static_cast<CodeT>(first)) {
+          break;
+        }
+        code = successors[code];
+      }
+    }
+    chain_->Recode(new_codes);
+    state_coder_->Recode(new_codes);
+    checkpointed_codes_ = 0;
+  }
+
+  //! Append changes since the previous checkpoint to the delta log:
+  //! states coded since then and merged transition deltas. The first
+  //! checkpoint and the one after Prune or Recode write the whole model
+  //! with Compact and start recording deltas, see NextCheckpointIsSnapshot.
+  //! Memory isn't checkpointed
+  void Checkpoint(std::ostream &os)
+    requires internal::is_serializable_state<StateT>
+  {
+    if (!chain_->DeltasEnabled()) {
+      Compact(os);
+      return;
+    }
+    internal::DeltaBlock<StateT, CodeT> block;
+    block.seq = ++checkpoint_seq_;
+    block.memory_size = GetMemorySize();
+    AppendCodedStates(block);
+    block.transitions = chain_->TakeDeltas();
+    internal::DeltaLogFormat<StateT, CodeT>::Write(os, block);
+  }
+
+  //! Write the whole model as snapshot block, that includes all the
+  //! checkpoints before. Recovery replays the snapshot and then only the
+  //! blocks of the log checkpointed after it, so the log may be truncated
+  void Compact(std::ostream &os)
+    requires internal::is_serializable_state<StateT>
+  {
+    chain_->EnableDeltas();
+    chain_->TakeDeltas();
+    internal::DeltaBlock<StateT, CodeT> block;
+    block.seq = ++checkpoint_seq_;
+    block.snapshot = true;
+    block.pruned = CoderPruned();
+    block.memory_size = GetMemorySize();
+    checkpointed_codes_ = 0;
+    AppendCodedStates(block);
+    chain_->CollectCounts(block.transitions);
+    internal::DeltaLogFormat<StateT, CodeT>::Write(os, block);
+  }
+
+  //! Whether the next Checkpoint writes the whole model as snapshot block,
+  //! as it's the first one or Prune or Recode changed codes since the
+  //! previous one. The snapshot replaces the model, so it must be written
+  //! where recovery starts, not appended to the log
+  bool NextCheckpointIsSnapshot() const {
+    return !chain_->DeltasEnabled();
+  }
+
+  //! Apply snapshot and delta blocks from the stream, skipping the ones
+  //! already applied, and start recording deltas. Snapshot is applied only
+  //! to the chain without transitions, and codes unseen states as unknown
+  //! if the model was pruned. States of block must get the codes they had,
+  //! so the shared vocabulary may already hold them, like when snapshots
+  //! of many chains over it are replayed. Stops at the end, at the block
+  //! cut by crash, following the missing one, at snapshot following other
+  //! blocks, at states coded differently or at block of another memory
+  //! size or with transitions out of the chain, see ValidDeltas, leaving
+  //! the stream at that block, so a replica may call it again as the log
+  //! grows. Returns number of applied blocks. Memory isn't restored, set
+  //! it with UpdateMemory
+  std::size_t Replay(std::istream &is)
+    requires internal::is_serializable_state<StateT>
+  {
+    std::size_t applied = 0;
+    internal::DeltaBlock<StateT, CodeT> block;
+    for (std::streampos start = is.tellg();
+         internal::DeltaLogFormat<StateT, CodeT>::Read(is, block);
+         start = is.tellg()) {
+      if (block.seq <= checkpoint_seq_) {
+        continue;
+      }
+      if ((block.snapshot ? Stats().rows != 0
+                          : block.seq != checkpoint_seq_ + 1) ||
+          !ContinuesCoding(block) || !ValidDeltas(block)) {
+        is.seekg(start);
+        break;
+      }
+      for (const StateT &state : block.states) {
+        state_coder_->Encode(state);
+      }
+      if (block.pruned) {
+        MarkPruned(block.states);
+      }
+      chain_->ApplyDeltas(block.transitions);
+      checkpoint_seq_ = block.seq;
+      checkpointed_codes_ = state_coder_->Size();
+      applied++;
+    }
+    chain_->EnableDeltas();
+    return applied;
+  }
+
+  //! Number of the last checkpoint written or replayed
+  uint64_t CheckpointSeq() const {
+    return checkpoint_seq_;
+  }
+
+  //! Number of states the prediction depends on: memorize_previous + 1
+  int GetMemorySize() const {
+    return chain_->GetMemorySize();
+  }
+
+  //! Whole model as snapshot block, like the one written by Compact: all
+  //! the coded states and transition counts. Read-only models, like
+  //! TieredChain, are built from it
+  internal::DeltaBlock<StateT, CodeT> Export() const {
+    internal::DeltaBlock<StateT, CodeT> block;
+    block.seq = checkpoint_seq_;
+    block.snapshot = true;
+    block.pruned = CoderPruned();
+    block.memory_size = GetMemorySize();
+    for (std::size_t code = 0; code < state_coder_->Size(); ++code) {
+      block.states.push_back(state_coder_->Decode(static_cast<CodeT>(code)));
+    }
+    chain_->CollectCounts(block.transitions);
+    return block;
+  }
+
   //! Get deque of memory, where the first is the last seen state.
   std::deque<StateT> GetMemory() const {
     std::deque<CodeT> encoded_memory = chain_->GetMemory();
@@ -100,9 +643,1200 @@ class MarkovChain {
 
  private:
   //! Chain implementation, either ForgorChain or RemberChain
-  std::unique_ptr<internal::BaseChain<CodeT>> chain_;
+  std::unique_ptr<internal::BaseChain<CodeT, RngT, MetricsT>> chain_;
   //! State encoder and decoder (into and from CodeT)
-  std::shared_ptr<internal::StateCoder<StateT, CodeT>> state_coder_;
+  std::shared_ptr<CoderT> state_coder_;
+  //! Whether state_coder_ is the vocabulary shared with other chains
+  bool shared_vocabulary_ = false;
+
+  //! Number of the last checkpoint written or replayed
+  uint64_t checkpoint_seq_ = 0;
+  //! Number of coded states written into checkpoints
+  std::size_t checkpointed_codes_ = 0;
+
+  template <class ChainT>
+  friend class AsyncFeeder;
+
+  //! Whether states of the block get codes first_code, first_code + 1 and
+  //! so on: they have these codes already or they are coded next
+  bool ContinuesCoding(
+      const internal::DeltaBlock<StateT, CodeT> &block) const {
+    if constexpr (requires(const StateT &state) {
+                    state_coder_->Find(state);
+                  }) {
+      std::size_t next_code = state_coder_->Size();
+      for (std::size_t i = 0; i < block.states.size(); ++i) {
+        std::optional<CodeT> code = state_coder_->Find(block.states[i]);
+        uint64_t expected = block.first_code + i;
+        if (code ? static_cast<uint64_t>(*code) != expected
+                 : CoderPruned() || expected != next_code++) {
+          return false;
+        }
+      }
+    }
+    // otherwise states are codes
+    return true;
+  }
+
+  //! Whether block is of the chain memory size and its transitions are
+  //! within the chain: depths below memory size, codes below the number of
+  //! codes after states of block are coded, and counts of snapshot positive
+  bool ValidDeltas(const internal::DeltaBlock<StateT, CodeT> &block) const {
+    if (block.memory_size != GetMemorySize()) {
+      return false;
+    }
+    std::size_t num_codes = state_coder_->Size();
+    if constexpr (requires(const StateT &state) {
+                    state_coder_->Find(state);
+                  }) {
+      num_codes = std::max<std::size_t>(
+          num_codes, block.first_code + block.states.size());
+    } else {
+      // states are codes
+      for (const StateT &state : block.states) {
+        if (std::cmp_less(state, 0)) {
+          return false;
+        }
+        num_codes = std::max(num_codes, static_cast<std::size_t>(state) + 1);
+      }
+    }
+    auto is_code = [num_codes](CodeT code) {
+      return std::cmp_greater_equal(code, 0) && std::cmp_less(code, num_codes);
+    };
+    return std::ranges::all_of(
+        block.transitions,
+        [&](const internal::TransitionDelta<CodeT> &delta) {
+          return delta.depth >= 0 && delta.depth < GetMemorySize() &&
+                 is_code(delta.from) && is_code(delta.to) &&
+                 (!block.snapshot || delta.delta > 0);
+        });
+  }
+
+  //! Whether the coder was pruned, so states[0] is unknown
+  bool CoderPruned() const {
+    if constexpr (requires { state_coder_->Pruned(); }) {
+      return state_coder_->Pruned();
+    } else {
+      return false;
+    }
+  }
+
+  //! Code states not coded yet as unknown, states[0], like after Prune,
+  //! keeping codes of the replayed states
+  void MarkPruned(const std::vector<StateT> &states) {
+    if constexpr (requires(std::span<const CodeT> codes) {
+                    state_coder_->Prune(codes, states[0]);
+                  }) {
+      assert(!states.empty() && "Pruned snapshot holds the unknown state");
+      std::vector<CodeT> same_codes(state_coder_->Size());
+      std::iota(same_codes.begin(), same_codes.end(), CodeT{0});
+      state_coder_->Prune(same_codes, states[0]);
+    } else {
+      assert(false && "Pruned snapshot is replayed into chain without Prune");
+    }
+  }
+
+  static std::unique_ptr<internal::BaseChain<CodeT, RngT, MetricsT>>
+  MakeChain(int memorize_previous, uint64_t random_state,
+            std::pmr::memory_resource *resource) {
+    assert(memorize_previous >= 0);
+    if (memorize_previous == 0) {
+      return std::make_unique<internal::ForgorChain<CodeT, RngT, MetricsT>>(
+          random_state, resource);
+    }
+    return std::make_unique<internal::RemberChain<CodeT, RngT, MetricsT>>(
+        memorize_previous, random_state, resource);
+  }
+
+  //! Encode records given by read(is, memory_size, fn), that are valid
+  //! for the chain, and add them by batches
+  template <class ReadT>
+  std::size_t ImportCounts(std::istream &is, ReadT read) {
+    constexpr std::size_t kBatchSize = 1 << 16;
+    std::vector<internal::TransitionDelta<CodeT>> batch;
+    std::size_t records = read(
+        is, chain_->GetMemorySize(),
+        [this, &batch](const internal::StateCount<StateT> &record) {
+          CodeT from = state_coder_->Encode(record.from);
+          batch.push_back({from, record.depth,
+                           state_coder_->Encode(record.to), record.count});
+          if (batch.size() >= kBatchSize) {
+            chain_->AddTransitions(batch);
+            batch.clear();
+          }
+        });
+    chain_->AddTransitions(batch);
+    return records;
+  }
+
+  //! Frequency of each coded state: the number of transitions into it or
+  //! from it, whichever is larger. If successors is given, it gets the
+  //! most frequent subsequent state of each state, or the number of states
+  //! if there are no transitions from it
+  std::vector<int64_t> StateFrequencies(
+      std::vector<CodeT> *successors = nullptr) const {
+    std::size_t num_codes = state_coder_->Size();
+    std::vector<int64_t> frequency(num_codes), in(num_codes), best(num_codes);
+    if (successors != nullptr) {
+      successors->assign(num_codes, static_cast<CodeT>(num_codes));
+    }
+    std::vector<internal::TransitionDelta<CodeT>> counts;
+    chain_->CollectCounts(counts);
+    for (const internal::TransitionDelta<CodeT> &count : counts) {
+      if (count.depth != 0) {
+        continue;
+      }
+      frequency[count.from] += count.delta;
+      in[count.to] += count.delta;
+      if (successors != nullptr && count.delta > best[count.from]) {
+        best[count.from] = count.delta;
+        (*successors)[count.from] = count.to;
+      }
+    }
+    for (std::size_t code = 0; code < num_codes; ++code) {
+      frequency[code] = std::max(frequency[code], in[code]);
+    }
+    return frequency;
+  }
+
+  //! Add states coded since the last checkpoint into the block
+  template <class BlockT>
+  void AppendCodedStates(BlockT &block) {
+    block.first_code = checkpointed_codes_;
+    for (std::size_t code = checkpointed_codes_; code < state_coder_->Size();
+         ++code) {
+      block.states.push_back(state_coder_->Decode(static_cast<CodeT>(code)));
+    }
+    checkpointed_codes_ = state_coder_->Size();
+  }
+
+  //! Whether states are coded into themselves, so sequences of states
+  //! are fed as sequences of codes
+  static constexpr bool kStatesAreCodes =
+      std::is_same_v<StateT, CodeT> && requires { CoderT::kIdentity; };
+};
+
+
+
+/*!
+  \brief Feeds MarkovChain on two background threads
+
+  FeedSequence copies the sequence into a bounded lock-free queue and
+  returns. The encoding thread turns sequences into codes and passes them
+  through the second queue to the counting thread, which applies them to
+  the chain. So encoding and counting run simultaneously with each other
+  and with the caller. When queues are full, FeedSequence waits.
+
+  Sequences are encoded and counted in the order they are fed, so after
+  Flush the chain is the same as if it was fed synchronously. Until
+  Flush returns the chain must not be used otherwise.
+*/
+template <class ChainT>
+class AsyncFeeder {
+ public:
+  using StateT = typename ChainT::StateType;
+  using CodeT = typename ChainT::CodeType;
+
+  //! Start threads feeding the chain, each queue holds up to capacity
+  //! sequences
+  explicit AsyncFeeder(ChainT &chain, std::size_t capacity = 1024)
+      : chain_(chain), states_(capacity), codes_(capacity) {
+    encoder_ = std::thread([this] { EncodeLoop(); });
+    counter_ = std::thread([this] { CountLoop(); });
+  }
+
+  AsyncFeeder(const AsyncFeeder &) = delete;
+  AsyncFeeder &operator=(const AsyncFeeder &) = delete;
+
+  //! Apply all fed sequences and stop threads
+  ~AsyncFeeder() {
+    states_.Push({{}, false, true});
+    encoder_.join();
+    counter_.join();
+  }
+
+  //! Queue sequence to learn from, move to its last state if needed.
+  //! Waits while the queue is full
+  template <class IterT>
+    requires utils::is_iterator<IterT, StateT>
+  void FeedSequence(IterT it, IterT end, bool update_memory = false) {
+    states_.Push({std::vector<StateT>(it, end), update_memory, false});
+    fed_++;
+  }
+
+  //! Wait until all fed sequences are applied to the chain
+  void Flush() {
+    for (uint64_t applied = applied_.load(); applied != fed_;
+         applied = applied_.load()) {
+      applied_.wait(applied);
+    }
+  }
+
+ private:
+  template <class T>
+  struct Batch {
+    std::vector<T> values;
+    bool update_memory = false;
+    //! Marks the last batch, after which threads stop
+    bool stop = false;
+  };
+
+  ChainT &chain_;
+  internal::SpscQueue<Batch<StateT>> states_;
+  internal::SpscQueue<Batch<CodeT>> codes_;
+  std::thread encoder_, counter_;
+  //! Number of sequences fed, used only by the caller
+  uint64_t fed_ = 0;
+  //! Number of sequences applied to the chain
+  std::atomic<uint64_t> applied_ = 0;
+
+  void EncodeLoop() {
+    for (;;) {
+      Batch<StateT> batch = states_.Pop();
+      std::vector<CodeT> codes;
+      codes.reserve(batch.values.size());
+      for (const StateT &state : batch.values) {
+        codes.push_back(chain_.state_coder_->Encode(state));
+      }
+      codes_.Push({std::move(codes), batch.update_memory, batch.stop});
+      if (batch.stop) {
+        return;
+      }
+    }
+  }
+
+  void CountLoop() {
+    for (;;) {
+      Batch<CodeT> batch = codes_.Pop();
+      if (batch.stop) {
+        return;
+      }
+      chain_.chain_->FeedCodes(batch.values, batch.update_memory);
+      applied_.fetch_add(1);
+      applied_.notify_all();
+    }
+  }
 };
 
+
+
+/*!
+  \brief Checkpoints MarkovChain into snapshot and delta log files
+
+  Checkpoint appends changes since the previous one to the log file, and
+  every compact_every checkpoints writes the whole model into the snapshot
+  file instead and truncates the log. The snapshot is written into the
+  temporary file and renamed, so there is always the complete one. Blocks
+  of the log included in the snapshot are skipped on recovery, so the
+  crash before truncation doesn't count them twice.
+*/
+template <class ChainT>
+class CheckpointLog {
+ public:
+  CheckpointLog(ChainT &chain, std::filesystem::path snapshot_path,
+                std::filesystem::path log_path, int compact_every = 16)
+      : chain_(chain),
+        snapshot_path_(std::move(snapshot_path)),
+        log_path_(std::move(log_path)),
+        compact_every_(compact_every),
+        since_compaction_(compact_every - 1) {
+    assert(compact_every > 0);
+  }
+
+  //! Append changes into the log or compact them into the snapshot. The
+  //! chain is compacted as well when its checkpoint is the whole model,
+  //! like after Prune or Recode, so the log holds only deltas
+  void Checkpoint() {
+    if (since_compaction_ + 1 >= compact_every_ ||
+        chain_.NextCheckpointIsSnapshot()) {
+      Compact();
+      return;
+    }
+    std::ofstream log(log_path_, std::ios::binary | std::ios::app);
+    chain_.Checkpoint(log);
+    since_compaction_++;
+  }
+
+  //! Write the whole model into the snapshot and truncate the log
+  void Compact() {
+    std::filesystem::path temp_path = snapshot_path_;
+    temp_path += ".tmp";
+    {
+      std::ofstream snapshot(temp_path, std::ios::binary | std::ios::trunc);
+      chain_.Compact(snapshot);
+    }
+    std::filesystem::rename(temp_path, snapshot_path_);
+    std::ofstream(log_path_, std::ios::binary | std::ios::trunc);
+    since_compaction_ = 0;
+  }
+
+  //! Replay the snapshot and the tail of the log into the empty chain.
+  //! The block cut by crash is cut from the log, so checkpoints continue
+  //! after the last complete block. Returns number of applied blocks
+  std::size_t Recover() {
+    std::size_t applied = 0;
+    if (std::ifstream snapshot(snapshot_path_, std::ios::binary); snapshot) {
+      applied += chain_.Replay(snapshot);
+      since_compaction_ = 0;
+    }
+    if (std::ifstream log(log_path_, std::ios::binary); log) {
+      std::size_t tail = chain_.Replay(log);
+      applied += tail;
+      since_compaction_ += static_cast<int>(tail);
+      std::streampos end = log.tellg();
+      log.close();
+      std::filesystem::resize_file(log_path_, static_cast<uintmax_t>(end));
+    }
+    return applied;
+  }
+
+ private:
+  ChainT &chain_;
+  std::filesystem::path snapshot_path_, log_path_;
+  int compact_every_;
+  //! Number of blocks appended to the log since the last compaction
+  int since_compaction_;
+};
+
+
+
+/*!
+  \brief Trainer for corpora larger than memory
+
+  FeedSequence encodes states and emits transitions (source, depth,
+  target), that are spilled into sorted runs on disk each time they take
+  the memory budget. WriteModel merges the runs k-way, summing counts of
+  equal transitions, and streams them into the model file as snapshot
+  block, that MarkovChain::Replay or CheckpointLog::Recover loads. So the
+  peak memory is the budget and the coded states, not the model size.
+  Learns like MarkovChain::FeedSequence, sequences are independent.
+*/
+template <class StateT, class CodeT = int>
+  requires std::copy_constructible<StateT> && std::integral<CodeT> &&
+           internal::is_serializable_state<StateT>
+class OutOfCoreTrainer {
+ public:
+  using StateType = StateT;
+  using CodeType = CodeT;
+
+  //! Trainer tracking the given number of previous states, keeping runs
+  //! in run_dir, that must not be shared with other trainers
+  OutOfCoreTrainer(int memorize_previous, std::filesystem::path run_dir,
+                   std::size_t budget_bytes)
+      : memory_size_(1 + memorize_previous),
+        runs_(std::move(run_dir), budget_bytes) {
+    assert(memorize_previous >= 0);
+  }
+
+  //! Learn from sequence
+  template <class IterT>
+    requires utils::is_iterator<IterT, StateT>
+  void FeedSequence(IterT it, IterT end) {
+    std::deque<CodeT> last_states;
+    for (; it != end; ++it) {
+      CodeT code = state_coder_.Encode(*it);
+      for (int depth = 0; depth < static_cast<int>(last_states.size());
+           ++depth) {
+        runs_.Add({last_states[depth], depth, code, 1});
+      }
+      if (static_cast<int>(last_states.size()) >= memory_size_) {
+        last_states.pop_back();
+      }
+      last_states.push_front(code);
+    }
+  }
+
+  //! Number of runs spilled to disk so far
+  std::size_t NumRuns() const {
+    return runs_.NumRuns();
+  }
+
+  //! Merge the runs and write the model as snapshot block into stream,
+  //! that must be seekable, like std::ofstream. Runs are removed, so the
+  //! trainer learns from scratch after, but keeps the coded states
+  void WriteModel(std::ostream &os) {
+    internal::DeltaBlock<StateT, CodeT> block;
+    block.seq = 1;
+    block.snapshot = true;
+    block.memory_size = memory_size_;
+    for (std::size_t code = 0; code < state_coder_.Size(); ++code) {
+      block.states.push_back(state_coder_.Decode(static_cast<CodeT>(code)));
+    }
+    typename internal::DeltaLogFormat<StateT, CodeT>::BlockWriter writer(
+        os, block);
+    block.states = {};
+    runs_.Merge([&writer](const internal::TransitionDelta<CodeT> &count) {
+      writer.Append(count);
+    });
+    writer.Finish();
+  }
+
+ private:
+  int memory_size_;
+  internal::StateCoder<StateT, CodeT> state_coder_;
+  internal::SortedRuns<CodeT> runs_;
+};
+
+
+/*!
+  \brief Markov chain learning and serving predictions concurrently
+
+  Readers take the immutable version of the chain with Snapshot and
+  predict from it with their own memory and generator, never waiting
+  for the writer. The single writer learns with FeedSequence into the
+  private delta and makes it visible with Publish, that builds the next
+  version sharing unchanged rows with the current one and swaps it in
+  atomically. Old version is freed when the last reader releases it.
+  Writer's methods must be called from one thread at a time.
+*/
+template <class StateT, class CodeT = int>
+  requires std::copy_constructible<StateT> && std::integral<CodeT>
+class ServingChain {
+ public:
+  using StateType = StateT;
+  using CodeType = CodeT;
+  using Snapshot = internal::ChainSnapshot<StateT, CodeT>;
+
+  //! Instantiate chain tracking the given number of previous states
+  explicit ServingChain(int memorize_previous = 0)
+      : memory_size_(1 + memorize_previous),
+        current_(std::make_shared<const Snapshot>(1 + memorize_previous)) {
+    assert(memorize_previous >= 0);
+    deltas_.Enable();
+    published_.store(current_);
+  }
+
+  //! Learn from sequence, visible to readers after Publish. Writer only
+  template <class IterT>
+    requires utils::is_iterator<IterT, StateT>
+  void FeedSequence(IterT it, IterT end) {
+    std::deque<CodeT> last_states;
+    for (; it != end; ++it) {
+      CodeT code = state_coder_.Encode(*it);
+      for (int depth = 0; depth < static_cast<int>(last_states.size());
+           ++depth) {
+        deltas_.Record(last_states[depth], depth, code, 1);
+      }
+      if (static_cast<int>(last_states.size()) >= memory_size_) {
+        last_states.pop_back();
+      }
+      last_states.push_front(code);
+    }
+  }
+
+  //! Make everything learned since the previous call visible to readers.
+  //! Copies only the pages of changed rows and the changed rows, so it
+  //! costs the number of changes. Returns the published version. Writer
+  //! only
+  uint64_t Publish() {
+    std::vector<StateT> new_states;
+    for (std::size_t code = current_->NumStates();
+         code < state_coder_.Size(); ++code) {
+      new_states.push_back(state_coder_.Decode(static_cast<CodeT>(code)));
+    }
+    current_ = current_->Next(new_states, deltas_.Take());
+    published_.store(current_);
+    return current_->Version();
+  }
+
+  //! Get the last published version. Safe to call from any thread
+  std::shared_ptr<const Snapshot> GetSnapshot() const {
+    return published_.load();
+  }
+
+ private:
+  int memory_size_;
+  //! Writer's coder, snapshots get states coded since the last publish
+  internal::StateCoder<StateT, CodeT> state_coder_;
+  //! Transitions learned since the last publish
+  internal::DeltaRecorder<CodeT> deltas_;
+  //! Last published version, kept by writer to build the next one
+  std::shared_ptr<const Snapshot> current_;
+  //! Version taken by readers
+  std::atomic<std::shared_ptr<const Snapshot>> published_;
+};
+
+
+
+/*!
+  \brief Read-only chain keeping cold rows compressed
+
+  It's built from learned MarkovChain and predicts like ServingChain
+  snapshots, with memory and generator given by caller. Rows of counters
+  are varint-compressed, and the ones used for sampling are decompressed
+  into the cache bounded by cache_bytes, evicting the least recently used.
+  With skewed traffic hot rows stay decompressed, so resident model is
+  much smaller than the learned one at almost the same latency. Safe to
+  predict from any threads: the cache is split into shards by row, each
+  with its own lock, and rows are decompressed outside the lock, once
+  even if many threads miss the same row.
+*/
+template <class StateT, class CodeT = int>
+  requires std::copy_constructible<StateT> && std::integral<CodeT>
+class TieredChain {
+ public:
+  using StateType = StateT;
+  using CodeType = CodeT;
+
+  //! Build from learned chain with cache of given size in bytes
+  template <class ChainT>
+    requires std::same_as<typename ChainT::StateType, StateT> &&
+             std::same_as<typename ChainT::CodeType, CodeT>
+  TieredChain(const ChainT &chain, std::size_t cache_bytes)
+      : TieredChain(chain.GetMemorySize(), chain.Export(), cache_bytes) {
+  }
+
+  //! Build from snapshot block, like the one given by MarkovChain::Export
+  TieredChain(int memory_size, internal::DeltaBlock<StateT, CodeT> block,
+              std::size_t cache_bytes)
+      : rows_(memory_size, block.states.size(),
+              std::move(block.transitions), cache_bytes) {
+    for (const StateT &state : block.states) {
+      state_coder_.Encode(state);
+    }
+  }
+
+  int GetMemorySize() const {
+    return rows_.GetMemorySize();
+  }
+
+  //! Number of coded states, codes are in [0, NumStates())
+  std::size_t NumStates() const {
+    return state_coder_.Size();
+  }
+
+  //! Code of the state, nullopt if it wasn't learned
+  std::optional<CodeT> Find(const StateT &state) const {
+    return state_coder_.Find(state);
+  }
+
+  StateT Decode(CodeT code) const {
+    return state_coder_.Decode(code);
+  }
+
+  //! Sample the subsequent state after remembered ones, where memory[0]
+  //! is the last one. Nullopt if there are no transitions
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  std::optional<CodeT> PredictCode(std::span<const CodeT> memory,
+                                   RngT &rng) const {
+    return rows_.PredictCode(memory, rng);
+  }
+
+  //! Sample the subsequent state after remembered states, see PredictCode.
+  //! Unknown states have no transitions
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  std::optional<StateT> PredictState(std::span<const StateT> memory,
+                                     RngT &rng) const {
+    std::vector<CodeT> codes;
+    for (const StateT &state : memory.first(std::min<std::size_t>(
+             memory.size(), GetMemorySize()))) {
+      codes.push_back(Find(state).value_or(static_cast<CodeT>(NumStates())));
+    }
+    std::optional<CodeT> code = PredictCode<RngT>(codes, rng);
+    return code ? std::optional<StateT>(Decode(*code)) : std::nullopt;
+  }
+
+  //! Hits, misses and bytes of the cache of decompressed rows
+  internal::CacheStats GetCacheStats() const {
+    return rows_.GetCacheStats();
+  }
+
+  //! Bytes taken by coder and compressed rows, the cache takes at most
+  //! its capacity besides
+  std::size_t MemoryUsage() const {
+    return state_coder_.MemoryUsage() + rows_.MemoryUsage();
+  }
+
+ private:
+  internal::StateCoder<StateT, CodeT> state_coder_;
+  internal::TieredRows<CodeT> rows_;
+};
+
+
+/*!
+  \brief Read-only chain with counts quantized to 8 bits for serving
+
+  Built from learned chain, it keeps for each row only the targets with
+  non-zero counts, coded as varint gaps, and 8-bit levels of counts, that
+  are exact up to 255 and log-scale above, see QuantizedRows. That's a few
+  bytes per transition instead of 8 bytes for each state up to the last
+  target in the Fenwick tree, so many more models fit into memory, while
+  sampling distribution drifts slightly. KlDivergence measures the drift.
+  Thread-safe for reading.
+*/
+template <class StateT, class CodeT = int>
+  requires std::copy_constructible<StateT> && std::integral<CodeT>
+class QuantizedChain {
+ public:
+  using StateType = StateT;
+  using CodeType = CodeT;
+
+  //! Build from learned chain
+  template <class ChainT>
+    requires std::same_as<typename ChainT::StateType, StateT> &&
+             std::same_as<typename ChainT::CodeType, CodeT>
+  explicit QuantizedChain(const ChainT &chain)
+      : QuantizedChain(chain.GetMemorySize(), chain.Export()) {
+  }
+
+  //! Build from snapshot block, like the one given by MarkovChain::Export
+  QuantizedChain(int memory_size, internal::DeltaBlock<StateT, CodeT> block)
+      : rows_(memory_size, block.states.size(),
+              std::move(block.transitions)) {
+    for (const StateT &state : block.states) {
+      state_coder_.Encode(state);
+    }
+  }
+
+  int GetMemorySize() const {
+    return rows_.GetMemorySize();
+  }
+
+  //! Number of coded states, codes are in [0, NumStates())
+  std::size_t NumStates() const {
+    return state_coder_.Size();
+  }
+
+  //! Code of the state, nullopt if it wasn't learned
+  std::optional<CodeT> Find(const StateT &state) const {
+    return state_coder_.Find(state);
+  }
+
+  StateT Decode(CodeT code) const {
+    return state_coder_.Decode(code);
+  }
+
+  //! Sample the subsequent state after remembered ones, where memory[0]
+  //! is the last one. Nullopt if there are no transitions
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  std::optional<CodeT> PredictCode(std::span<const CodeT> memory,
+                                   RngT &rng) const {
+    return rows_.PredictCode(memory, rng);
+  }
+
+  //! Sample the subsequent state after remembered states, see PredictCode.
+  //! Unknown states have no transitions
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  std::optional<StateT> PredictState(std::span<const StateT> memory,
+                                     RngT &rng) const {
+    std::vector<CodeT> codes;
+    for (const StateT &state : memory.first(std::min<std::size_t>(
+             memory.size(), GetMemorySize()))) {
+      codes.push_back(Find(state).value_or(static_cast<CodeT>(NumStates())));
+    }
+    std::optional<CodeT> code = PredictCode<RngT>(codes, rng);
+    return code ? std::optional<StateT>(Decode(*code)) : std::nullopt;
+  }
+
+  //! Kullback-Leibler divergence of the quantized distributions from the
+  //! exact ones of the chain this one was built from, in nats per learned
+  //! transition. The chain must not have learned anything since
+  template <class ChainT>
+    requires std::same_as<typename ChainT::StateType, StateT> &&
+             std::same_as<typename ChainT::CodeType, CodeT>
+  double KlDivergence(const ChainT &chain) const {
+    return rows_.KlDivergence(chain.Export().transitions);
+  }
+
+  //! Bytes taken by coder and quantized rows
+  std::size_t MemoryUsage() const {
+    return state_coder_.MemoryUsage() + rows_.MemoryUsage();
+  }
+
+ private:
+  internal::StateCoder<StateT, CodeT> state_coder_;
+  internal::QuantizedRows<CodeT> rows_;
+};
+
+
+/*!
+  \brief Markov chain factorized through classes of states for huge
+  vocabularies
+
+  States are grouped into classes, and the chain counts transitions from
+  remembered states into classes and how often each state of a class
+  comes, see ClassCounters. Predicting samples the class given memory,
+  then the state given the class, so the state within the class doesn't
+  depend on memory. With about sqrt(V) classes both memory and work per
+  prediction are about O(sqrt(V)) instead of O(V). Classes are given as
+  map from state, like the frequency bins of FrequencyClasses, states
+  missing in it are spread over classes in order of appearance.
+*/
+template <class StateT, class CodeT = int>
+  requires std::copy_constructible<StateT> && std::integral<CodeT>
+class FactorizedChain {
+ public:
+  using StateType = StateT;
+  using CodeType = CodeT;
+  using ClassMap = std::unordered_map<StateT, CodeT>;
+
+  //! Instantiate chain tracking the given number of previous states with
+  //! states in num_classes classes, classes in map must be less
+  FactorizedChain(int memorize_previous, std::size_t num_classes,
+                  ClassMap classes = {})
+      : num_classes_(num_classes),
+        classes_(std::move(classes)),
+        counters_(1 + memorize_previous) {
+    assert(memorize_previous >= 0 && num_classes > 0);
+  }
+
+  //! Classes of states as frequency bins: states ordered by descending
+  //! frequency in the sample are split into num_classes bins of about
+  //! equal total frequency, so frequent states take small classes
+  template <class IterT>
+    requires utils::is_iterator<IterT, StateT>
+  static ClassMap FrequencyClasses(IterT it, IterT end,
+                                   std::size_t num_classes) {
+    std::vector<std::pair<StateT, int64_t>> frequencies;
+    std::unordered_map<StateT, std::size_t> index;
+    int64_t total = 0;
+    for (; it != end; ++it, ++total) {
+      auto [pos, added] = index.try_emplace(*it, frequencies.size());
+      if (added) {
+        frequencies.emplace_back(*it, 0);
+      }
+      frequencies[pos->second].second++;
+    }
+    std::stable_sort(frequencies.begin(), frequencies.end(),
+                     [](const auto &lhs, const auto &rhs) {
+                       return lhs.second > rhs.second;
+                     });
+    ClassMap classes;
+    int64_t before = 0;
+    for (const auto &[state, frequency] : frequencies) {
+      auto cls = static_cast<std::size_t>(
+          static_cast<__int128>(before) * num_classes / total);
+      classes.emplace(state, static_cast<CodeT>(cls));
+      before += frequency;
+    }
+    return classes;
+  }
+
+  //! Learn from sequence
+  template <class IterT>
+    requires utils::is_iterator<IterT, StateT>
+  void FeedSequence(IterT it, IterT end) {
+    std::deque<CodeT> last_states;
+    for (; it != end; ++it) {
+      CodeT code = Encode(*it);
+      if (!last_states.empty()) {
+        counters_.CountState(code, 1);
+      }
+      for (int depth = 0; depth < static_cast<int>(last_states.size());
+           ++depth) {
+        counters_.CountTransition(last_states[depth], depth, code, 1);
+      }
+      if (static_cast<int>(last_states.size()) >= GetMemorySize()) {
+        last_states.pop_back();
+      }
+      last_states.push_front(code);
+    }
+  }
+
+  int GetMemorySize() const {
+    return counters_.GetMemorySize();
+  }
+
+  //! Number of coded states, codes are in [0, NumStates())
+  std::size_t NumStates() const {
+    return state_coder_.Size();
+  }
+
+  std::size_t NumClasses() const {
+    return num_classes_;
+  }
+
+  //! Code of the state, nullopt if it wasn't learned
+  std::optional<CodeT> Find(const StateT &state) const {
+    return state_coder_.Find(state);
+  }
+
+  StateT Decode(CodeT code) const {
+    return state_coder_.Decode(code);
+  }
+
+  //! Class of the learned state
+  CodeT ClassOf(CodeT code) const {
+    return counters_.ClassOf(code);
+  }
+
+  //! Sample the subsequent state after remembered ones, where memory[0]
+  //! is the last one. Nullopt if there are no transitions
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  std::optional<CodeT> PredictCode(std::span<const CodeT> memory,
+                                   RngT &rng) const {
+    return counters_.PredictCode(memory, rng);
+  }
+
+  //! Sample the subsequent state after remembered states, see PredictCode.
+  //! Unknown states have no transitions
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  std::optional<StateT> PredictState(std::span<const StateT> memory,
+                                     RngT &rng) const {
+    std::vector<CodeT> codes;
+    for (const StateT &state : memory.first(std::min<std::size_t>(
+             memory.size(), GetMemorySize()))) {
+      codes.push_back(Find(state).value_or(static_cast<CodeT>(NumStates())));
+    }
+    std::optional<CodeT> code = PredictCode<RngT>(codes, rng);
+    return code ? std::optional<StateT>(Decode(*code)) : std::nullopt;
+  }
+
+  //! Bytes taken by coder and counters
+  std::size_t MemoryUsage() const {
+    return state_coder_.MemoryUsage() + counters_.MemoryUsage();
+  }
+
+ private:
+  std::size_t num_classes_;
+  ClassMap classes_;
+  internal::StateCoder<StateT, CodeT> state_coder_;
+  internal::ClassCounters<CodeT> counters_;
+
+  //! Code the state, putting the new one into its class
+  CodeT Encode(const StateT &state) {
+    std::size_t size = state_coder_.Size();
+    CodeT code = state_coder_.Encode(state);
+    if (static_cast<std::size_t>(code) == size) {
+      auto it = classes_.find(state);
+      CodeT cls = it != classes_.end()
+                      ? it->second
+                      : static_cast<CodeT>(size % num_classes_);
+      assert(static_cast<std::size_t>(cls) < num_classes_);
+      counters_.AddState(code, cls);
+    }
+    return code;
+  }
+};
+
+
+/*!
+  \brief Read-only chain frozen into constexpr arrays
+
+  It's the model generated as C++ header by WriteFrozenHeader for small
+  stable chains, like protocol state machines or fixed grammars: states,
+  their codes in ascending order of states to find codes by binary
+  search, and FrozenRows of transition counts. Strings are stored as
+  std::string_view of literals. The whole model is an object of literal
+  type with sizes in its type, so it's built by the compiler, nothing is
+  loaded or allocated at runtime, it's shared by processes as read-only
+  data, and all the methods may be called in constant expressions.
+*/
+template <class StateT, class CodeT, int kMemorySize, std::size_t kNumStates,
+          std::size_t kNumEntries>
+  requires std::integral<CodeT> && (kMemorySize > 0)
+class FrozenChain {
+ public:
+  using StateType = StateT;
+  using CodeType = CodeT;
+  using Rows =
+      internal::FrozenRows<CodeT, kMemorySize, kNumStates, kNumEntries>;
+
+  //! Build from states by codes, codes ordered by their states and rows
+  constexpr FrozenChain(std::array<StateT, kNumStates> states,
+                        std::array<CodeT, kNumStates> sorted_codes, Rows rows)
+      : states_(states), sorted_codes_(sorted_codes), rows_(rows) {
+  }
+
+  static constexpr int GetMemorySize() {
+    return kMemorySize;
+  }
+
+  //! Number of coded states, codes are in [0, NumStates())
+  static constexpr std::size_t NumStates() {
+    return kNumStates;
+  }
+
+  //! Code of the state, nullopt if it wasn't learned
+  constexpr std::optional<CodeT> Find(const StateT &state) const {
+    auto it = std::lower_bound(
+        sorted_codes_.begin(), sorted_codes_.end(), state,
+        [this](CodeT code, const StateT &state) {
+          return states_[code] < state;
+        });
+    return it != sorted_codes_.end() && states_[*it] == state
+               ? std::optional<CodeT>(*it)
+               : std::nullopt;
+  }
+
+  constexpr StateT Decode(CodeT code) const {
+    return states_[code];
+  }
+
+  //! Sample the subsequent state after remembered ones, where memory[0]
+  //! is the last one. Nullopt if there are no transitions
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  constexpr std::optional<CodeT> PredictCode(std::span<const CodeT> memory,
+                                             RngT &rng) const {
+    return rows_.PredictCode(memory, rng);
+  }
+
+  //! Sample the subsequent state after remembered states, see PredictCode.
+  //! Unknown states have no transitions
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  constexpr std::optional<StateT> PredictState(std::span<const StateT> memory,
+                                               RngT &rng) const {
+    std::array<CodeT, kMemorySize> codes{};
+    std::size_t size = std::min<std::size_t>(memory.size(), kMemorySize);
+    for (std::size_t i = 0; i < size; ++i) {
+      codes[i] = Find(memory[i]).value_or(static_cast<CodeT>(kNumStates));
+    }
+    std::optional<CodeT> code =
+        PredictCode<RngT>(std::span<const CodeT>(codes.data(), size), rng);
+    return code ? std::optional<StateT>(Decode(*code)) : std::nullopt;
+  }
+
+  //! Bytes taken by the model, besides literals of string states
+  static constexpr std::size_t MemoryUsage() {
+    return sizeof(FrozenChain);
+  }
+
+ private:
+  std::array<StateT, kNumStates> states_;
+  std::array<CodeT, kNumStates> sorted_codes_;
+  Rows rows_;
+};
+
+
+namespace internal {
+
+//! Write values as braced list starting at column indent and wrapped
+//! to fit into 80 columns
+template <class T, class WriteT>
+void WriteBracedList(std::ostream &os, std::span<const T> values,
+                     std::size_t indent, WriteT write) {
+  constexpr std::size_t kWidth = 78;
+  std::size_t column = indent + 1;
+  os << '{';
+  for (std::size_t i = 0; i < values.size(); ++i) {
+    std::ostringstream value;
+    write(value, values[i]);
+    std::string text = value.str();
+    if (i > 0 && column + 2 + text.size() > kWidth) {
+      os << ",\n" << std::string(indent + 1, ' ');
+      column = indent + 1;
+    } else if (i > 0) {
+      os << ", ";
+      column += 2;
+    }
+    os << text;
+    column += text.size();
+  }
+  os << '}';
+}
+
+}  // namespace internal
+
+
+//! Write snapshot block, like the one given by MarkovChain::Export, as C++
+//! header defining inline constexpr FrozenChain named name, the generated
+//! header includes the library as include
+template <class StateT, class CodeT>
+  requires internal::is_freezable_state<StateT>
+void WriteFrozenHeader(std::ostream &os, int memory_size,
+                       internal::DeltaBlock<StateT, CodeT> block,
+                       std::string_view name,
+                       std::string_view include = "src/evolv.h") {
+  using Frozen = internal::FrozenState<StateT>;
+  std::size_t num_states = block.states.size();
+  std::vector<internal::TransitionDelta<CodeT>> &counts = block.transitions;
+  internal::MergeDeltas(counts);
+  std::erase_if(counts, [](const internal::TransitionDelta<CodeT> &count) {
+    return count.delta <= 0;
+  });
+
+  // counts are ordered by source state and depth like rows are
+  std::vector<uint32_t> entry_begin(num_states * memory_size + 1, 0);
+  std::vector<CodeT> targets;
+  std::vector<int64_t> prefix_sums;
+  for (const internal::TransitionDelta<CodeT> &count : counts) {
+    std::size_t row =
+        static_cast<std::size_t>(count.from) * memory_size + count.depth;
+    entry_begin[row + 1]++;
+    bool same_row = !targets.empty() && entry_begin[row + 1] > 1;
+    targets.push_back(count.to);
+    prefix_sums.push_back(count.delta + (same_row ? prefix_sums.back() : 0));
+  }
+  for (std::size_t row = 0; row + 1 < entry_begin.size(); ++row) {
+    entry_begin[row + 1] += entry_begin[row];
+  }
+  std::vector<CodeT> sorted_codes(num_states);
+  for (std::size_t code = 0; code < num_states; ++code) {
+    sorted_codes[code] = static_cast<CodeT>(code);
+  }
+  std::sort(sorted_codes.begin(), sorted_codes.end(),
+            [&block](CodeT lhs, CodeT rhs) {
+              return block.states[lhs] < block.states[rhs];
+            });
+
+  auto write_code = [](std::ostream &os, CodeT code) {
+    internal::FrozenState<CodeT>::Write(os, code);
+  };
+  auto write_number = [](std::ostream &os, auto value) { os << value; };
+  os << "// Generated by evolv::WriteFrozenHeader, do not edit\n"
+     << "#pragma once\n\n"
+     << "#include \"" << include << "\"\n\n"
+     << "inline constexpr evolv::FrozenChain<" << Frozen::TypeName() << ", "
+     << internal::IntegralTypeName<CodeT>() << ", " << memory_size << ", "
+     << num_states << ", " << targets.size() << ">\n"
+     << "    " << name << "(\n"
+     << "        // states by codes\n"
+     << "        ";
+  internal::WriteBracedList(
+      os, std::span<const StateT>(block.states), 8,
+      [](std::ostream &os, const StateT &state) { Frozen::Write(os, state); });
+  os << ",\n        // codes ordered by states\n"
+     << "        ";
+  internal::WriteBracedList(os, std::span<const CodeT>(sorted_codes), 8,
+                            write_code);
+  os << ",\n        // first entries of rows, targets and prefix sums\n"
+     << "        {";
+  internal::WriteBracedList(os, std::span<const uint32_t>(entry_begin), 9,
+                            write_number);
+  os << ",\n         ";
+  internal::WriteBracedList(os, std::span<const CodeT>(targets), 9,
+                            write_code);
+  os << ",\n         ";
+  internal::WriteBracedList(os, std::span<const int64_t>(prefix_sums), 9,
+                            write_number);
+  os << "});\n";
+}
+
+//! Write learned chain as C++ header, see WriteFrozenHeader of block
+template <class ChainT>
+  requires internal::is_freezable_state<typename ChainT::StateType>
+void WriteFrozenHeader(std::ostream &os, const ChainT &chain,
+                       std::string_view name,
+                       std::string_view include = "src/evolv.h") {
+  WriteFrozenHeader(os, chain.GetMemorySize(), chain.Export(), name,
+                    include);
+}
+
+
+/*!
+  \brief Registry of many chains over one shared vocabulary
+
+  Chains of tenants, like per-customer models over the same events, are
+  created on first access by key and share internal::SharedStateCoder,
+  so states and their hash table are stored once and each chain takes
+  only its transition counters and memory. Registry may be used from many
+  threads at once, as may different chains, while each chain is used by
+  one thread at a time like MarkovChain. Chains are held by shared_ptr,
+  so the erased one lives while it's used.
+*/
+template <class StateT, class CodeT = int, class KeyT = std::string>
+  requires std::copy_constructible<StateT> && std::integral<CodeT>
+class ChainRegistry {
+ public:
+  using Vocabulary = internal::SharedStateCoder<StateT, CodeT>;
+  using Chain = MarkovChain<StateT, CodeT, internal::Xoshiro256pp,
+                            internal::NoMetrics, Vocabulary>;
+
+  //! Instantiate registry of chains tracking the given number of previous
+  //! states, each seeded differently from random_state
+  ChainRegistry(int memorize_previous, uint64_t random_state,
+                std::shared_ptr<Vocabulary> vocabulary =
+                    std::make_shared<Vocabulary>())
+      : memorize_previous_(memorize_previous),
+        random_state_(random_state),
+        vocabulary_(std::move(vocabulary)) {
+    assert(memorize_previous >= 0 && vocabulary_ != nullptr);
+  }
+
+  //! Chain of the key, created empty if there is none
+  std::shared_ptr<Chain> Get(const KeyT &key) {
+    if (std::shared_ptr<Chain> chain = Find(key)) {
+      return chain;
+    }
+    std::unique_lock lock(mutex_);
+    auto [it, added] = chains_.try_emplace(key);
+    if (added) {
+      it->second = std::make_shared<Chain>(
+          memorize_previous_, random_state_ + created_++, vocabulary_);
+    }
+    return it->second;
+  }
+
+  //! Chain of the key, nullptr if there is none
+  std::shared_ptr<Chain> Find(const KeyT &key) const {
+    std::shared_lock lock(mutex_);
+    auto it = chains_.find(key);
+    return it == chains_.end() ? nullptr : it->second;
+  }
+
+  //! Drop chain of the key, return whether there was one. States it
+  //! learned stay in the vocabulary
+  bool Erase(const KeyT &key) {
+    std::unique_lock lock(mutex_);
+    return chains_.erase(key) > 0;
+  }
+
+  //! Number of chains
+  std::size_t Size() const {
+    std::shared_lock lock(mutex_);
+    return chains_.size();
+  }
+
+  const std::shared_ptr<Vocabulary> &GetVocabulary() const {
+    return vocabulary_;
+  }
+
+  //! Bytes taken by the vocabulary, counted once, and by counters and
+  //! memory of all the chains, while chains aren't changed
+  internal::MemoryReport MemoryUsage() const {
+    std::shared_lock lock(mutex_);
+    internal::MemoryReport report;
+    report.coder = vocabulary_->MemoryUsage();
+    for (const auto &[key, chain] : chains_) {
+      internal::MemoryReport bytes = chain->MemoryUsage();
+      report.counters += bytes.counters;
+      report.memory += bytes.memory;
+    }
+    return report;
+  }
+
+ private:
+  int memorize_previous_;
+  uint64_t random_state_;
+  std::shared_ptr<Vocabulary> vocabulary_;
+  std::unordered_map<KeyT, std::shared_ptr<Chain>> chains_;
+  //! Number of chains created, that seeds the next one
+  uint64_t created_ = 0;
+  //! Guards chains_ and created_
+  mutable std::shared_mutex mutex_;
+};
+
+}  // namespace evolv
+
+
+#ifdef EVOLV_PRECOMPILED
+// Common instantiations are compiled once into libevolv (src/evolv.cc),
+// EVOLV_PRECOMPILED is defined when linking against it. Other types are
+// instantiated from headers as usual
+namespace evolv {
+
+extern template class MarkovChain<int>;
+extern template class MarkovChain<int64_t>;
+extern template class MarkovChain<std::string>;
+
+namespace internal {
+
+extern template class FenwickTree<int64_t, int>;
+extern template class ForgorChain<int>;
+extern template class RemberChain<int>;
+extern template class StateCoder<int, int>;
+extern template class StateCoder<int64_t, int>;
+extern template class StateCoder<std::string, int>;
+
+}  // namespace internal
+
 }  // namespace evolv
+#endif
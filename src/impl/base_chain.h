@@ -1,13 +1,27 @@
 #pragma once
 
-#include <chrono>
+#include <algorithm>
+#include <array>
+#include <cassert>
 #include <concepts>
+#include <cstddef>
+#include <cstdint>
 #include <deque>
-#include <random>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
 #include <vector>
 
+#include "delta_log.h"
 #include "encoding_iter.h"
+#include "generator.h"
+#include "memory_usage.h"
+#include "metrics.h"
+#include "random.h"
+#include "simulator.h"
 #include "src/impl/fenwick_tree.h"
+#include "utils.h"
 
 
 //! Namespace to keep all implementations hidden
@@ -19,15 +33,27 @@ namespace evolv::internal {
   This is the abstract class, MarkovChain stores it's instance
   as chain implementation. Both Forgor and Rember chains inherits it. This
   operates on sequences encoded by StateCoder, which are always integral.
+  Random generator RngT is used in predicting, it's seeded with full 64 bits.
+  MetricsT is either NoMetrics or Metrics, see metrics.h.
 */
-template <class CodeT>
-  requires std::integral<CodeT>
+template <class CodeT, class RngT = Xoshiro256pp,
+          class MetricsT = NoMetrics>
+  requires std::integral<CodeT> && utils::is_random_generator<RngT>
 class BaseChain {
  public:
-  BaseChain(int memory_size, int random_state)
+  BaseChain(int memory_size, uint64_t random_state)
       : memory_size_(memory_size), rng_(random_state) {
   }
 
+  //! Get metrics, that are collected only if MetricsT is Metrics
+  MetricsT &GetMetrics() {
+    return metrics_;
+  }
+
+  const MetricsT &GetMetrics() const {
+    return metrics_;
+  }
+
   int GetMemorySize() const {
     return memory_size_;
   }
@@ -58,26 +84,266 @@ class BaseChain {
     }
   }
 
+  //! Start recording transition deltas for checkpoints
+  void EnableDeltas() {
+    deltas_.Enable();
+  }
+
+  bool DeltasEnabled() const {
+    return deltas_.Enabled();
+  }
+
+  //! Take transition deltas recorded since the previous call
+  std::vector<TransitionDelta<CodeT>> TakeDeltas() {
+    return deltas_.Take();
+  }
+
+  //! Map codes in counters and memory, new_codes[code] is the new code of
+  //! code. Transitions mapped into the same one are merged. Recording of
+  //! deltas stops, as they refer to old codes
+  void Recode(std::span<const CodeT> new_codes) {
+    std::vector<TransitionDelta<CodeT>> counts;
+    CollectCounts(counts);
+    for (TransitionDelta<CodeT> &count : counts) {
+      count.from = new_codes[count.from];
+      count.to = new_codes[count.to];
+    }
+    MergeDeltas(counts);
+    ClearCounts();
+    ApplyDeltas(counts);
+    for (CodeT &code : memory_) {
+      code = new_codes[code];
+    }
+    deltas_.Reset();
+  }
+
+  //! Add transition counts, like ApplyDeltas, but recording them for
+  //! checkpoints. Depth must be less than the memory size
+  void AddTransitions(std::span<const TransitionDelta<CodeT>> transitions) {
+    ApplyDeltas(transitions);
+    for (const TransitionDelta<CodeT> &transition : transitions) {
+      assert(transition.depth < memory_size_ && "Depth beyond memory size");
+      deltas_.Record(transition.from, transition.depth, transition.to,
+                     transition.delta);
+    }
+  }
+
   virtual ~BaseChain() = default;
 
   //! Learn from sequence and move to last state in sequence if needed or if
-  //! there is no memory
+  //! there is no memory. Each transition is counted weight times
   virtual void FeedSequence(EncodingIter<CodeT> it, EncodingIter<CodeT> end,
-                            bool update_memory = false) = 0;
+                            bool update_memory = false,
+                            int64_t weight = 1) = 0;
+
+  //! Learn from sequence of codes, bypassing encoding
+  virtual void FeedCodes(std::span<const CodeT> codes,
+                         bool update_memory = false, int64_t weight = 1) = 0;
+
+  //! Learn from sequence of codes like FeedCodes, but it may be called from
+  //! many threads at once, while other methods aren't called. The first
+  //! context codes are only remembered, transitions into them aren't
+  //! counted, so a long sequence may be fed by windows overlapping by
+  //! memory size. Memory isn't updated
+  virtual void FeedCodesConcurrent(std::span<const CodeT> codes,
+                                   std::size_t context = 0) = 0;
 
   //! Predict the subsequent state based on current state and possibly memory,
   //! move to predicted state if needed
   virtual CodeT PredictState(bool update_memory = false) = 0;
 
+  //! Predict like PredictState, but nullopt if there are no transitions
+  virtual std::optional<CodeT> TryPredictState(bool update_memory = false) = 0;
+
+  //! Append k samples of the subsequent state drawn independently from
+  //! current memory, in order of codes, without moving. False with none
+  //! appended if there are no transitions
+  virtual bool PredictStates(std::size_t k, std::vector<CodeT> &out) = 0;
+
+  //! Lazily predict subsequent states moving to each of them, the loop runs
+  //! inside implementation without virtual call per state
+  virtual Generator<CodeT> WalkCodes() = 0;
+
+  //! Step independent walkers from given states for given number of steps
+  //! without touching memory, add visit statistics of states with codes in
+  //! [0, num_codes) into counts. Runs on given number of threads
+  virtual void Simulate(std::span<const CodeT> starts, int steps,
+                        std::span<const CodeT> targets, std::size_t num_codes,
+                        SimulationCounts &counts, int threads) = 0;
+
+  //! Fill number of rows, transitions and bytes taken by counters and memory
+  virtual void FillStats(ChainStats &stats) const = 0;
+
+  //! Give back storage exceeding the size of counters and memory
+  virtual void ShrinkToFit() = 0;
+
+  //! Add deltas to transition counts, like replayed from the log. They
+  //! aren't recorded again
+  virtual void ApplyDeltas(std::span<const TransitionDelta<CodeT>> deltas) = 0;
+
+  //! Append all non-zero transition counts as deltas from the empty chain
+  virtual void CollectCounts(
+      std::vector<TransitionDelta<CodeT>> &counts) const = 0;
+
+  //! Drop all transition counts
+  virtual void ClearCounts() = 0;
+
  protected:
   using CountT = int64_t;
+  //! Number of stripes of row locks in FeedCodesConcurrent
+  static constexpr std::size_t kRowStripes = 64;
   using FenwickCounter = FenwickTree<CountT, CodeT>;
 
   int memory_size_;
   // Last states where the chain ends
   std::deque<CodeT> memory_;
   // Random number generator, used in predicting next state
-  mutable std::mt19937_64 rng_;
+  mutable RngT rng_;
+  // Either collects metrics or does nothing
+  [[no_unique_address]] MetricsT metrics_;
+  // Transition deltas since the last checkpoint, if recording is on
+  DeltaRecorder<CodeT> deltas_;
+  // Guards the table of rows in FeedCodesConcurrent: held shared while
+  // counting, exclusively while the table grows
+  std::shared_mutex counters_mutex_;
+  // Guard rows in FeedCodesConcurrent, row of state from is guarded by
+  // row_mutexes_[from % kRowStripes]: held shared while counting into
+  // it, exclusively while it's created or grows
+  std::array<std::shared_mutex, kRowStripes> row_mutexes_;
+  // Guards deltas_ and metrics_ in FeedCodesConcurrent
+  std::mutex deltas_mutex_;
+  // Uniforms drawn in PredictStates and their buckets, kept to reuse
+  // the storage
+  std::vector<CountT> uniforms_;
+  std::vector<std::size_t> buckets_;
+
+  //! Draw k uniforms below total in sorted order, so they are resolved
+  //! into states in one pass over counters. They are spread into k
+  //! buckets by value and insertion sorted, that takes O(k) on average.
+  //! If total isn't above k, each value is its own bucket, so counting
+  //! sort leaves nothing to insertion sort
+  std::span<const CountT> DrawSortedUniforms(std::size_t k, CountT total) {
+    bool by_value = static_cast<uint64_t>(total) <= k;
+    std::size_t num_buckets = by_value ? static_cast<std::size_t>(total) : k;
+    // otherwise bucket of x is floor(x * scale / 2^64), that is monotone
+    // and below k, and scale fits as k < total
+    auto scale =
+        by_value ? 0
+                 : static_cast<uint64_t>((static_cast<__uint128_t>(k) << 64) /
+                                         static_cast<uint64_t>(total));
+    auto bucket = [by_value, scale](CountT x) {
+      return by_value ? static_cast<std::size_t>(x)
+                      : static_cast<std::size_t>(
+                            (static_cast<__uint128_t>(x) * scale) >> 64);
+    };
+    uniforms_.resize(2 * k);
+    buckets_.assign(num_buckets + 1, 0);
+    std::span<CountT> drawn(uniforms_.data() + k, k);
+    for (CountT &x : drawn) {
+      x = static_cast<CountT>(UniformBelow(rng_, total));
+      buckets_[bucket(x) + 1]++;
+    }
+    for (std::size_t i = 1; i <= num_buckets; ++i) {
+      buckets_[i] += buckets_[i - 1];
+    }
+    std::span<CountT> sorted(uniforms_.data(), k);
+    for (CountT x : drawn) {
+      sorted[buckets_[bucket(x)]++] = x;
+    }
+    if (by_value) {
+      return sorted;
+    }
+    for (std::size_t i = 1; i < k; ++i) {
+      CountT x = sorted[i];
+      std::size_t j = i;
+      for (; j > 0 && sorted[j - 1] > x; --j) {
+        sorted[j] = sorted[j - 1];
+      }
+      sorted[j] = x;
+    }
+    return sorted;
+  }
+
+  //! Count transitions of one sequence from many threads at once. They're
+  //! merged, so each distinct one is counted once, and grouped by the
+  //! source state. The table of rows is taken exclusively only if it has
+  //! less than num_rows(), then reserve(rows) grows it to hold at least
+  //! the given number of rows. Rows of each source state are locked by
+  //! their stripe: rows that exist and are large enough are incremented
+  //! by try_add with atomics under the shared lock, the rest are counted
+  //! by add under the exclusive lock, it's rare after the warm-up
+  template <class NumRowsT, class ReserveT, class TryAddT, class AddT>
+  void CountConcurrent(std::vector<TransitionDelta<CodeT>> &transitions,
+                       NumRowsT num_rows, ReserveT reserve, TryAddT try_add,
+                       AddT add) {
+    MergeDeltas(transitions);
+    if (transitions.empty()) {
+      return;
+    }
+    // transitions are ordered by the source state
+    auto rows = static_cast<std::size_t>(transitions.back().from) + 1;
+    std::shared_lock table_lock(counters_mutex_);
+    if (num_rows() < rows) {
+      table_lock.unlock();
+      {
+        std::unique_lock lock(counters_mutex_);
+        reserve(rows);
+      }
+      table_lock.lock();
+    }
+
+    int64_t resizes = 0;
+    std::vector<TransitionDelta<CodeT>> missed;
+    for (auto first = transitions.begin(); first != transitions.end();) {
+      auto last = std::find_if(first, transitions.end(),
+                               [from = first->from](const auto &transition) {
+                                 return transition.from != from;
+                               });
+      std::shared_mutex &row_mutex =
+          row_mutexes_[static_cast<std::size_t>(first->from) % kRowStripes];
+      missed.clear();
+      {
+        std::shared_lock lock(row_mutex);
+        for (auto it = first; it != last; ++it) {
+          if (!try_add(*it)) {
+            missed.push_back(*it);
+          }
+        }
+      }
+      if (!missed.empty()) {
+        std::unique_lock lock(row_mutex);
+        for (const TransitionDelta<CodeT> &transition : missed) {
+          resizes += add(transition) ? 1 : 0;
+        }
+      }
+      first = last;
+    }
+    table_lock.unlock();
+
+    if (deltas_.Enabled() || resizes > 0) {
+      std::lock_guard lock(deltas_mutex_);
+      for (; resizes > 0; --resizes) {
+        metrics_.CountResize();
+      }
+      for (const TransitionDelta<CodeT> &transition : transitions) {
+        deltas_.Record(transition.from, transition.depth, transition.to,
+                       transition.delta);
+      }
+    }
+  }
+
+  //! Bytes taken by memory and uniforms of PredictStates. Deque allocates
+  //! the map of at least 8 pointers and nodes of 512 bytes, one more than
+  //! needed for its size
+  std::size_t MemoryBytes() const {
+    std::size_t per_node = std::max<std::size_t>(1, 512 / sizeof(CodeT));
+    std::size_t nodes = memory_.size() / per_node + 1;
+    return sizeof(memory_) +
+           AllocatedBytes(std::max<std::size_t>(8, nodes + 2) *
+                          sizeof(void *)) +
+           nodes * AllocatedBytes(per_node * sizeof(CodeT)) +
+           VectorBytes(uniforms_) + VectorBytes(buckets_);
+  }
 };
 
 }  // namespace evolv::internal
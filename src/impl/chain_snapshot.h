@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "delta_log.h"
+#include "fenwick_tree.h"
+#include "persistent_array.h"
+#include "random.h"
+#include "utils.h"
+
+
+namespace evolv::internal {
+
+/*!
+  \brief Immutable version of learned chain for concurrent readers
+
+  It holds coded states and transition counters, like MarkovChain, but
+  never changes, so any number of threads may predict from it without
+  synchronization, each with its own memory and generator. Next builds
+  the following version from changes, sharing with this one everything
+  that isn't changed: pages of states, rows and the state index.
+  Row is counters of transitions from a state by depth, like in
+  RemberChain, ForgorChain is the case of memory_size = 1. The index is
+  an open-addressing hash table of codes in a PersistentArray, so new
+  states copy only the pages of their slots, until the table is grown.
+*/
+template <class StateT, class CodeT>
+  requires std::copy_constructible<StateT> && std::integral<CodeT>
+class ChainSnapshot {
+  using CountT = int64_t;
+  using FenwickCounter = FenwickTree<CountT, CodeT>;
+  using Row = std::vector<FenwickCounter>;
+
+ public:
+  //! Least number of slots of the state index, it's kept at most half full
+  static constexpr int kMinIndexBits = 4;
+
+  //! Empty version of chain remembering given number of states
+  explicit ChainSnapshot(int memory_size) : memory_size_(memory_size) {
+    assert(memory_size > 0);
+  }
+
+  //! Number of versions published before this one
+  uint64_t Version() const {
+    return version_;
+  }
+
+  int GetMemorySize() const {
+    return memory_size_;
+  }
+
+  //! Number of coded states, codes are in [0, NumStates())
+  std::size_t NumStates() const {
+    return states_.Size();
+  }
+
+  //! Code of the state, nullopt if it wasn't seen by this version
+  std::optional<CodeT> Find(const StateT &state) const {
+    if (index_.Size() == 0) {
+      return std::nullopt;
+    }
+    std::size_t mask = index_.Size() - 1;
+    for (std::size_t slot = SlotOf(state, index_bits_);;
+         slot = (slot + 1) & mask) {
+      CodeT stored = index_[slot];
+      if (stored == 0) {
+        return std::nullopt;
+      }
+      if (states_[stored - 1] == state) {
+        return static_cast<CodeT>(stored - 1);
+      }
+    }
+  }
+
+  const StateT &Decode(CodeT code) const {
+    return states_[code];
+  }
+
+  //! Get counter of transitions from given state into the state coming
+  //! in depth + 1 steps, nullptr if there are none
+  const FenwickCounter *FindCounter(CodeT from, int depth) const {
+    if (static_cast<std::size_t>(from) >= rows_.Size()) {
+      return nullptr;
+    }
+    const std::shared_ptr<const Row> &row = rows_[from];
+    if (row == nullptr || static_cast<int>(row->size()) <= depth) {
+      return nullptr;
+    }
+    return &(*row)[depth];
+  }
+
+  //! Sample the subsequent state after remembered ones, where memory[0]
+  //! is the last one, like in MarkovChain::GetMemory. States beyond the
+  //! memory size are ignored. Nullopt if there are no transitions
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  std::optional<CodeT> PredictCode(std::span<const CodeT> memory,
+                                   RngT &rng) const {
+    int depth_count =
+        std::min(static_cast<int>(memory.size()), memory_size_);
+    thread_local std::vector<const FenwickCounter *> counters;
+    thread_local std::vector<CountT> bases;
+    counters.resize(depth_count);
+    CountT total = 0;
+    for (int depth = 0; depth < depth_count; ++depth) {
+      counters[depth] = FindCounter(memory[depth], depth);
+      if (counters[depth] != nullptr) {
+        total += counters[depth]->TotalSum();
+      }
+    }
+    if (total == 0) {
+      return std::nullopt;
+    }
+    auto x = static_cast<CountT>(UniformBelow(rng, total));
+    if (depth_count == 1) {
+      return static_cast<CodeT>(counters[0]->UpperBound(x));
+    }
+
+    // one descent over the trees of all depths, like in RemberChain
+    CodeT next_state;
+    FenwickCounter::UpperBounds(std::span(counters.data(), depth_count),
+                                std::span(&x, 1), std::span(&next_state, 1),
+                                bases);
+    return next_state;
+  }
+
+  //! Sample the subsequent state after remembered states, see PredictCode.
+  //! States unknown to this version have no transitions
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  std::optional<StateT> PredictState(std::span<const StateT> memory,
+                                     RngT &rng) const {
+    std::vector<CodeT> codes;
+    for (const StateT &state : memory.first(std::min<std::size_t>(
+             memory.size(), memory_size_))) {
+      codes.push_back(Find(state).value_or(static_cast<CodeT>(NumStates())));
+    }
+    std::optional<CodeT> code = PredictCode<RngT>(codes, rng);
+    return code ? std::optional<StateT>(Decode(*code)) : std::nullopt;
+  }
+
+  //! Build the following version with states coded as NumStates(),
+  //! NumStates() + 1 and so on, and transition deltas, that are ordered
+  //! by the source state, as given by DeltaRecorder::Take. It copies
+  //! only pages with new states and changed rows and paths to them
+  std::shared_ptr<const ChainSnapshot> Next(
+      std::span<const StateT> new_states,
+      std::span<const TransitionDelta<CodeT>> deltas) const {
+    auto next = std::make_shared<ChainSnapshot>(*this);
+    next->version_++;
+
+    typename PersistentArray<StateT>::Editor states(states_);
+    for (std::size_t i = 0; i < new_states.size(); ++i) {
+      states[states_.Size() + i] = new_states[i];
+    }
+    next->states_ = states.Finish();
+    next->IndexStates(states_.Size());
+
+    typename PersistentArray<std::shared_ptr<const Row>>::Editor rows(rows_);
+    for (auto it = deltas.begin(); it != deltas.end();) {
+      CodeT from = it->from;
+      auto row = static_cast<std::size_t>(from) < rows_.Size() &&
+                         rows_[from] != nullptr
+                     ? std::make_shared<Row>(*rows_[from])
+                     : std::make_shared<Row>();
+      for (; it != deltas.end() && it->from == from; ++it) {
+        if (static_cast<int>(row->size()) <= it->depth) {
+          row->resize(it->depth + 1);
+        }
+        (*row)[it->depth].Add(it->to, it->delta);
+      }
+      rows[from] = std::move(row);
+    }
+    next->rows_ = rows.Finish();
+    return next;
+  }
+
+  //! Bytes taken by this version, including parts shared with others
+  std::size_t MemoryUsage() const {
+    std::size_t bytes = sizeof(*this) + states_.MemoryUsage() +
+                        rows_.MemoryUsage() + index_.MemoryUsage();
+    for (std::size_t from = 0; from < rows_.Size(); ++from) {
+      if (rows_[from] != nullptr) {
+        bytes += VectorBytes(*rows_[from]);
+        for (const FenwickCounter &counter : *rows_[from]) {
+          bytes += counter.MemoryUsage() - sizeof(counter);
+        }
+      }
+    }
+    return bytes;
+  }
+
+ private:
+  int memory_size_;
+  uint64_t version_ = 0;
+  //! States by codes
+  PersistentArray<StateT> states_;
+  //! Slots of codes by states, holding code + 1 or 0 if empty
+  PersistentArray<CodeT> index_;
+  //! Number of slots of the index is 2 ** index_bits_
+  int index_bits_ = 0;
+  //! Counters of transitions from states by codes
+  PersistentArray<std::shared_ptr<const Row>> rows_;
+
+  //! Slot to start looking for the state from, given by the high bits of
+  //! the mixed hash, as std::hash of integers is identity
+  static std::size_t SlotOf(const StateT &state, int bits) {
+    constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15;
+    uint64_t hash = std::hash<StateT>{}(state) * kMultiplier;
+    return static_cast<std::size_t>(hash >> (64 - bits));
+  }
+
+  //! Add states with codes from first_code into the index, rebuilding it
+  //! twice as large when it gets more than half full
+  void IndexStates(std::size_t first_code) {
+    int bits = std::max(index_bits_, kMinIndexBits);
+    while ((std::size_t{1} << bits) < 2 * NumStates()) {
+      ++bits;
+    }
+    bool grown = bits != index_bits_;
+    if (grown) {
+      index_ = {};
+      index_bits_ = bits;
+      first_code = 0;
+    }
+    typename PersistentArray<CodeT>::Editor index(index_);
+    std::size_t size = std::size_t{1} << bits;
+    if (grown) {
+      // the new table takes all of its slots, empty ones are 0
+      index[size - 1] = 0;
+    }
+    for (std::size_t code = first_code; code < NumStates(); ++code) {
+      std::size_t slot = SlotOf(states_[code], bits);
+      while (index[slot] != 0) {
+        slot = (slot + 1) & (size - 1);
+      }
+      index[slot] = static_cast<CodeT>(code + 1);
+    }
+    index_ = index.Finish();
+  }
+};
+
+}  // namespace evolv::internal
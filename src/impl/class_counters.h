@@ -0,0 +1,150 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "fenwick_tree.h"
+#include "memory_usage.h"
+#include "random.h"
+#include "utils.h"
+
+
+namespace evolv::internal {
+
+/*!
+  \brief Transition counters factorized through classes of states
+
+  Instead of the row over all the states for each remembered one, there
+  is the row over classes, counting transitions into states of each
+  class, and for each class the counter of how many times its states
+  were seen as targets. The next state is sampled as the class given
+  memory, then the state given the class. With about sqrt(V) classes of
+  about sqrt(V) states rows take O(sqrt(V)) instead of O(V), and
+  sampling searches classes and one class instead of all the states.
+  Rows of depth are indexed by code of the source state, like in
+  RemberChain.
+*/
+template <class CodeT>
+  requires std::integral<CodeT>
+class ClassCounters {
+ public:
+  using CountT = int64_t;
+  using FenwickCounter = FenwickTree<CountT, CodeT>;
+
+  explicit ClassCounters(int memory_size) : class_rows_(memory_size) {
+  }
+
+  //! Put the state of the next code into the class
+  void AddState(CodeT code, CodeT cls) {
+    assert(static_cast<std::size_t>(code) == class_of_.size());
+    if (static_cast<std::size_t>(cls) >= members_.size()) {
+      members_.resize(static_cast<std::size_t>(cls) + 1);
+      member_counts_.resize(members_.size());
+    }
+    class_of_.push_back(cls);
+    member_index_.push_back(static_cast<CodeT>(members_[cls].size()));
+    members_[cls].push_back(code);
+  }
+
+  int GetMemorySize() const {
+    return static_cast<int>(class_rows_.size());
+  }
+
+  std::size_t NumStates() const {
+    return class_of_.size();
+  }
+
+  CodeT ClassOf(CodeT code) const {
+    return class_of_[code];
+  }
+
+  //! Count the state seen as the target of transitions
+  void CountState(CodeT code, CountT weight) {
+    member_counts_[class_of_[code]].Add(member_index_[code], weight);
+  }
+
+  //! Count transition from state into the class of the state coming in
+  //! depth + 1 steps
+  void CountTransition(CodeT from, int depth, CodeT to, CountT weight) {
+    std::vector<FenwickCounter> &level = class_rows_[depth];
+    if (static_cast<std::size_t>(from) >= level.size()) {
+      level.resize(static_cast<std::size_t>(from) + 1);
+    }
+    level[from].Add(class_of_[to], weight);
+  }
+
+  //! Sample the subsequent state after remembered ones, where memory[0]
+  //! is the last one: the class from rows of memory added up, then the
+  //! state from the class. Nullopt if there are no transitions
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  std::optional<CodeT> PredictCode(std::span<const CodeT> memory,
+                                   RngT &rng) const {
+    int depth_count = std::min(static_cast<int>(memory.size()),
+                               static_cast<int>(class_rows_.size()));
+    thread_local std::vector<const FenwickCounter *> rows;
+    thread_local std::vector<CountT> bases;
+    rows.clear();
+    CountT total = 0;
+    for (int depth = 0; depth < depth_count; ++depth) {
+      const std::vector<FenwickCounter> &level = class_rows_[depth];
+      if (memory[depth] >= 0 &&
+          static_cast<std::size_t>(memory[depth]) < level.size() &&
+          level[memory[depth]].TotalSum() > 0) {
+        rows.push_back(&level[memory[depth]]);
+        total += rows.back()->TotalSum();
+      }
+    }
+    if (total == 0) {
+      return std::nullopt;
+    }
+    auto x = static_cast<CountT>(UniformBelow(rng, total));
+    CodeT cls;
+    FenwickCounter::UpperBounds(rows, std::span(&x, 1), std::span(&cls, 1),
+                                bases);
+
+    // states of the class with transitions into it were seen as targets
+    const FenwickCounter &members = member_counts_[cls];
+    x = static_cast<CountT>(UniformBelow(rng, members.TotalSum()));
+    return members_[cls][members.UpperBound(x)];
+  }
+
+  //! Bytes taken by counters and classes
+  std::size_t MemoryUsage() const {
+    std::size_t bytes = sizeof(*this) + VectorBytes(class_of_) +
+                        VectorBytes(member_index_) + VectorBytes(members_) +
+                        VectorBytes(member_counts_) +
+                        VectorBytes(class_rows_);
+    for (const std::vector<CodeT> &members : members_) {
+      bytes += VectorBytes(members);
+    }
+    for (const FenwickCounter &counter : member_counts_) {
+      bytes += counter.MemoryUsage() - sizeof(counter);
+    }
+    for (const std::vector<FenwickCounter> &level : class_rows_) {
+      bytes += VectorBytes(level);
+      for (const FenwickCounter &row : level) {
+        bytes += row.MemoryUsage() - sizeof(row);
+      }
+    }
+    return bytes;
+  }
+
+ private:
+  //! Class of each state and its index among states of the class
+  std::vector<CodeT> class_of_;
+  std::vector<CodeT> member_index_;
+  //! States of each class and how many times they were seen as targets
+  std::vector<std::vector<CodeT>> members_;
+  std::vector<FenwickCounter> member_counts_;
+  //! Counts of transitions into classes, class_rows_[depth][from]
+  std::vector<std::vector<FenwickCounter>> class_rows_;
+};
+
+}  // namespace evolv::internal
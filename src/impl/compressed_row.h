@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cassert>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "fenwick_tree.h"
+#include "memory_usage.h"
+
+
+namespace evolv::internal {
+
+/*!
+  \brief Counter of transitions kept compressed while it's cold
+
+  Non-zero counts are stored in order of target states, each as varint
+  of the gap from the previous target followed by varint of the count,
+  so a row with a few targets takes a few bytes instead of a counter for
+  each coded state. Decompress gives the Fenwick tree for sampling.
+*/
+template <class CodeT>
+  requires std::integral<CodeT>
+class CompressedRow {
+ public:
+  using CountT = int64_t;
+  using FenwickCounter = FenwickTree<CountT, CodeT>;
+
+  CompressedRow() = default;
+
+  //! Compress non-zero counts of the counter
+  explicit CompressedRow(const FenwickCounter &counter) {
+    for (CodeT to = 0; to < counter.Size(); ++to) {
+      if (CountT count = counter.Sum(to) - counter.Sum(to - 1); count != 0) {
+        Append(to, count);
+      }
+    }
+  }
+
+  //! Append count of transitions into the state following the ones
+  //! appended before
+  void Append(CodeT to, CountT count) {
+    assert((targets_ == 0 || to >= size_) && "Targets must be increasing");
+    assert(count > 0 && "Only positive counts are stored");
+    PutVarint(static_cast<uint64_t>(to - (targets_ == 0 ? 0 : size_)));
+    PutVarint(static_cast<uint64_t>(count));
+    size_ = to + 1;
+    total_sum_ += count;
+    targets_++;
+  }
+
+  //! Number of states the decompressed counter covers: the last target + 1
+  CodeT Size() const {
+    return size_;
+  }
+
+  //! Number of states with non-zero count
+  std::size_t Targets() const {
+    return targets_;
+  }
+
+  CountT TotalSum() const {
+    return total_sum_;
+  }
+
+  //! Call fn(to, count) for each target in increasing order
+  template <class FnT>
+  void ForEach(FnT fn) const {
+    const uint8_t *pos = bytes_.data();
+    CodeT to = 0;
+    for (std::size_t i = 0; i < targets_; ++i) {
+      to += static_cast<CodeT>(GetVarint(pos));
+      fn(to, static_cast<CountT>(GetVarint(pos)));
+      to++;
+    }
+  }
+
+  //! Fenwick tree over the counts, built in linear time
+  FenwickCounter Decompress() const {
+    std::vector<CountT> counts(static_cast<std::size_t>(size_));
+    ForEach([&counts](CodeT to, CountT count) { counts[to] = count; });
+    return FenwickCounter(counts);
+  }
+
+  //! Give back storage exceeding the size
+  void ShrinkToFit() {
+    bytes_.shrink_to_fit();
+  }
+
+  //! Bytes taken by the row including compressed counts
+  std::size_t MemoryUsage() const {
+    return sizeof(*this) + VectorBytes(bytes_);
+  }
+
+ private:
+  std::vector<uint8_t> bytes_;
+  CountT total_sum_ = 0;
+  std::size_t targets_ = 0;
+  CodeT size_ = 0;
+
+  void PutVarint(uint64_t value) {
+    for (; value >= 0x80; value >>= 7) {
+      bytes_.push_back(static_cast<uint8_t>(value | 0x80));
+    }
+    bytes_.push_back(static_cast<uint8_t>(value));
+  }
+
+  static uint64_t GetVarint(const uint8_t *&pos) {
+    uint64_t value = 0;
+    for (int shift = 0;; shift += 7) {
+      uint8_t byte = *pos++;
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+  }
+};
+
+}  // namespace evolv::internal
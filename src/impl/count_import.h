@@ -0,0 +1,227 @@
+#pragma once
+
+#include <charconv>
+#include <concepts>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include "delta_log.h"
+
+
+namespace evolv::internal {
+
+//! How states are parsed from text: integral ones as decimal numbers
+template <class StateT>
+struct StateParser {};
+
+template <class StateT>
+  requires std::integral<StateT>
+struct StateParser<StateT> {
+  static bool Parse(std::string_view text, StateT &state) {
+    auto [end, error] =
+        std::from_chars(text.data(), text.data() + text.size(), state);
+    return error == std::errc() && end == text.data() + text.size();
+  }
+};
+
+//! Strings are taken as they are
+template <>
+struct StateParser<std::string> {
+  static bool Parse(std::string_view text, std::string &state) {
+    state.assign(text);
+    return true;
+  }
+};
+
+//! Concept for checking if states of StateT may be parsed from text
+template <class StateT>
+concept is_parsable_state =
+    std::default_initializable<StateT> &&
+    requires(std::string_view text, StateT &state) {
+      { StateParser<StateT>::Parse(text, state) } -> std::same_as<bool>;
+    };
+
+
+//! Pre-aggregated count of transitions from state into the state coming
+//! in depth + 1 steps
+template <class StateT>
+struct StateCount {
+  StateT from;
+  StateT to;
+  int64_t count = 0;
+  int32_t depth = 0;
+};
+
+
+//! Outcome of parsing binary record
+enum class ParseResult {
+  kParsed,
+  //! There are not enough bytes, the rest of record may follow
+  kCutShort,
+  kMalformed,
+};
+
+
+/*!
+  \brief Parser and writer of records with pre-aggregated counts
+
+  TSV line is "from<TAB>to<TAB>count" optionally followed by "<TAB>depth".
+  Binary record is from and to written like in the delta log, see
+  StateSerializer, then 64-bit count and 32-bit depth in native byte
+  order. Records are parsed for the chain remembering memory_size states,
+  the one with depth outside [0, memory_size) or non-positive count is
+  malformed.
+*/
+template <class StateT>
+class CountFormat {
+ public:
+  //! Whether the record may be counted by the chain remembering
+  //! memory_size states
+  static bool Valid(const StateCount<StateT> &record, int memory_size) {
+    return record.count > 0 && record.depth >= 0 &&
+           record.depth < memory_size;
+  }
+
+  //! Parse TSV line without line break, false if it's malformed
+  static bool ParseTsv(std::string_view line, int memory_size,
+                       StateCount<StateT> &record)
+    requires is_parsable_state<StateT>
+  {
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    std::string_view fields[4];
+    int num_fields = 0;
+    for (;;) {
+      if (num_fields == 4) {
+        return false;
+      }
+      std::size_t tab = line.find('\t');
+      fields[num_fields++] = line.substr(0, tab);
+      if (tab == std::string_view::npos) {
+        break;
+      }
+      line.remove_prefix(tab + 1);
+    }
+    record.depth = 0;
+    return num_fields >= 3 &&
+           StateParser<StateT>::Parse(fields[0], record.from) &&
+           StateParser<StateT>::Parse(fields[1], record.to) &&
+           StateParser<int64_t>::Parse(fields[2], record.count) &&
+           (num_fields == 3 ||
+            StateParser<int32_t>::Parse(fields[3], record.depth)) &&
+           Valid(record, memory_size);
+  }
+
+  static void WriteTsv(std::ostream &os, const StateCount<StateT> &record) {
+    os << record.from << '\t' << record.to << '\t' << record.count;
+    if (record.depth != 0) {
+      os << '\t' << record.depth;
+    }
+    os << '\n';
+  }
+
+  //! Parse binary record moving pos past it, pos stays if it's cut short
+  //! or malformed
+  static ParseResult ParseBinary(const char *&pos, const char *end,
+                                 int memory_size, StateCount<StateT> &record)
+    requires is_serializable_state<StateT>
+  {
+    const char *start = pos;
+    if (!StateSerializer<StateT>::Read(pos, end, record.from) ||
+        !StateSerializer<StateT>::Read(pos, end, record.to) ||
+        !StateSerializer<int64_t>::Read(pos, end, record.count) ||
+        !StateSerializer<int32_t>::Read(pos, end, record.depth)) {
+      pos = start;
+      return ParseResult::kCutShort;
+    }
+    if (!Valid(record, memory_size)) {
+      pos = start;
+      return ParseResult::kMalformed;
+    }
+    return ParseResult::kParsed;
+  }
+
+  static void WriteBinary(std::ostream &os, const StateCount<StateT> &record)
+    requires is_serializable_state<StateT>
+  {
+    std::string bytes;
+    StateSerializer<StateT>::Write(bytes, record.from);
+    StateSerializer<StateT>::Write(bytes, record.to);
+    StateSerializer<int64_t>::Write(bytes, record.count);
+    StateSerializer<int32_t>::Write(bytes, record.depth);
+    os.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+  }
+};
+
+
+//! Call fn(record) for each TSV record of the stream, skipping empty lines
+//! and lines starting with '#', see CountFormat for memory_size. Stops at
+//! the end or at the malformed line, leaving the stream at it. Returns
+//! number of records
+template <class StateT, class FnT>
+  requires is_parsable_state<StateT>
+std::size_t ReadTsvCounts(std::istream &is, int memory_size, FnT fn) {
+  std::size_t records = 0;
+  StateCount<StateT> record;
+  std::string line;
+  for (std::streampos start = is.tellg(); std::getline(is, line);
+       start = is.tellg()) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    if (!CountFormat<StateT>::ParseTsv(line, memory_size, record)) {
+      is.clear();
+      is.seekg(start);
+      break;
+    }
+    fn(record);
+    records++;
+  }
+  return records;
+}
+
+
+//! Call fn(record) for each binary record of the stream, that is read by
+//! chunks, see CountFormat for memory_size. Stops at the end or at the
+//! malformed record, leaving the stream at the beginning of it or of the
+//! record cut short if any. Returns number of records
+template <class StateT, class FnT>
+  requires is_serializable_state<StateT>
+std::size_t ReadBinaryCounts(std::istream &is, int memory_size, FnT fn) {
+  constexpr std::size_t kChunkBytes = 1 << 20;
+  std::size_t records = 0;
+  StateCount<StateT> record;
+  std::string buffer;
+  // position of the buffer in the stream
+  std::streamoff offset = is.tellg();
+  std::size_t pending = 0;
+  for (;;) {
+    buffer.resize(pending + kChunkBytes);
+    is.read(buffer.data() + pending, kChunkBytes);
+    std::size_t size = pending + static_cast<std::size_t>(is.gcount());
+    const char *pos = buffer.data(), *end = pos + size;
+    ParseResult result;
+    while ((result = CountFormat<StateT>::ParseBinary(
+                pos, end, memory_size, record)) == ParseResult::kParsed) {
+      fn(record);
+      records++;
+    }
+    auto parsed = static_cast<std::size_t>(pos - buffer.data());
+    offset += static_cast<std::streamoff>(parsed);
+    pending = size - parsed;
+    if (result == ParseResult::kMalformed || !is) {
+      break;
+    }
+    buffer.erase(0, parsed);
+  }
+  is.clear();
+  is.seekg(offset);
+  return records;
+}
+
+}  // namespace evolv::internal
@@ -0,0 +1,437 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "memory_usage.h"
+
+
+namespace evolv::internal {
+
+//! Change of transition count from state with code from into the state
+//! coming in depth + 1 steps
+template <class CodeT>
+struct TransitionDelta {
+  CodeT from;
+  int32_t depth;
+  CodeT to;
+  int64_t delta;
+
+  bool operator==(const TransitionDelta &) const = default;
+};
+
+
+//! Order of transitions: by source state, then by depth, then by target
+struct TransitionLess {
+  template <class CodeT>
+  bool operator()(const TransitionDelta<CodeT> &lhs,
+                  const TransitionDelta<CodeT> &rhs) const {
+    return std::tie(lhs.from, lhs.depth, lhs.to) <
+           std::tie(rhs.from, rhs.depth, rhs.to);
+  }
+};
+
+
+//! Sum deltas of the same transition and order them by transition
+template <class CodeT>
+void MergeDeltas(std::vector<TransitionDelta<CodeT>> &deltas) {
+  std::sort(deltas.begin(), deltas.end(), TransitionLess{});
+  std::size_t size = 0;
+  for (const TransitionDelta<CodeT> &delta : deltas) {
+    if (size > 0 && deltas[size - 1].from == delta.from &&
+        deltas[size - 1].depth == delta.depth &&
+        deltas[size - 1].to == delta.to) {
+      deltas[size - 1].delta += delta.delta;
+    } else {
+      deltas[size++] = delta;
+    }
+  }
+  deltas.resize(size);
+}
+
+
+/*!
+  \brief Transition deltas applied since the last checkpoint
+
+  Recording is off until Enable, then each counted transition is summed
+  into the delta of its cell, so while it's off learning costs only the
+  check of a flag, and while it's on memory grows with changed cells,
+  not with counted transitions.
+*/
+template <class CodeT>
+class DeltaRecorder {
+ public:
+  //! Start recording transitions
+  void Enable() {
+    enabled_ = true;
+  }
+
+  bool Enabled() const {
+    return enabled_;
+  }
+
+  //! Stop recording and drop recorded deltas
+  void Reset() {
+    enabled_ = false;
+    deltas_ = {};
+  }
+
+  //! Record change of transition count if recording is on
+  void Record(CodeT from, int depth, CodeT to, int64_t delta) {
+    if (enabled_) {
+      deltas_[{from, static_cast<int32_t>(depth), to}] += delta;
+    }
+  }
+
+  //! Take recorded deltas summed by transition and ordered by it,
+  //! recording continues from scratch
+  std::vector<TransitionDelta<CodeT>> Take() {
+    std::vector<TransitionDelta<CodeT>> deltas;
+    deltas.reserve(deltas_.size());
+    for (const auto &[cell, delta] : deltas_) {
+      deltas.push_back({cell.from, cell.depth, cell.to, delta});
+    }
+    deltas_ = {};
+    std::sort(deltas.begin(), deltas.end(), TransitionLess{});
+    return deltas;
+  }
+
+  //! Bytes taken by deltas not yet taken
+  std::size_t MemoryUsage() const {
+    return HashTableBytes(deltas_);
+  }
+
+ private:
+  //! Transition whose count changed
+  struct Cell {
+    CodeT from;
+    int32_t depth;
+    CodeT to;
+
+    bool operator==(const Cell &) const = default;
+  };
+
+  struct CellHash {
+    std::size_t operator()(const Cell &cell) const {
+      constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15;
+      uint64_t hash = static_cast<uint64_t>(cell.from) * kMultiplier;
+      hash = (hash ^ static_cast<uint32_t>(cell.depth)) * kMultiplier;
+      hash = (hash ^ static_cast<uint64_t>(cell.to)) * kMultiplier;
+      return static_cast<std::size_t>(hash ^ (hash >> 32));
+    }
+  };
+
+  bool enabled_ = false;
+  std::unordered_map<Cell, int64_t, CellHash> deltas_;
+};
+
+
+//! Append non-zero counts of the counter of transitions from given state
+template <class CodeT, class CounterT>
+void AppendCounts(CodeT from, int depth, const CounterT &counter,
+                  std::vector<TransitionDelta<CodeT>> &counts) {
+  if (counter.TotalSum() == 0) {
+    return;
+  }
+  for (int64_t to = 0; to < counter.Size(); ++to) {
+    if (int64_t count = counter.Sum(to) - counter.Sum(to - 1); count != 0) {
+      counts.push_back({from, static_cast<int32_t>(depth),
+                        static_cast<CodeT>(to), count});
+    }
+  }
+}
+
+
+//! How states are written into the log: trivially copyable ones
+//! byte by byte in native order
+template <class StateT>
+struct StateSerializer {};
+
+template <class StateT>
+  requires std::is_trivially_copyable_v<StateT>
+struct StateSerializer<StateT> {
+  static void Write(std::string &out, const StateT &state) {
+    out.append(reinterpret_cast<const char *>(&state), sizeof(state));
+  }
+
+  //! Read state moving pos, false if there are not enough bytes
+  static bool Read(const char *&pos, const char *end, StateT &state) {
+    if (end - pos < static_cast<std::ptrdiff_t>(sizeof(state))) {
+      return false;
+    }
+    std::memcpy(&state, pos, sizeof(state));
+    pos += sizeof(state);
+    return true;
+  }
+};
+
+//! Strings are written as 64-bit length followed by characters
+template <>
+struct StateSerializer<std::string> {
+  static void Write(std::string &out, const std::string &state) {
+    StateSerializer<uint64_t>::Write(out, state.size());
+    out.append(state);
+  }
+
+  static bool Read(const char *&pos, const char *end, std::string &state) {
+    uint64_t size = 0;
+    if (!StateSerializer<uint64_t>::Read(pos, end, size) ||
+        static_cast<uint64_t>(end - pos) < size) {
+      return false;
+    }
+    state.assign(pos, size);
+    pos += size;
+    return true;
+  }
+};
+
+//! Concept for checking if states of StateT may be written into the log
+template <class StateT>
+concept is_serializable_state =
+    std::default_initializable<StateT> &&
+    requires(std::string &out, const StateT &state, const char *&pos,
+             StateT &read) {
+      StateSerializer<StateT>::Write(out, state);
+      { StateSerializer<StateT>::Read(pos, pos, read) } -> std::same_as<bool>;
+    };
+
+
+/*!
+  \brief Block of the delta log written by one checkpoint
+
+  Block holds states coded since the previous checkpoint, that got codes
+  first_code, first_code + 1 and so on, and transition deltas. Blocks are
+  numbered by seq and record memory_size of the chain, depths of
+  transitions are below it. Snapshot block holds the whole model as
+  deltas from the empty one and has seq of the last checkpoint it
+  includes. Snapshot of pruned model is marked, its states[0] is the
+  unknown state, that states not coded are coded as.
+*/
+template <class StateT, class CodeT>
+struct DeltaBlock {
+  uint64_t seq = 0;
+  bool snapshot = false;
+  bool pruned = false;
+  int32_t memory_size = 0;
+  uint64_t first_code = 0;
+  std::vector<StateT> states;
+  std::vector<TransitionDelta<CodeT>> transitions;
+};
+
+
+/*!
+  \brief Writer and reader of delta log blocks
+
+  Block is the fixed header followed by payload of the size written in
+  header, so a block cut by crash is detected and isn't applied.
+  Header and transitions are written field by field, so the format
+  doesn't depend on padding of structs. Numbers are in native byte
+  order, the log isn't portable between machines with different
+  endianness.
+*/
+template <class StateT, class CodeT>
+  requires is_serializable_state<StateT>
+class DeltaLogFormat {
+ public:
+  static constexpr uint32_t kMagic = 0x4c445645;  // "EVDL"
+
+ private:
+  //! Bits of Header::flags
+  static constexpr uint32_t kSnapshot = 1;
+  static constexpr uint32_t kPruned = 2;
+
+  struct Header {
+    uint32_t magic;
+    uint32_t flags;
+    int32_t memory_size;
+    uint64_t seq;
+    uint64_t first_code;
+    uint64_t num_states;
+    uint64_t num_transitions;
+    uint64_t payload_bytes;
+  };
+
+  static constexpr std::size_t kHeaderBytes = 3 * 4 + 5 * 8;
+  static constexpr std::size_t kTransitionBytes = 2 * sizeof(CodeT) + 4 + 8;
+
+ public:
+  //! Append block to the stream
+  static void Write(std::ostream &os, const DeltaBlock<StateT, CodeT> &block) {
+    std::string payload;
+    for (const StateT &state : block.states) {
+      StateSerializer<StateT>::Write(payload, state);
+    }
+    for (const TransitionDelta<CodeT> &delta : block.transitions) {
+      WriteTransition(payload, delta);
+    }
+    WriteHeader(os, {kMagic, Flags(block), block.memory_size, block.seq,
+                     block.first_code, block.states.size(),
+                     block.transitions.size(), payload.size()});
+    os.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+  }
+
+  /*!
+    \brief Writer of the block with transitions appended one by one
+
+    For blocks too large to hold in memory. Header is written first with
+    broken magic and is patched by Finish, so until then the block is
+    seen as cut short and isn't read. The stream must be seekable.
+  */
+  class BlockWriter {
+   public:
+    //! Start the block with states of the given one, its transitions are
+    //! ignored
+    BlockWriter(std::ostream &os, const DeltaBlock<StateT, CodeT> &block)
+        : os_(os),
+          start_(os.tellp()),
+          header_{0, Flags(block), block.memory_size, block.seq,
+                  block.first_code, block.states.size(), 0, 0} {
+      WriteHeader(os_, header_);
+      for (const StateT &state : block.states) {
+        StateSerializer<StateT>::Write(buffer_, state);
+      }
+      Flush();
+    }
+
+    //! Append transition after the ones appended before
+    void Append(const TransitionDelta<CodeT> &delta) {
+      WriteTransition(buffer_, delta);
+      header_.num_transitions++;
+      if (buffer_.size() >= kBufferBytes) {
+        Flush();
+      }
+    }
+
+    //! Complete the block, the stream is left at its end
+    void Finish() {
+      Flush();
+      std::streampos end = os_.tellp();
+      header_.magic = kMagic;
+      os_.seekp(start_);
+      WriteHeader(os_, header_);
+      os_.seekp(end);
+    }
+
+   private:
+    static constexpr std::size_t kBufferBytes = 1 << 16;
+
+    std::ostream &os_;
+    std::streampos start_;
+    Header header_;
+    std::string buffer_;
+
+    void Flush() {
+      os_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+      header_.payload_bytes += buffer_.size();
+      buffer_.clear();
+    }
+  };
+
+  //! Read the next block. On a block cut short or broken the stream is
+  //! left at its beginning and false is returned, as well as at the end.
+  //! Block is broken if its counts of states and transitions don't fit
+  //! into its payload, each state takes at least a byte
+  static bool Read(std::istream &is, DeltaBlock<StateT, CodeT> &block) {
+    std::streampos start = is.tellg();
+    Header header;
+    std::string payload;
+    if (!ReadHeader(is, header) || header.magic != kMagic ||
+        header.num_transitions > header.payload_bytes / kTransitionBytes ||
+        header.num_states > header.payload_bytes -
+                                header.num_transitions * kTransitionBytes) {
+      return Rewind(is, start);
+    }
+    payload.resize(header.payload_bytes);
+    if (!is.read(payload.data(),
+                 static_cast<std::streamsize>(payload.size()))) {
+      return Rewind(is, start);
+    }
+
+    block.seq = header.seq;
+    block.snapshot = (header.flags & kSnapshot) != 0;
+    block.pruned = (header.flags & kPruned) != 0;
+    block.memory_size = header.memory_size;
+    block.first_code = header.first_code;
+    block.states.resize(header.num_states);
+    block.transitions.resize(header.num_transitions);
+    const char *pos = payload.data(), *end = pos + payload.size();
+    for (StateT &state : block.states) {
+      if (!StateSerializer<StateT>::Read(pos, end, state)) {
+        return Rewind(is, start);
+      }
+    }
+    for (TransitionDelta<CodeT> &delta : block.transitions) {
+      if (!ReadTransition(pos, end, delta)) {
+        return Rewind(is, start);
+      }
+    }
+    return pos == end || Rewind(is, start);
+  }
+
+ private:
+  static void WriteHeader(std::ostream &os, const Header &header) {
+    std::string bytes;
+    StateSerializer<uint32_t>::Write(bytes, header.magic);
+    StateSerializer<uint32_t>::Write(bytes, header.flags);
+    StateSerializer<int32_t>::Write(bytes, header.memory_size);
+    for (uint64_t field : {header.seq, header.first_code, header.num_states,
+                           header.num_transitions, header.payload_bytes}) {
+      StateSerializer<uint64_t>::Write(bytes, field);
+    }
+    os.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+  }
+
+  static bool ReadHeader(std::istream &is, Header &header) {
+    char bytes[kHeaderBytes];
+    if (!is.read(bytes, kHeaderBytes)) {
+      return false;
+    }
+    const char *pos = bytes, *end = bytes + kHeaderBytes;
+    return StateSerializer<uint32_t>::Read(pos, end, header.magic) &&
+           StateSerializer<uint32_t>::Read(pos, end, header.flags) &&
+           StateSerializer<int32_t>::Read(pos, end, header.memory_size) &&
+           StateSerializer<uint64_t>::Read(pos, end, header.seq) &&
+           StateSerializer<uint64_t>::Read(pos, end, header.first_code) &&
+           StateSerializer<uint64_t>::Read(pos, end, header.num_states) &&
+           StateSerializer<uint64_t>::Read(pos, end, header.num_transitions) &&
+           StateSerializer<uint64_t>::Read(pos, end, header.payload_bytes);
+  }
+
+  static void WriteTransition(std::string &out,
+                              const TransitionDelta<CodeT> &delta) {
+    StateSerializer<CodeT>::Write(out, delta.from);
+    StateSerializer<int32_t>::Write(out, delta.depth);
+    StateSerializer<CodeT>::Write(out, delta.to);
+    StateSerializer<int64_t>::Write(out, delta.delta);
+  }
+
+  static bool ReadTransition(const char *&pos, const char *end,
+                             TransitionDelta<CodeT> &delta) {
+    return StateSerializer<CodeT>::Read(pos, end, delta.from) &&
+           StateSerializer<int32_t>::Read(pos, end, delta.depth) &&
+           StateSerializer<CodeT>::Read(pos, end, delta.to) &&
+           StateSerializer<int64_t>::Read(pos, end, delta.delta);
+  }
+
+  static uint32_t Flags(const DeltaBlock<StateT, CodeT> &block) {
+    return (block.snapshot ? kSnapshot : 0) | (block.pruned ? kPruned : 0);
+  }
+
+  static bool Rewind(std::istream &is, std::streampos start) {
+    is.clear();
+    is.seekg(start);
+    return false;
+  }
+};
+
+}  // namespace evolv::internal
@@ -29,25 +29,25 @@ class EncodingIterIface {
   //! Advance iterator
   virtual void Advance() = 0;
   
-  virtual bool operator==(const EncodingIterIface<CodeT> &other) const;
+  virtual bool operator==(const EncodingIterIface<CodeT> &other) const = 0;
 };
 
 
 /*!
   \brief The only implementation of EncodingIterIface
 
-  While EncodingIterIface is meant to hide IterT and StateT, this
-  explicitly depends on them along with CodeT. To hide IterT and StateT
+  While EncodingIterIface is meant to hide IterT and CoderT, this
+  explicitly depends on them along with CodeT. To hide IterT and CoderT
   this is stored as EncodingIterIface and when needed dynamic_cast'ed back.
+  CoderT is StateCoder or one of coders of integral states.
 */
-template <class CodeT, class IterT, class StateT>
-  requires std::integral<CodeT> && evolv::utils::is_iterator<IterT, StateT> &&
-           std::copy_constructible<StateT>
+template <class CodeT, class IterT, class CoderT>
+  requires std::integral<CodeT> &&
+           evolv::utils::is_iterator<IterT, typename CoderT::StateType>
 class EncodingIterImpl : public EncodingIterIface<CodeT> {
  public:
   //! Inititalize underlying iterator and state coder
-  EncodingIterImpl(IterT iter,
-                   std::shared_ptr<StateCoder<StateT, CodeT>> state_coder)
+  EncodingIterImpl(IterT iter, std::shared_ptr<CoderT> state_coder)
       : iter_(iter), state_coder_(state_coder) {
   }
 
@@ -64,7 +64,7 @@ class EncodingIterImpl : public EncodingIterIface<CodeT> {
   //! Binary comparison, it dynamic_cast's EncodingIterIface to this class
   bool operator==(const EncodingIterIface<CodeT> &other) const {
     auto other_iter =
-        dynamic_cast<const EncodingIterImpl<CodeT, IterT, StateT> &>(other)
+        dynamic_cast<const EncodingIterImpl<CodeT, IterT, CoderT> &>(other)
             .iter_;
     return iter_ == other_iter;
   }
@@ -73,14 +73,14 @@ class EncodingIterImpl : public EncodingIterIface<CodeT> {
   //! Underlying iterator
   IterT iter_;
   //! State coder
-  std::shared_ptr<StateCoder<StateT, CodeT>> state_coder_;
+  std::shared_ptr<CoderT> state_coder_;
 };
 
 
 /*!
   \brief Iterator on StateT sequence that encodes it into CodeT
 
-  Only constructor depends on template class parametes IterT and StateT.
+  Only constructor depends on template class parametes IterT and CoderT.
   Although it's implementation EncodingIterImpl also depends on it, it's
   implicitly casted to EncodingIterIface behind unique_ptr.
   When iterating over sequence, it applies encoding on it's elements.
@@ -90,12 +90,10 @@ template <class CodeT>
 class EncodingIter {
  public:
   //! Create EncodingIterImpl and implicitly case it to EncodingIterIface
-  template <class IterT, class StateT>
-    requires evolv::utils::is_iterator<IterT, StateT> &&
-             std::copy_constructible<StateT>
-  EncodingIter(IterT iter,
-               std::shared_ptr<StateCoder<StateT, CodeT>> state_coder) {
-    impl_ = std::make_unique<EncodingIterImpl<CodeT, IterT, StateT>>(
+  template <class IterT, class CoderT>
+    requires evolv::utils::is_iterator<IterT, typename CoderT::StateType>
+  EncodingIter(IterT iter, std::shared_ptr<CoderT> state_coder) {
+    impl_ = std::make_unique<EncodingIterImpl<CodeT, IterT, CoderT>>(
         iter, state_coder);
   }
 
@@ -126,4 +124,9 @@ class EncodingIter {
   std::unique_ptr<EncodingIterIface<CodeT>> impl_;
 };
 
+//! Deduce CodeT from the state coder
+template <class IterT, class CoderT>
+EncodingIter(IterT, std::shared_ptr<CoderT>)
+    -> EncodingIter<typename CoderT::CodeType>;
+
 }  // namespace evolv::internal
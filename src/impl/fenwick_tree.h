@@ -1,37 +1,79 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <concepts>
+#include <cstddef>
 #include <cstdint>
 #include <iostream>
+#include <memory_resource>
+#include <span>
 #include <vector>
 
+#include "memory_usage.h"
+
 
 namespace evolv::internal {
 
-//! Fenwick tree implementation
+//! Fenwick tree implementation. It's allocator-aware, so being stored
+//! in std::pmr containers it allocates from their memory resource
 template <class DataT, class SizeT = int64_t>
   requires std::integral<DataT> && std::signed_integral<SizeT>
 class FenwickTree {
  public:
-  //! Constructs empty Fenwick tree
-  FenwickTree() : tree_(1, 0) {
+  using allocator_type = std::pmr::polymorphic_allocator<DataT>;
+
+  //! Constructs empty Fenwick tree, that allocates nothing until Add
+  FenwickTree() = default;
+
+  //! Constructs empty Fenwick tree allocating with given allocator
+  explicit FenwickTree(const allocator_type &alloc) : tree_(alloc) {
   }
 
   //! Costruct Fenwick tree of given size filled with zeros
-  explicit FenwickTree(SizeT size)
-      : tree_(static_cast<std::size_t>(size) + 1, 0) {
+  explicit FenwickTree(SizeT size, const allocator_type &alloc = {})
+      : tree_(static_cast<std::size_t>(size) + 1, 0, alloc) {
+  }
+
+  //! Construct Fenwick tree over given counts in linear time
+  explicit FenwickTree(std::span<const DataT> counts,
+                       const allocator_type &alloc = {})
+      : tree_(counts.size() + 1, 0, alloc) {
+    for (std::size_t idx = 1; idx < tree_.size(); ++idx) {
+      tree_[idx] += counts[idx - 1];
+      total_sum_ += counts[idx - 1];
+      if (std::size_t parent = idx + (idx & -idx); parent < tree_.size()) {
+        tree_[parent] += tree_[idx];
+      }
+    }
+  }
+
+  FenwickTree(const FenwickTree &other) = default;
+  FenwickTree(FenwickTree &&other) = default;
+  FenwickTree &operator=(const FenwickTree &other) = default;
+  FenwickTree &operator=(FenwickTree &&other) = default;
+
+  //! Copy tree into storage allocated with given allocator
+  FenwickTree(const FenwickTree &other, const allocator_type &alloc)
+      : tree_(other.tree_, alloc), total_sum_(other.total_sum_) {
+  }
+
+  //! Move tree, copying if other uses different allocator
+  FenwickTree(FenwickTree &&other, const allocator_type &alloc)
+      : tree_(std::move(other.tree_), alloc), total_sum_(other.total_sum_) {
   }
 
   //! Return number of elements in Fenwick tree
   SizeT Size() const {
-    return static_cast<SizeT>(tree_.size()) - 1;
+    return tree_.empty() ? 0 : static_cast<SizeT>(tree_.size()) - 1;
   }
 
 
   //! Resize tree: shrink or expand
   void Resize(SizeT new_size) {
     new_size += 1;
-    auto old_size = Size() + 1;
+    SizeT old_size = tree_.empty() ? 1 : Size() + 1;
     tree_.resize(new_size, 0);
     for (SizeT idx = old_size; idx < new_size; ++idx) {
       auto sum = Sum(idx - (idx & -idx), old_size - 2);
@@ -63,9 +105,15 @@ class FenwickTree {
     return total_sum_;
   }
 
-  //! Add x to element at given index
-  void Add(SizeT idx, DataT x) {
-    if (idx >= Size()) {
+  //! Array of the tree, that queries read, to prefetch it before them
+  const DataT *Data() const {
+    return tree_.data();
+  }
+
+  //! Add x to element at given index, return whether tree was resized
+  bool Add(SizeT idx, DataT x) {
+    bool resized = idx >= Size();
+    if (resized) {
       Resize(idx + 1);
     }
     idx++;
@@ -73,6 +121,23 @@ class FenwickTree {
       tree_[idx] += x;
     }
     total_sum_ += x;
+    return resized;
+  }
+
+  //! Add x to element at given index with atomic operations, so it may
+  //! be called from many threads at once, while the tree isn't resized.
+  //! Return false without adding if index is out of size
+  bool AddConcurrent(SizeT idx, DataT x) {
+    if (idx >= Size()) {
+      return false;
+    }
+    idx++;
+    for (; idx < Size() + 1; idx += (idx & -idx)) {
+      std::atomic_ref<DataT>(tree_[idx]).fetch_add(x,
+                                                   std::memory_order_relaxed);
+    }
+    std::atomic_ref<DataT>(total_sum_).fetch_add(x, std::memory_order_relaxed);
+    return true;
   }
 
   //! Upper bound on prefix sums
@@ -87,7 +152,46 @@ class FenwickTree {
     }
     return idx;
   }
-  
+
+  //! Upper bounds of all the sorted xs in one descent: queries share the
+  //! nodes visited until they part, then each branch goes on with its own
+  //! part of them. out[i] is set to UpperBound(xs[i])
+  void UpperBounds(std::span<const DataT> xs, std::span<SizeT> out) const {
+    UpperBounds(xs, out, 0, std::__bit_floor(tree_.size()), 0);
+  }
+
+  //! Upper bounds on prefix sums of the trees added up, trees may differ
+  //! in size and nullptr ones are skipped. All the sorted xs are resolved
+  //! in one descent over the trees at once like in UpperBounds, so it
+  //! takes O(log n) sums per query instead of binary search over Sum.
+  //! bases is the scratch of prefix sums reused between calls
+  static void UpperBounds(std::span<const FenwickTree *const> trees,
+                          std::span<const DataT> xs, std::span<SizeT> out,
+                          std::vector<DataT> &bases) {
+    std::size_t size = 0;
+    for (const FenwickTree *tree : trees) {
+      if (tree != nullptr) {
+        size = std::max(size, tree->tree_.size());
+      }
+    }
+    SizeT lmb = std::__bit_floor(size);
+    // a frame of prefix sums for each level the descent may branch at
+    bases.resize(trees.size() * (std::bit_width(size) + 1));
+    std::fill_n(bases.begin(), trees.size(), 0);
+    UpperBounds(trees, xs, out, 0, lmb, static_cast<SizeT>(size),
+                bases.data());
+  }
+
+  //! Bytes taken by the tree including allocated storage
+  std::size_t MemoryUsage() const {
+    return sizeof(*this) + VectorBytes(tree_);
+  }
+
+  //! Give back storage exceeding the size
+  void ShrinkToFit() {
+    tree_.shrink_to_fit();
+  }
+
   std::vector<DataT> AsCounter() const {
     std::vector<DataT> counter(Size());
     for (int i = 0; i < counter.size(); ++i) {
@@ -97,8 +201,97 @@ class FenwickTree {
   }
 
  private:
-  std::vector<DataT> tree_;
+  std::pmr::vector<DataT> tree_;
   DataT total_sum_ = 0;
+
+  //! Descend from node idx with step lmb for xs, base is the sum of
+  //! elements before idx
+  void UpperBounds(std::span<const DataT> xs, std::span<SizeT> out,
+                   SizeT idx, SizeT lmb, DataT base) const {
+    for (; lmb >= 1 && xs.size() > 1; lmb >>= 1) {
+      if (idx + lmb >= static_cast<SizeT>(tree_.size())) {
+        continue;
+      }
+      DataT bound = base + tree_[idx + lmb];
+      std::size_t split = Split(xs, bound);
+      if (split > 0 && split < xs.size()) {
+        UpperBounds(xs.subspan(split), out.subspan(split), idx + lmb,
+                    lmb >> 1, bound);
+        xs = xs.first(split);
+        out = out.first(split);
+      } else if (split == 0) {
+        idx += lmb;
+        base = bound;
+      }
+    }
+    if (xs.size() == 1) {
+      // the single query goes on like in UpperBound, but with conditional
+      // moves instead of branches
+      DataT x = xs[0] - base;
+      auto size = static_cast<SizeT>(tree_.size());
+      for (; lmb >= 1; lmb >>= 1) {
+        SizeT node = idx + lmb;
+        DataT value = tree_[node < size ? node : 0];
+        bool right = node < size && value <= x;
+        idx = right ? node : idx;
+        x -= right ? value : 0;
+      }
+    }
+    std::fill(out.begin(), out.end(), idx);
+  }
+
+  //! Descend over the trees from node idx with step lmb for xs, nodes are
+  //! below size. bases[i] is the sum of elements of trees[i] before idx,
+  //! the next frame of bases is used for the nodes tried
+  static void UpperBounds(std::span<const FenwickTree *const> trees,
+                          std::span<const DataT> xs, std::span<SizeT> out,
+                          SizeT idx, SizeT lmb, SizeT size, DataT *bases) {
+    std::size_t count = trees.size();
+    DataT *next = bases + count;
+    for (; lmb >= 1 && !xs.empty(); lmb >>= 1) {
+      SizeT node = idx + lmb;
+      if (node >= size) {
+        continue;
+      }
+      // node covers elements [idx, node) of each tree, or the rest of
+      // the shorter ones
+      DataT bound = 0;
+      for (std::size_t i = 0; i < count; ++i) {
+        const FenwickTree *tree = trees[i];
+        if (tree == nullptr) {
+          next[i] = 0;
+        } else if (node < static_cast<SizeT>(tree->tree_.size())) {
+          next[i] = bases[i] + tree->tree_[node];
+        } else {
+          next[i] = tree->total_sum_;
+        }
+        bound += next[i];
+      }
+      std::size_t split = Split(xs, bound);
+      if (split > 0 && split < xs.size()) {
+        UpperBounds(trees, xs.subspan(split), out.subspan(split), node,
+                    lmb >> 1, size, next);
+        xs = xs.first(split);
+        out = out.first(split);
+      } else if (split == 0) {
+        idx = node;
+        std::copy(next, next + count, bases);
+      }
+    }
+    std::fill(out.begin(), out.end(), idx);
+  }
+
+  //! Number of the sorted xs less than bound. Binary search is written
+  //! to compile into conditional moves, as the queries are random
+  static std::size_t Split(std::span<const DataT> xs, DataT bound) {
+    const DataT *first = xs.data();
+    for (std::size_t size = xs.size(); size > 1;) {
+      std::size_t half = size / 2;
+      first = first[half - 1] < bound ? first + half : first;
+      size -= half;
+    }
+    return static_cast<std::size_t>(first - xs.data()) + (*first < bound);
+  }
 };
 
 }  // namespace evolv::internal
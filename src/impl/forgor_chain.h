@@ -1,13 +1,20 @@
 #pragma once
 
-#include <chrono>
+#include <algorithm>
+#include <cassert>
 #include <cstdint>
 #include <deque>
-#include <random>
-#include <unordered_map>
+#include <memory_resource>
+#include <optional>
+#include <span>
+#include <vector>
 
 #include "base_chain.h"
+#include "delta_log.h"
 #include "fenwick_tree.h"
+#include "generator.h"
+#include "random.h"
+#include "simulator.h"
 
 
 namespace evolv::internal {
@@ -21,34 +28,51 @@ namespace evolv::internal {
   The more transitions from state A to state B -> the more probability
   that standing in state A the chain will predict state B.
 */
-template <class CodeT>
-  requires std::integral<CodeT>
-class ForgorChain : public BaseChain<CodeT> {
-  using typename BaseChain<CodeT>::FenwickCounter;
-  using BaseChain<CodeT>::memory_size_;
-  using BaseChain<CodeT>::memory_;
-  using BaseChain<CodeT>::rng_;
+template <class CodeT, class RngT = Xoshiro256pp,
+          class MetricsT = NoMetrics>
+  requires std::integral<CodeT> && utils::is_random_generator<RngT>
+class ForgorChain : public BaseChain<CodeT, RngT, MetricsT> {
+  using typename BaseChain<CodeT, RngT, MetricsT>::CountT;
+  using typename BaseChain<CodeT, RngT, MetricsT>::FenwickCounter;
+  using BaseChain<CodeT, RngT, MetricsT>::memory_size_;
+  using BaseChain<CodeT, RngT, MetricsT>::memory_;
+  using BaseChain<CodeT, RngT, MetricsT>::rng_;
+  using BaseChain<CodeT, RngT, MetricsT>::metrics_;
+  using BaseChain<CodeT, RngT, MetricsT>::deltas_;
 
  public:
-  using BaseChain<CodeT>::UpdateMemory;
-  using BaseChain<CodeT>::GetMemory;
+  using BaseChain<CodeT, RngT, MetricsT>::UpdateMemory;
+  using BaseChain<CodeT, RngT, MetricsT>::GetMemory;
 
-  explicit ForgorChain(int random_state) : BaseChain<CodeT>(1, random_state) {
+  //! Initialize memory_ and rng_, counters allocate from given resource
+  explicit ForgorChain(uint64_t random_state,
+                       std::pmr::memory_resource *resource =
+                           std::pmr::get_default_resource())
+      : BaseChain<CodeT, RngT, MetricsT>(1, random_state),
+        transitions_(resource) {
   }
 
   //! Learn from sequence and move to last state in sequence if needed or if
   //! there is no memory. This is the implementation of virtual FeedSequence 
   //! in BaseChain
   void FeedSequence(EncodingIter<CodeT> it, EncodingIter<CodeT> end,
-                    bool update_memory) {
-    FeedSequenceImpl(std::move(it), std::move(end), update_memory);
+                    bool update_memory, int64_t weight) {
+    FeedSequenceImpl(std::move(it), std::move(end), update_memory, weight);
+  }
+
+  //! Learn from sequence of codes, bypassing encoding. This is the
+  //! implementation of virtual FeedCodes in BaseChain
+  void FeedCodes(std::span<const CodeT> codes, bool update_memory,
+                 int64_t weight) {
+    FeedSequenceImpl(codes.begin(), codes.end(), update_memory, weight);
   }
 
   //! Learn from sequence and move to last state in sequence if needed or if
   //! there is no memory. This is the implementation called either from
   //! virtual FeedSequence or directly (in tests, for example)
   template <class IterT>
-  void FeedSequenceImpl(IterT it, IterT end, bool update_memory = false) {
+  void FeedSequenceImpl(IterT it, IterT end, bool update_memory = false,
+                        int64_t weight = 1) {
     if (it == end) {
       return;
     }
@@ -56,7 +80,10 @@ class ForgorChain : public BaseChain<CodeT> {
     CodeT state = *it;
     ++it;
     for (; it != end; ++it) {
-      transitions_.Get(state).Add(*it, 1);
+      if (transitions_.Get(state).Add(*it, weight)) {
+        metrics_.CountResize();
+      }
+      deltas_.Record(state, 0, *it, weight);
       state = *it;
     }
     if (update_memory || memory_.empty()) {
@@ -64,30 +91,223 @@ class ForgorChain : public BaseChain<CodeT> {
     }
   }
 
+  //! Learn from sequence of codes from many threads at once, see
+  //! BaseChain::CountConcurrent. Transitions into the first context codes
+  //! aren't counted. Memory isn't updated
+  void FeedCodesConcurrent(std::span<const CodeT> codes,
+                           std::size_t context = 0) {
+    std::vector<TransitionDelta<CodeT>> transitions;
+    for (std::size_t i = std::max<std::size_t>(context, 1); i < codes.size();
+         ++i) {
+      transitions.push_back({codes[i - 1], 0, codes[i], 1});
+    }
+    this->CountConcurrent(
+        transitions, [this] { return transitions_.NumRows(); },
+        [this](std::size_t rows) { transitions_.Reserve(rows); },
+        [this](const TransitionDelta<CodeT> &transition) {
+          FenwickCounter *counter = transitions_.Find(transition.from);
+          return counter != nullptr &&
+                 counter->AddConcurrent(transition.to, transition.delta);
+        },
+        [this](const TransitionDelta<CodeT> &transition) {
+          return transitions_.Get(transition.from)
+              .Add(transition.to, transition.delta);
+        });
+  }
+
   //! Predict the subsequent state based on current state and possibly memory,
   //! move to predicted state if needed
   CodeT PredictState(bool update_memory = false) {
     assert(!memory_.empty() && "Call FeedSequence at least once");
-    int64_t x = rng_() % transitions_.Get(memory_[0]).TotalSum();
-    CodeT next_state = transitions_.Get(memory_[0]).UpperBound(x);
-    if (update_memory) {
-      UpdateMemory(next_state);
+    std::optional<CodeT> next_state = TryPredictState(update_memory);
+    assert(next_state && "No transitions from current state");
+    return *next_state;
+  }
+
+  //! Predict like PredictState, but nullopt if there are no transitions
+  //! or nothing was fed yet
+  std::optional<CodeT> TryPredictState(bool update_memory = false) {
+    std::optional<CodeT> next_state =
+        memory_.empty() ? std::nullopt : SampleNext();
+    if (next_state && update_memory) {
+      UpdateMemory(*next_state);
     }
     return next_state;
   }
 
+  //! Append k samples of the subsequent state in order of codes, resolved
+  //! in one descent of the counter of current state. Memory isn't moved
+  bool PredictStates(std::size_t k, std::vector<CodeT> &out) {
+    const FenwickCounter *counter =
+        memory_.empty() ? nullptr : FindCounter(memory_[0]);
+    if (counter == nullptr || counter->TotalSum() == 0) {
+      return false;
+    }
+    std::span<const CountT> xs = this->DrawSortedUniforms(
+        k, counter->TotalSum());
+    out.resize(out.size() + k);
+    counter->UpperBounds(xs, std::span(out).last(k));
+    return true;
+  }
+
+  //! Lazily predict subsequent states moving to each of them, ends when
+  //! there are no transitions from current state
+  Generator<CodeT> WalkCodes() {
+    assert(!memory_.empty() && "Call FeedSequence at least once");
+    for (std::optional<CodeT> next = SampleNext(); next; next = SampleNext()) {
+      UpdateMemory(*next);
+      co_yield *next;
+    }
+  }
+
+  //! Fill the size of transition counters and memory
+  void FillStats(ChainStats &stats) const {
+    transitions_.FillStats(stats);
+    stats.bytes.counters += deltas_.MemoryUsage();
+    stats.bytes.memory += this->MemoryBytes();
+  }
+
+  //! Give back storage of counters and memory exceeding their size
+  void ShrinkToFit() {
+    transitions_.ShrinkToFit();
+    memory_.shrink_to_fit();
+  }
+
+  //! Add deltas to transition counts, depth is always 0
+  void ApplyDeltas(std::span<const TransitionDelta<CodeT>> deltas) {
+    for (const TransitionDelta<CodeT> &delta : deltas) {
+      assert(delta.depth == 0 && "ForgorChain tracks only current state");
+      if (transitions_.Get(delta.from).Add(delta.to, delta.delta)) {
+        metrics_.CountResize();
+      }
+    }
+  }
+
+  //! Append all non-zero transition counts
+  void CollectCounts(std::vector<TransitionDelta<CodeT>> &counts) const {
+    transitions_.CollectCounts(counts);
+  }
+
+  //! Drop all transition counts
+  void ClearCounts() {
+    transitions_.Clear();
+  }
+
+  //! Simulate independent walkers starting from given states, see Simulator
+  void Simulate(std::span<const CodeT> starts, int steps,
+                std::span<const CodeT> targets, std::size_t num_codes,
+                SimulationCounts &counts, int threads) {
+    Simulator<ForgorChain, CodeT, RngT>(*this, targets, num_codes)
+        .Run(starts, steps, rng_(), counts, threads);
+  }
+
+  //! Get counter of transitions from given state, nullptr if there are none.
+  //! Depth is always 0 as only current state is tracked
+  const FenwickCounter *FindCounter(CodeT from,
+                                    [[maybe_unused]] int depth = 0) const {
+    return transitions_.Find(from);
+  }
+
+  //! Sample the subsequent state from the counter of current state with
+  //! the given generator, nullopt if there are no transitions
+  std::optional<CodeT> SampleFrom(const FenwickCounter *const *counters,
+                                  [[maybe_unused]] int depth_count,
+                                  RngT &rng) const {
+    const FenwickCounter *counter = counters[0];
+    if (counter == nullptr || counter->TotalSum() == 0) {
+      return std::nullopt;
+    }
+    auto x = static_cast<CountT>(UniformBelow(rng, counter->TotalSum()));
+    return static_cast<CodeT>(counter->UpperBound(x));
+  }
+
  private:
+  //! Counters of transitions indexed by code of the source state, as
+  //! codes are dense. Counters of states without transitions are empty
+  //! and allocate nothing
   class TransitCounters {
    public:
+    explicit TransitCounters(std::pmr::memory_resource *resource)
+        : counters_(resource) {
+    }
+
     FenwickCounter &Get(CodeT from) {
+      if (static_cast<std::size_t>(from) >= counters_.size()) {
+        counters_.resize(static_cast<std::size_t>(from) + 1);
+      }
       return counters_[from];
     }
 
+    //! Number of rows, states without transitions have empty ones
+    std::size_t NumRows() const {
+      return counters_.size();
+    }
+
+    //! Grow to hold at least given number of rows, taking the slack
+    //! allocated by the vector, so it's grown again only when it's full
+    void Reserve(std::size_t rows) {
+      if (counters_.size() < rows) {
+        counters_.resize(rows);
+        counters_.resize(counters_.capacity());
+      }
+    }
+
+    const FenwickCounter *Find(CodeT from) const {
+      return static_cast<std::size_t>(from) < counters_.size() &&
+                     counters_[from].Size() > 0
+                 ? &counters_[from]
+                 : nullptr;
+    }
+
+    FenwickCounter *Find(CodeT from) {
+      return static_cast<std::size_t>(from) < counters_.size() &&
+                     counters_[from].Size() > 0
+                 ? &counters_[from]
+                 : nullptr;
+    }
+
+    //! Fill number of rows, transitions and bytes taken
+    void FillStats(ChainStats &stats) const {
+      stats.bytes.counters += sizeof(counters_) + VectorBytes(counters_);
+      for (const FenwickCounter &counter : counters_) {
+        if (counter.Size() > 0) {
+          stats.rows++;
+          stats.transitions += counter.TotalSum();
+          stats.bytes.counters += counter.MemoryUsage() - sizeof(counter);
+        }
+      }
+    }
+
+    //! Append non-zero counts ordered by transition
+    void CollectCounts(std::vector<TransitionDelta<CodeT>> &counts) const {
+      for (std::size_t from = 0; from < counters_.size(); ++from) {
+        AppendCounts(static_cast<CodeT>(from), 0, counters_[from], counts);
+      }
+    }
+
+    void Clear() {
+      counters_.clear();
+      counters_.shrink_to_fit();
+    }
+
+    void ShrinkToFit() {
+      for (FenwickCounter &counter : counters_) {
+        counter.ShrinkToFit();
+      }
+      counters_.shrink_to_fit();
+    }
+
    private:
-    std::unordered_map<CodeT, FenwickCounter> counters_;
+    std::pmr::vector<FenwickCounter> counters_;
   };
   // For all states count transitions to each state
   TransitCounters transitions_;
+
+  //! Sample the subsequent state from the current one
+  std::optional<CodeT> SampleNext() {
+    const FenwickCounter *counter = FindCounter(memory_[0]);
+    return SampleFrom(&counter, 1, rng_);
+  }
 };
 
 }  // namespace evolv::internal
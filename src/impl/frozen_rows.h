@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "random.h"
+#include "utils.h"
+
+
+namespace evolv::internal {
+
+/*!
+  \brief Transition counts of a frozen model in constexpr arrays
+
+  Rows are laid out by source state, then by depth: the row of state from
+  at depth is from * kMemorySize + depth. Each row keeps targets with
+  non-zero counts in ascending order and inclusive prefix sums of their
+  counts, so sampling searches the prefix sums of one row. It's an
+  aggregate of arrays with sizes known at compile time, so the model
+  written as header, see WriteFrozenHeader, is built by the compiler into
+  read-only data and may be sampled in constant expressions.
+*/
+template <class CodeT, int kMemorySize, std::size_t kNumStates,
+          std::size_t kNumEntries>
+  requires std::integral<CodeT> && (kMemorySize > 0) &&
+           (kNumEntries <= std::numeric_limits<uint32_t>::max())
+struct FrozenRows {
+  static constexpr std::size_t kNumRows = kNumStates * kMemorySize;
+
+  //! Index of the first entry of each row with the extra one ending the
+  //! last row
+  std::array<uint32_t, kNumRows + 1> entry_begin;
+  //! Target states of entries
+  std::array<CodeT, kNumEntries> targets;
+  //! Sums of counts of the row up to and including the entry
+  std::array<int64_t, kNumEntries> prefix_sums;
+
+  //! Sample the subsequent state after remembered ones, where memory[0]
+  //! is the last one. Nullopt if there are no transitions
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  constexpr std::optional<CodeT> PredictCode(std::span<const CodeT> memory,
+                                             RngT &rng) const {
+    int64_t total = 0;
+    for (int depth = 0; depth < Depths(memory); ++depth) {
+      total += RowTotal(memory[depth], depth);
+    }
+    if (total == 0) {
+      return std::nullopt;
+    }
+    auto x = static_cast<int64_t>(UniformBelow(rng, total));
+    for (int depth = 0;; ++depth) {
+      int64_t row_total = RowTotal(memory[depth], depth);
+      if (x < row_total) {
+        std::size_t row = RowOf(memory[depth], depth);
+        auto first = prefix_sums.begin() + entry_begin[row];
+        auto last = prefix_sums.begin() + entry_begin[row + 1];
+        return targets[std::upper_bound(first, last, x) -
+                       prefix_sums.begin()];
+      }
+      x -= row_total;
+    }
+  }
+
+ private:
+  static constexpr int Depths(std::span<const CodeT> memory) {
+    return std::min(static_cast<int>(memory.size()), kMemorySize);
+  }
+
+  static constexpr std::size_t RowOf(CodeT from, int depth) {
+    return static_cast<std::size_t>(from) * kMemorySize + depth;
+  }
+
+  //! Sum of counts of the row, 0 for states that aren't coded
+  constexpr int64_t RowTotal(CodeT from, int depth) const {
+    if (from < 0 || static_cast<std::size_t>(from) >= kNumStates) {
+      return 0;
+    }
+    std::size_t row = RowOf(from, depth);
+    return entry_begin[row] == entry_begin[row + 1]
+               ? 0
+               : prefix_sums[entry_begin[row + 1] - 1];
+  }
+};
+
+
+//! Name of integral type as written in generated header
+template <class T>
+  requires std::integral<T>
+std::string IntegralTypeName() {
+  if constexpr (std::same_as<T, int>) {
+    return "int";
+  } else {
+    return std::string(std::is_signed_v<T> ? "int" : "uint") +
+           std::to_string(8 * sizeof(T)) + "_t";
+  }
+}
+
+
+//! How states of StateT are stored in frozen models and written into
+//! generated header. Integral states are stored as they are
+template <class StateT>
+struct FrozenState {};
+
+template <class StateT>
+  requires std::integral<StateT>
+struct FrozenState<StateT> {
+  using Type = StateT;
+
+  static std::string TypeName() {
+    return IntegralTypeName<StateT>();
+  }
+
+  static void Write(std::ostream &os, StateT state) {
+    if constexpr (std::is_signed_v<StateT>) {
+      // the least value isn't a literal, as literals aren't negative
+      if (state == std::numeric_limits<StateT>::min()) {
+        os << '(' << static_cast<int64_t>(state) + 1 << " - 1)";
+        return;
+      }
+      os << static_cast<int64_t>(state);
+    } else {
+      os << static_cast<uint64_t>(state) << 'u';
+    }
+  }
+};
+
+//! Strings are stored as views of literals
+template <>
+struct FrozenState<std::string> {
+  using Type = std::string_view;
+
+  static std::string TypeName() {
+    return "std::string_view";
+  }
+
+  //! Write string literal, bytes that aren't printable are escaped in
+  //! octal, as octal escapes take at most 3 digits
+  static void Write(std::ostream &os, const std::string &state) {
+    os << '"';
+    for (char c : state) {
+      auto byte = static_cast<unsigned char>(c);
+      if (c == '"' || c == '\\') {
+        os << '\\' << c;
+      } else if (byte >= 0x20 && byte < 0x7f) {
+        os << c;
+      } else {
+        os << '\\' << static_cast<char>('0' + (byte >> 6))
+           << static_cast<char>('0' + ((byte >> 3) & 7))
+           << static_cast<char>('0' + (byte & 7));
+      }
+    }
+    os << '"';
+  }
+};
+
+//! Concept for checking if chain of states of StateT may be frozen
+template <class StateT>
+concept is_freezable_state = requires {
+  typename FrozenState<StateT>::Type;
+};
+
+}  // namespace evolv::internal
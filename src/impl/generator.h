@@ -0,0 +1,124 @@
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <ranges>
+#include <type_traits>
+#include <utility>
+
+
+namespace evolv::internal {
+
+/*!
+  \brief Lazily evaluated range of values yielded by coroutine
+
+  Minimal replacement of C++23 std::generator. It's an input view, so it
+  works with range adaptors like std::views::take_while. Yielded values
+  aren't copied: iterator refers to the value given to co_yield, which
+  lives in the coroutine frame until the coroutine is resumed. RefT is
+  the type of dereferenced iterator, like const T & or T.
+*/
+template <class RefT>
+class Generator : public std::ranges::view_interface<Generator<RefT>> {
+  using ValueT = std::remove_cvref_t<RefT>;
+
+ public:
+  struct promise_type {
+    const ValueT *value = nullptr;
+
+    Generator get_return_object() {
+      return Generator(Handle::from_promise(*this));
+    }
+
+    std::suspend_always initial_suspend() noexcept {
+      return {};
+    }
+
+    std::suspend_always final_suspend() noexcept {
+      return {};
+    }
+
+    //! Keep the address of yielded value, that lives until resume
+    std::suspend_always yield_value(const ValueT &yielded) noexcept {
+      value = std::addressof(yielded);
+      return {};
+    }
+
+    void return_void() {
+    }
+
+    void unhandled_exception() {
+      throw;
+    }
+  };
+
+  using Handle = std::coroutine_handle<promise_type>;
+
+  class Iterator {
+   public:
+    using value_type = ValueT;
+    using difference_type = std::ptrdiff_t;
+
+    Iterator() = default;
+
+    explicit Iterator(Handle handle) : handle_(handle) {
+    }
+
+    RefT operator*() const {
+      return *handle_.promise().value;
+    }
+
+    //! Resume coroutine until the next value is yielded
+    Iterator &operator++() {
+      handle_.resume();
+      return *this;
+    }
+
+    void operator++(int) {
+      ++*this;
+    }
+
+    bool operator==(std::default_sentinel_t) const {
+      return handle_.done();
+    }
+
+   private:
+    Handle handle_;
+  };
+
+  Generator(Generator &&other) noexcept
+      : handle_(std::exchange(other.handle_, {})) {
+  }
+
+  Generator &operator=(Generator &&other) noexcept {
+    std::swap(handle_, other.handle_);
+    return *this;
+  }
+
+  ~Generator() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  //! Run coroutine until the first value, may be called only once
+  Iterator begin() {
+    handle_.resume();
+    return Iterator(handle_);
+  }
+
+  std::default_sentinel_t end() const {
+    return {};
+  }
+
+ private:
+  Handle handle_;
+
+  explicit Generator(Handle handle) : handle_(handle) {
+  }
+};
+
+}  // namespace evolv::internal
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+#include "memory_usage.h"
+#include "state_coder.h"
+#include "utils.h"
+
+
+namespace evolv::internal {
+
+/*!
+  \brief Coder of non-negative integral states into themselves
+
+  Codes must be dense, as transition counters are indexed by them, like
+  event IDs or enum values. Size() is the maximum seen state plus one,
+  so it counts the states that weren't seen but lie below the maximum.
+*/
+template <class StateT, class CodeT>
+  requires std::integral<StateT> && std::integral<CodeT>
+class IdentityCoder {
+ public:
+  using StateType = StateT;
+  using CodeType = CodeT;
+  //! Marks that codes are states themselves
+  static constexpr bool kIdentity = true;
+
+  //! Resource is accepted for uniformity with StateCoder, nothing is stored
+  explicit IdentityCoder(std::pmr::memory_resource * =
+                             std::pmr::get_default_resource()) {
+  }
+
+  //! Map state to code, which is the state itself
+  CodeT Encode(const StateT &state) {
+    if constexpr (std::is_signed_v<StateT>) {
+      assert(state >= 0 && "IdentityCoder codes only non-negative states");
+    }
+    auto code = static_cast<CodeT>(state);
+    size_ = std::max(size_, static_cast<std::size_t>(code) + 1);
+    return code;
+  }
+
+  //! Map states to codes from many threads at once, while other methods
+  //! aren't called. Size() grows with atomic maximum once per call
+  template <class IterT>
+  void EncodeConcurrent(IterT it, IterT end, std::vector<CodeT> &codes) {
+    std::size_t size = 0;
+    for (; it != end; ++it) {
+      if constexpr (std::is_signed_v<StateT>) {
+        assert(*it >= 0 && "IdentityCoder codes only non-negative states");
+      }
+      codes.push_back(static_cast<CodeT>(*it));
+      size = std::max(size, static_cast<std::size_t>(codes.back()) + 1);
+    }
+    std::atomic_ref<std::size_t> size_ref(size_);
+    std::size_t seen = size_ref.load();
+    while (seen < size && !size_ref.compare_exchange_weak(seen, size)) {
+    }
+  }
+
+  //! Account codes fed directly, Size() grows to cover them
+  void Admit(std::span<const CodeT> codes) {
+    if (codes.empty()) {
+      return;
+    }
+    auto [min_code, max_code] = std::minmax_element(codes.begin(), codes.end());
+    if constexpr (std::is_signed_v<CodeT>) {
+      assert(*min_code >= 0 && "IdentityCoder codes only non-negative states");
+    }
+    size_ = std::max(size_, static_cast<std::size_t>(*max_code) + 1);
+  }
+
+  //! Map code to state, which is the code itself
+  StateT Decode(CodeT code) const {
+    return static_cast<StateT>(code);
+  }
+
+  //! Number of codes, that are in [0, Size())
+  std::size_t Size() const {
+    return size_;
+  }
+
+  std::size_t MemoryUsage() const {
+    return sizeof(*this);
+  }
+
+  void ShrinkToFit() {
+  }
+
+ private:
+  std::size_t size_ = 0;
+};
+
+
+/*!
+  \brief Coder of states in bounded range with direct-indexed table
+
+  The range is given by utils::StateRange specialized for StateT.
+  Codes are dense and assigned in first-seen order like in StateCoder,
+  but looking up the code is indexing the table instead of hashing.
+*/
+template <class StateT, class CodeT>
+  requires utils::has_state_range<StateT> && std::integral<CodeT>
+class TableCoder {
+ public:
+  using StateType = StateT;
+  using CodeType = CodeT;
+
+  static constexpr int64_t kMin = utils::StateRange<StateT>::kMin;
+  static constexpr int64_t kMax = utils::StateRange<StateT>::kMax;
+  //! Code of unknown state after Prune
+  static constexpr CodeT kUnknown = 0;
+
+  //! Construct coder allocating the table from given resource
+  explicit TableCoder(std::pmr::memory_resource *resource =
+                          std::pmr::get_default_resource())
+      : encoder_(kMax - kMin + 1, kNone, resource), decoder_(resource) {
+  }
+
+  //! Map state to code
+  CodeT Encode(const StateT &state) {
+    int64_t idx = Index(state);
+    assert(0 <= idx && idx <= kMax - kMin && "State is out of StateRange");
+    CodeT &code = encoder_[idx];
+    if (code == kNone) {
+      if (pruned_) {
+        return kUnknown;
+      }
+      code = static_cast<CodeT>(decoder_.size());
+      decoder_.push_back(state);
+    }
+    return code;
+  }
+
+  //! Map states to codes from many threads at once, while other methods
+  //! aren't called. The table never grows, so known states are looked up
+  //! without locking, new ones are coded under the lock
+  template <class IterT>
+  void EncodeConcurrent(IterT it, IterT end, std::vector<CodeT> &codes) {
+    for (; it != end; ++it) {
+      int64_t idx = Index(*it);
+      assert(0 <= idx && idx <= kMax - kMin && "State is out of StateRange");
+      std::atomic_ref<CodeT> code(encoder_[idx]);
+      if (pruned_ && code.load(std::memory_order_relaxed) == kNone) {
+        codes.push_back(kUnknown);
+        continue;
+      }
+      if (code.load(std::memory_order_acquire) == kNone) {
+        std::lock_guard lock(mutex_);
+        if (code.load(std::memory_order_relaxed) == kNone) {
+          decoder_.push_back(*it);
+          code.store(static_cast<CodeT>(decoder_.size() - 1),
+                     std::memory_order_release);
+        }
+      }
+      codes.push_back(code.load(std::memory_order_acquire));
+    }
+  }
+
+  //! Code of the state, nullopt if it isn't coded
+  std::optional<CodeT> Find(const StateT &state) const {
+    CodeT code = encoder_[Index(state)];
+    return code == kNone ? std::nullopt : std::optional(code);
+  }
+
+  //! Recode states like StateCoder::Prune
+  void Prune(std::span<const CodeT> new_codes, const StateT &unknown) {
+    assert(new_codes.size() == Size());
+    std::pmr::vector<StateT> decoder(1, unknown, decoder_.get_allocator());
+    for (CodeT &code : encoder_) {
+      if (code == kNone) {
+        continue;
+      }
+      StateT state = decoder_[code];
+      code = new_codes[code];
+      if (code != kUnknown) {
+        decoder.resize(std::max<std::size_t>(decoder.size(), code + 1));
+        decoder[code] = state;
+      }
+    }
+    assert(encoder_[Index(unknown)] == kNone ||
+           encoder_[Index(unknown)] == kUnknown);
+    encoder_[Index(unknown)] = kUnknown;
+    decoder_ = std::move(decoder);
+    pruned_ = true;
+  }
+
+  //! Renumber states like StateCoder::Recode
+  void Recode(std::span<const CodeT> new_codes) {
+    assert(new_codes.size() == Size());
+    std::pmr::vector<StateT> decoder(decoder_.size(), decoder_.get_allocator());
+    for (CodeT &code : encoder_) {
+      if (code != kNone) {
+        decoder[new_codes[code]] = decoder_[code];
+        code = new_codes[code];
+      }
+    }
+    decoder_ = std::move(decoder);
+  }
+
+  //! Whether Prune was called, then kUnknown is reserved
+  bool Pruned() const {
+    return pruned_;
+  }
+
+  //! Check that codes fed directly were given by this coder
+  void Admit([[maybe_unused]] std::span<const CodeT> codes) const {
+    assert(std::all_of(codes.begin(), codes.end(), [this](CodeT code) {
+      return 0 <= code && static_cast<std::size_t>(code) < Size();
+    }));
+  }
+
+  //! Map code to state
+  StateT Decode(CodeT code) const {
+    return decoder_[code];
+  }
+
+  //! Map code to reference to the stored state, without copying
+  const StateT &DecodeRef(CodeT code) const {
+    return decoder_[code];
+  }
+
+  //! Number of coded states, codes are in [0, Size())
+  std::size_t Size() const {
+    return decoder_.size();
+  }
+
+  //! Bytes taken by the table and the vector of states
+  std::size_t MemoryUsage() const {
+    return sizeof(*this) + VectorBytes(encoder_) + VectorBytes(decoder_);
+  }
+
+  //! Give back storage exceeding the number of coded states
+  void ShrinkToFit() {
+    decoder_.shrink_to_fit();
+  }
+
+ private:
+  static constexpr CodeT kNone = std::numeric_limits<CodeT>::max();
+
+  //! Code of each state in range or kNone if it's not seen yet
+  std::pmr::vector<CodeT> encoder_;
+  //! Stores mapping from code to state
+  std::pmr::vector<StateT> decoder_;
+  //! Guards coding of new states in EncodeConcurrent
+  std::mutex mutex_;
+  //! Whether Prune was called, so new states are unknown
+  bool pruned_ = false;
+
+  static int64_t Index(StateT state) {
+    if constexpr (std::is_enum_v<StateT>) {
+      return static_cast<int64_t>(
+                 static_cast<std::underlying_type_t<StateT>>(state)) -
+             kMin;
+    } else {
+      return static_cast<int64_t>(state) - kMin;
+    }
+  }
+};
+
+
+//! Coder used by MarkovChain by default: TableCoder if utils::StateRange
+//! is specialized for StateT, StateCoder otherwise
+template <class StateT, class CodeT>
+struct DefaultCoderOf {
+  using Type = StateCoder<StateT, CodeT>;
+};
+
+template <class StateT, class CodeT>
+  requires utils::has_state_range<StateT>
+struct DefaultCoderOf<StateT, CodeT> {
+  using Type = TableCoder<StateT, CodeT>;
+};
+
+}  // namespace evolv::internal
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "memory_usage.h"
+
+
+namespace evolv::internal {
+
+//! Counters of cache lookups, see LruCache::Stats
+struct CacheStats {
+  int64_t hits = 0;
+  int64_t misses = 0;
+  int64_t evictions = 0;
+  //! Bytes taken by cached values and bookkeeping
+  std::size_t bytes = 0;
+  std::size_t capacity = 0;
+
+  //! Fraction of lookups served from cache, 0 if there were none
+  double HitRate() const {
+    int64_t lookups = hits + misses;
+    return lookups == 0 ? 0 : static_cast<double>(hits) / lookups;
+  }
+};
+
+
+/*!
+  \brief Cache of values bounded by bytes, evicting the least recently used
+
+  Values are loaded on miss and held by shared_ptr, so the value taken
+  stays valid after it's evicted. Size of value is its MemoryUsage().
+  Value larger than the capacity of its shard is returned without
+  caching. Keys are split between shards by hash, each with its own lock,
+  list and share of capacity, so threads hitting different keys don't
+  wait for each other, and the least recently used is evicted within the
+  shard. Loading is done outside the lock, once per key: threads missing
+  the key being loaded wait for it. All methods are thread-safe.
+*/
+template <class KeyT, class ValueT>
+class LruCache {
+ public:
+  //! Cache of the given capacity split evenly between shards
+  explicit LruCache(std::size_t capacity_bytes, std::size_t num_shards = 1)
+      : capacity_(capacity_bytes),
+        shards_(std::max<std::size_t>(num_shards, 1)) {
+    for (Shard &shard : shards_) {
+      shard.capacity = capacity_ / shards_.size();
+    }
+  }
+
+  //! Get cached value of the key or load it with load(), that returns
+  //! ValueT. A key is loaded once, while its shard stays unlocked
+  template <class LoadT>
+  std::shared_ptr<const ValueT> Get(const KeyT &key, LoadT &&load) {
+    Shard &shard = ShardOf(key);
+    std::shared_ptr<Slot> slot;
+    bool missed = false;
+    {
+      std::lock_guard lock(shard.mutex);
+      if (auto it = shard.index.find(key); it != shard.index.end()) {
+        shard.entries.splice(shard.entries.begin(), shard.entries,
+                             it->second);
+        shard.hits++;
+        slot = it->second->slot;
+      } else {
+        shard.misses++;
+        slot = std::make_shared<Slot>();
+        missed = true;
+        // the entry takes only bookkeeping until the value is loaded
+        shard.entries.push_front({key, slot, kEntryBytes});
+        shard.index.emplace(key, shard.entries.begin());
+        shard.bytes += kEntryBytes;
+        shard.EvictOverCapacity();
+      }
+    }
+    std::call_once(slot->loaded, [&slot, &load] {
+      slot->value = std::make_shared<const ValueT>(load());
+    });
+    if (missed) {
+      shard.Admit(key, slot);
+    }
+    return slot->value;
+  }
+
+  //! Drop all the cached values, keeping the counters
+  void Clear() {
+    for (Shard &shard : shards_) {
+      std::lock_guard lock(shard.mutex);
+      shard.entries.clear();
+      shard.index.clear();
+      shard.bytes = 0;
+    }
+  }
+
+  CacheStats Stats() const {
+    CacheStats stats;
+    stats.capacity = capacity_;
+    for (const Shard &shard : shards_) {
+      std::lock_guard lock(shard.mutex);
+      stats.hits += shard.hits;
+      stats.misses += shard.misses;
+      stats.evictions += shard.evictions;
+      stats.bytes += shard.bytes;
+    }
+    return stats;
+  }
+
+ private:
+  //! Value of the key, loaded by the first thread that needs it
+  struct Slot {
+    std::once_flag loaded;
+    std::shared_ptr<const ValueT> value;
+  };
+
+  struct Entry {
+    KeyT key;
+    std::shared_ptr<Slot> slot;
+    std::size_t bytes;
+  };
+
+  //! Bookkeeping of entry: list node, index node and slot
+  static constexpr std::size_t kEntryBytes =
+      AllocatedBytes(2 * sizeof(void *) + sizeof(Entry)) +
+      AllocatedBytes(2 * sizeof(void *) + sizeof(KeyT) +
+                     sizeof(typename std::list<Entry>::iterator)) +
+      AllocatedBytes(2 * sizeof(void *) + sizeof(Slot)) +
+      AllocatedBytes(2 * sizeof(void *));
+
+  struct Shard {
+    std::size_t capacity = 0;
+    std::size_t bytes = 0;
+    int64_t hits = 0;
+    int64_t misses = 0;
+    int64_t evictions = 0;
+    //! Entries from the most recently used
+    std::list<Entry> entries;
+    std::unordered_map<KeyT, typename std::list<Entry>::iterator> index;
+    mutable std::mutex mutex;
+
+    //! Count bytes of the loaded value of the key, if it wasn't evicted
+    //! meanwhile, or drop it if it doesn't fit
+    void Admit(const KeyT &key, const std::shared_ptr<Slot> &slot) {
+      std::lock_guard lock(mutex);
+      auto it = index.find(key);
+      if (it == index.end() || it->second->slot != slot) {
+        return;
+      }
+      std::size_t value_bytes = slot->value->MemoryUsage();
+      if (value_bytes + kEntryBytes > capacity) {
+        bytes -= it->second->bytes;
+        entries.erase(it->second);
+        index.erase(it);
+        return;
+      }
+      // the entry may have become the least recently used one meanwhile,
+      // so it's moved to the front to not be evicted first
+      entries.splice(entries.begin(), entries, it->second);
+      it->second->bytes += value_bytes;
+      bytes += value_bytes;
+      EvictOverCapacity();
+    }
+
+    void EvictOverCapacity() {
+      while (bytes > capacity && !entries.empty()) {
+        const Entry &last = entries.back();
+        bytes -= last.bytes;
+        index.erase(last.key);
+        entries.pop_back();
+        evictions++;
+      }
+    }
+  };
+
+  std::size_t capacity_;
+  std::vector<Shard> shards_;
+
+  Shard &ShardOf(const KeyT &key) {
+    // std::hash of integers is identity, so it's mixed before taking shard
+    constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15;
+    uint64_t hash = std::hash<KeyT>{}(key) * kMultiplier;
+    return shards_[(hash >> 32) % shards_.size()];
+  }
+};
+
+}  // namespace evolv::internal
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace evolv::internal {
+
+//! Bytes taken by StateCoder, transition counters and memory
+struct MemoryReport {
+  std::size_t coder = 0;
+  std::size_t counters = 0;
+  std::size_t memory = 0;
+
+  std::size_t Total() const {
+    return coder + counters + memory;
+  }
+};
+
+
+//! Bytes actually taken from the heap by allocation of given size.
+//! Models glibc malloc: 8 bytes of header, 16 bytes alignment and
+//! 32 bytes of minimal chunk
+constexpr std::size_t AllocatedBytes(std::size_t requested) {
+  if (requested == 0) {
+    return 0;
+  }
+  return std::max<std::size_t>(32, (requested + 8 + 15) & ~std::size_t(15));
+}
+
+
+//! Heap bytes owned by the value besides its own size, none by default
+template <class T>
+std::size_t HeapBytes(const T &) {
+  return 0;
+}
+
+//! Heap bytes owned by the string, none if it fits into small string buffer
+template <class CharT, class TraitsT, class AllocT>
+std::size_t HeapBytes(const std::basic_string<CharT, TraitsT, AllocT> &str) {
+  auto data = reinterpret_cast<const char *>(str.data());
+  auto self = reinterpret_cast<const char *>(&str);
+  if (data >= self && data < self + sizeof(str)) {
+    return 0;
+  }
+  return AllocatedBytes((str.capacity() + 1) * sizeof(CharT));
+}
+
+
+//! Heap bytes of vector storage including the slack after size
+template <class T, class AllocT>
+std::size_t VectorBytes(const std::vector<T, AllocT> &vec) {
+  return AllocatedBytes(vec.capacity() * sizeof(T));
+}
+
+
+//! Heap bytes of hash table buckets and nodes, not including heap owned by
+//! keys and values. Node holds pointer to the next one, the value and,
+//! unless the key is integral, the cached hash
+template <class KeyT, class ValueT, class... ArgsT>
+std::size_t HashTableBytes(
+    const std::unordered_map<KeyT, ValueT, ArgsT...> &map) {
+  std::size_t node = sizeof(void *) + sizeof(std::pair<const KeyT, ValueT>);
+  if constexpr (!std::is_integral_v<KeyT>) {
+    node += sizeof(std::size_t);
+  }
+  // the single bucket is stored inside the table itself
+  std::size_t buckets =
+      map.bucket_count() > 1 ? map.bucket_count() * sizeof(void *) : 0;
+  return AllocatedBytes(buckets) + map.size() * AllocatedBytes(node);
+}
+
+}  // namespace evolv::internal
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "memory_usage.h"
+
+
+namespace evolv::internal {
+
+//! Snapshot of chain size, activity and latencies, see MarkovChain::Stats
+struct ChainStats {
+  //! Number of coded states
+  std::size_t states = 0;
+  //! Number of transition counters (Fenwick tree rows)
+  std::size_t rows = 0;
+  //! Total number of counted transitions
+  int64_t transitions = 0;
+
+  //! Number of FeedSequence and PredictState calls, collected with Metrics
+  int64_t feeds = 0;
+  int64_t predictions = 0;
+  //! Number of times a row was resized while learning, collected with Metrics
+  int64_t row_resizes = 0;
+  //! Latency percentiles in nanoseconds, collected with Metrics
+  int64_t feed_p50_ns = 0;
+  int64_t feed_p99_ns = 0;
+  int64_t predict_p50_ns = 0;
+  int64_t predict_p99_ns = 0;
+
+  //! Bytes taken by StateCoder, transition counters and memory
+  MemoryReport bytes;
+};
+
+
+/*!
+  \brief Histogram of latencies with logarithmic buckets
+
+  Each power of 2 is split into kSubBuckets linear buckets, so percentiles
+  are reported with relative error below 1 / kSubBuckets.
+*/
+class LatencyHistogram {
+ public:
+  static constexpr int kSubBits = 3;
+  static constexpr int kSubBuckets = 1 << kSubBits;
+
+  //! Record single value
+  void Record(int64_t nanos) {
+    buckets_[Bucket(static_cast<uint64_t>(nanos < 0 ? 0 : nanos))]++;
+    count_++;
+  }
+
+  int64_t Count() const {
+    return count_;
+  }
+
+  //! Add records of the other histogram, like collected by other thread
+  void Merge(const LatencyHistogram &other) {
+    for (int bucket = 0; bucket < kBuckets; ++bucket) {
+      buckets_[bucket] += other.buckets_[bucket];
+    }
+    count_ += other.count_;
+  }
+
+  //! Value below which given fraction of records lies, 0 if there are none
+  int64_t Percentile(double fraction) const {
+    if (count_ == 0) {
+      return 0;
+    }
+    auto rank = static_cast<int64_t>(fraction * (count_ - 1));
+    for (int bucket = 0; bucket < kBuckets; ++bucket) {
+      rank -= buckets_[bucket];
+      if (rank < 0) {
+        return Middle(bucket);
+      }
+    }
+    return Middle(kBuckets - 1);
+  }
+
+ private:
+  static constexpr int kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+  std::array<int64_t, kBuckets> buckets_{};
+  int64_t count_ = 0;
+
+  static int Bucket(uint64_t value) {
+    if (value < kSubBuckets) {
+      return static_cast<int>(value);
+    }
+    int exp = std::bit_width(value) - 1;
+    int sub = static_cast<int>(value >> (exp - kSubBits)) & (kSubBuckets - 1);
+    return (exp - kSubBits + 1) * kSubBuckets + sub;
+  }
+
+  static int64_t Middle(int bucket) {
+    if (bucket < kSubBuckets) {
+      return bucket;
+    }
+    int exp = bucket / kSubBuckets + kSubBits - 1;
+    int64_t width = int64_t(1) << (exp - kSubBits);
+    return (kSubBuckets + bucket % kSubBuckets) * width + width / 2;
+  }
+};
+
+
+/*!
+  \brief Metrics policy that collects nothing
+
+  All methods are empty, so with this policy chains have no overhead.
+*/
+class NoMetrics {
+ public:
+  static constexpr bool kEnabled = false;
+
+  struct TimePoint {};
+
+  TimePoint Now() const {
+    return {};
+  }
+
+  void RecordFeed(TimePoint) {
+  }
+
+  void RecordPredict(TimePoint) {
+  }
+
+  void CountResize() {
+  }
+
+  void Fill(ChainStats &) const {
+  }
+};
+
+
+/*!
+  \brief Metrics policy that counts row resizes and measures latencies
+  of FeedSequence and PredictState
+*/
+class Metrics {
+ public:
+  static constexpr bool kEnabled = true;
+
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  TimePoint Now() const {
+    return std::chrono::steady_clock::now();
+  }
+
+  //! Record latency of FeedSequence started at given time point
+  void RecordFeed(TimePoint start) {
+    feed_.Record(Since(start));
+  }
+
+  //! Record latency of PredictState started at given time point
+  void RecordPredict(TimePoint start) {
+    predict_.Record(Since(start));
+  }
+
+  void CountResize() {
+    row_resizes_++;
+  }
+
+  //! Write collected metrics into stats
+  void Fill(ChainStats &stats) const {
+    stats.feeds = feed_.Count();
+    stats.predictions = predict_.Count();
+    stats.row_resizes = row_resizes_;
+    stats.feed_p50_ns = feed_.Percentile(0.5);
+    stats.feed_p99_ns = feed_.Percentile(0.99);
+    stats.predict_p50_ns = predict_.Percentile(0.5);
+    stats.predict_p99_ns = predict_.Percentile(0.99);
+  }
+
+ private:
+  LatencyHistogram feed_, predict_;
+  int64_t row_resizes_ = 0;
+
+  static int64_t Since(TimePoint start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  }
+};
+
+}  // namespace evolv::internal
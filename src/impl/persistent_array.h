@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "memory_usage.h"
+
+
+namespace evolv::internal {
+
+/*!
+  \brief Immutable array sharing storage between versions
+
+  Values are kept in pages of kPageSize, that are leaves of a tree with
+  kFanout children in each inner node. Copying the array copies only the
+  pointer to the root, and Editor copies only the pages it changes and
+  the nodes on the paths to them, so the new version costs the changed
+  pages times the height of the tree, while everything else is shared
+  with the old version, that stays the same.
+*/
+template <class T>
+class PersistentArray {
+  static constexpr int kPageBits = 8;
+  static constexpr int kFanoutBits = 5;
+
+  //! Inner node with children or page with values
+  struct Node {
+    //! Id of the editor that made the node
+    uint64_t owner = 0;
+    std::vector<std::shared_ptr<Node>> children;
+    std::vector<T> values;
+  };
+
+ public:
+  static constexpr std::size_t kPageSize = std::size_t{1} << kPageBits;
+  static constexpr std::size_t kFanout = std::size_t{1} << kFanoutBits;
+
+  //! Number of elements, the ones never set are default constructed
+  std::size_t Size() const {
+    return size_;
+  }
+
+  const T &operator[](std::size_t idx) const {
+    assert(idx < size_);
+    const Node *page = FindPage(idx);
+    if (page == nullptr) {
+      static const T kDefault{};
+      return kDefault;
+    }
+    return page->values[idx % kPageSize];
+  }
+
+  //! Whether the element is stored in the same page in both arrays
+  bool SharesPage(const PersistentArray &other, std::size_t idx) const {
+    const Node *page = FindPage(idx);
+    return page != nullptr && page == other.FindPage(idx);
+  }
+
+  //! Bytes taken by nodes and pages, including the shared ones
+  std::size_t MemoryUsage() const {
+    return sizeof(*this) + NodeBytes(root_.get(), height_);
+  }
+
+  /*!
+    \brief Builder of the new version of array
+
+    Node is copied when it's changed the first time, then it's changed in
+    place, as nobody else refers to it. Nodes copied by the editor are
+    marked with its id, unique among editors.
+  */
+  class Editor {
+   public:
+    explicit Editor(const PersistentArray &base)
+        : array_(base), id_(next_id_.fetch_add(1) + 1) {
+    }
+
+    //! Mutable reference to element, array grows to include it
+    T &operator[](std::size_t idx) {
+      std::size_t page = idx >> kPageBits;
+      if (array_.root_ == nullptr) {
+        array_.root_ = MakeNode(0);
+      }
+      while ((page >> (kFanoutBits * array_.height_)) > 0) {
+        std::shared_ptr<Node> root = MakeNode(++array_.height_);
+        root->children[0] = std::move(array_.root_);
+        array_.root_ = std::move(root);
+      }
+      Node *node = Own(array_.root_, array_.height_);
+      for (int level = array_.height_; level > 0; --level) {
+        std::size_t child =
+            (page >> (kFanoutBits * (level - 1))) & (kFanout - 1);
+        node = Own(node->children[child], level - 1);
+      }
+      array_.size_ = std::max(array_.size_, idx + 1);
+      return node->values[idx % kPageSize];
+    }
+
+    //! Take the built array, the editor must not be used after
+    PersistentArray Finish() {
+      return std::move(array_);
+    }
+
+   private:
+    PersistentArray array_;
+    uint64_t id_;
+
+    static inline std::atomic<uint64_t> next_id_ = 0;
+
+    //! Node at given level, that is page at level 0, made by this editor
+    std::shared_ptr<Node> MakeNode(int level) const {
+      auto node = std::make_shared<Node>();
+      node->owner = id_;
+      if (level == 0) {
+        node->values.resize(kPageSize);
+      } else {
+        node->children.resize(kFanout);
+      }
+      return node;
+    }
+
+    //! Make the node changeable by this editor, copying it if it's shared
+    Node *Own(std::shared_ptr<Node> &node, int level) const {
+      if (node == nullptr) {
+        node = MakeNode(level);
+      } else if (node->owner != id_) {
+        node = std::make_shared<Node>(*node);
+        node->owner = id_;
+      }
+      return node.get();
+    }
+  };
+
+ private:
+  std::shared_ptr<Node> root_;
+  //! Number of inner levels above pages
+  int height_ = 0;
+  std::size_t size_ = 0;
+
+  //! Page holding the element, nullptr if it was never set
+  const Node *FindPage(std::size_t idx) const {
+    std::size_t page = idx >> kPageBits;
+    if (root_ == nullptr || (page >> (kFanoutBits * height_)) > 0) {
+      return nullptr;
+    }
+    const Node *node = root_.get();
+    for (int level = height_; level > 0 && node != nullptr; --level) {
+      std::size_t child =
+          (page >> (kFanoutBits * (level - 1))) & (kFanout - 1);
+      node = node->children[child].get();
+    }
+    return node;
+  }
+
+  static std::size_t NodeBytes(const Node *node, int level) {
+    if (node == nullptr) {
+      return 0;
+    }
+    std::size_t bytes = AllocatedBytes(sizeof(Node) + 16);
+    if (level == 0) {
+      return bytes + AllocatedBytes(kPageSize * sizeof(T));
+    }
+    bytes += VectorBytes(node->children);
+    for (const auto &child : node->children) {
+      bytes += NodeBytes(child.get(), level - 1);
+    }
+    return bytes;
+  }
+};
+
+}  // namespace evolv::internal
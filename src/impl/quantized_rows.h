@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "delta_log.h"
+#include "memory_usage.h"
+#include "random.h"
+#include "utils.h"
+
+
+namespace evolv::internal {
+
+/*!
+  \brief Read-only transition counters quantized to 8 bits
+
+  Each row keeps its non-zero counts in order of target states: targets
+  as varint gaps, like in CompressedRow, and counts as 8-bit levels. Rows
+  with counts up to 255 keep them exactly, larger ones take levels on log
+  scale with the step of 1/32 bit times the scale of the row, the finest
+  one that covers the largest count, so the weight of level q is
+  2^(q * scale / 32) and it's within 2^(scale / 64) times of the count.
+  Every kBlock entries of the row the cumulative weight is stored, so
+  sampling searches blocks and scans one of them. Rows are laid out by
+  source state, then by depth, like in TieredRows.
+*/
+template <class CodeT>
+  requires std::integral<CodeT>
+class QuantizedRows {
+ public:
+  using CountT = int64_t;
+
+  //! Entries between stored cumulative weights
+  static constexpr std::size_t kBlock = 64;
+
+  //! Build rows from transition counts as given by BaseChain::CollectCounts
+  QuantizedRows(int memory_size, std::size_t num_states,
+                std::vector<TransitionDelta<CodeT>> counts)
+      : memory_size_(memory_size), row_begin_(num_states + 1, 0) {
+    assert(memory_size > 0);
+    MergeDeltas(counts);
+    std::erase_if(counts, [](const TransitionDelta<CodeT> &count) {
+      return count.delta <= 0;
+    });
+    for (const TransitionDelta<CodeT> &count : counts) {
+      row_begin_[count.from + 1] = std::max<std::size_t>(
+          row_begin_[count.from + 1], count.depth + 1);
+    }
+    for (std::size_t from = 0; from < num_states; ++from) {
+      row_begin_[from + 1] += row_begin_[from];
+    }
+    rows_.reserve(row_begin_[num_states] + 1);
+    levels_.reserve(counts.size());
+
+    // counts are ordered by source state and depth like rows are
+    auto it = counts.begin();
+    for (std::size_t from = 0; from < num_states; ++from) {
+      for (std::size_t depth = 0;
+           depth < row_begin_[from + 1] - row_begin_[from]; ++depth) {
+        auto end = std::find_if(it, counts.end(), [&](const auto &count) {
+          return static_cast<std::size_t>(count.from) != from ||
+                 static_cast<std::size_t>(count.depth) != depth;
+        });
+        AppendRow(std::span(it, end));
+        it = end;
+      }
+    }
+    rows_.push_back({levels_.size(), blocks_.size(), 0, 0});
+    rows_.shrink_to_fit();
+    blocks_.shrink_to_fit();
+    levels_.shrink_to_fit();
+    bytes_.shrink_to_fit();
+  }
+
+  int GetMemorySize() const {
+    return memory_size_;
+  }
+
+  //! Sample the subsequent state after remembered ones, where memory[0]
+  //! is the last one, like ChainSnapshot::PredictCode. The row is picked
+  //! by its total weight, then the state within the row
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  std::optional<CodeT> PredictCode(std::span<const CodeT> memory,
+                                   RngT &rng) const {
+    int depth_count =
+        std::min(static_cast<int>(memory.size()), memory_size_);
+    double total = 0;
+    for (int depth = 0; depth < depth_count; ++depth) {
+      if (std::optional<std::size_t> idx = RowIndex(memory[depth], depth)) {
+        total += rows_[*idx].total;
+      }
+    }
+    if (total == 0) {
+      return std::nullopt;
+    }
+    double x = UniformReal(rng) * total;
+    std::optional<std::size_t> last;
+    for (int depth = 0; depth < depth_count; ++depth) {
+      if (std::optional<std::size_t> idx = RowIndex(memory[depth], depth)) {
+        if (x < rows_[*idx].total) {
+          return SampleRow(*idx, x);
+        }
+        x -= rows_[*idx].total;
+        last = idx;
+      }
+    }
+    // x may run past the rows by rounding
+    return SampleRow(*last, rows_[*last].total);
+  }
+
+  //! Kullback-Leibler divergence of quantized rows from the exact counts,
+  //! that rows were built from, in nats. It's averaged over rows weighted
+  //! by their counts, so it's the expected one per learned transition
+  double KlDivergence(std::vector<TransitionDelta<CodeT>> counts) const {
+    MergeDeltas(counts);
+    std::erase_if(counts, [](const TransitionDelta<CodeT> &count) {
+      return count.delta <= 0;
+    });
+    double divergence = 0, transitions = 0;
+    for (auto it = counts.begin(); it != counts.end();) {
+      auto end = std::find_if(it, counts.end(), [it](const auto &count) {
+        return count.from != it->from || count.depth != it->depth;
+      });
+      std::optional<std::size_t> idx = RowIndex(it->from, it->depth);
+      assert(idx && "Counts differ from the ones rows were built from");
+      const Row &row = rows_[*idx];
+      double row_count = 0;
+      for (auto count = it; count != end; ++count) {
+        row_count += static_cast<double>(count->delta);
+      }
+      std::size_t entry = row.entry_begin;
+      for (auto count = it; count != end; ++count, ++entry) {
+        double p = static_cast<double>(count->delta) / row_count;
+        double q = Weight(row.scale, levels_[entry]) / row.total;
+        divergence += row_count * p * std::log(p / q);
+      }
+      transitions += row_count;
+      it = end;
+    }
+    return transitions == 0 ? 0 : divergence / transitions;
+  }
+
+  //! Bytes taken by rows
+  std::size_t MemoryUsage() const {
+    return sizeof(*this) + VectorBytes(row_begin_) + VectorBytes(rows_) +
+           VectorBytes(blocks_) + VectorBytes(levels_) + VectorBytes(bytes_);
+  }
+
+ private:
+  struct Row {
+    //! Index of the first entry in levels_
+    std::size_t entry_begin;
+    //! Index of the first block in blocks_
+    std::size_t block_begin;
+    //! Sum of weights of entries
+    double total;
+    //! 0 for exact counts, otherwise the step of levels in 1/32 bit
+    uint8_t scale;
+  };
+
+  struct Block {
+    //! Sum of weights of entries of the row before the block
+    double before;
+    //! Offset of the first target in bytes_, that is written as the gap
+    //! from -1
+    std::size_t byte_offset;
+  };
+
+  int memory_size_;
+  std::vector<std::size_t> row_begin_;
+  //! Rows with the extra one ending the last
+  std::vector<Row> rows_;
+  std::vector<Block> blocks_;
+  std::vector<uint8_t> levels_;
+  //! Varint gaps between targets
+  std::vector<uint8_t> bytes_;
+
+  //! Weight of level of row of given scale
+  static double Weight(uint8_t scale, uint8_t level) {
+    static const std::array<std::array<double, 256>, 9> kWeights = [] {
+      std::array<std::array<double, 256>, 9> weights;
+      for (int level = 0; level < 256; ++level) {
+        weights[0][level] = level;
+        for (int scale = 1; scale < 9; ++scale) {
+          weights[scale][level] = std::exp2(level * scale / 32.0);
+        }
+      }
+      return weights;
+    }();
+    return kWeights[scale][level];
+  }
+
+  void AppendRow(std::span<const TransitionDelta<CodeT>> counts) {
+    CountT max_count = 0;
+    for (const TransitionDelta<CodeT> &count : counts) {
+      max_count = std::max(max_count, count.delta);
+    }
+    // the finest scale with 255 levels covering the largest count
+    uint8_t scale = 0;
+    if (max_count > 255) {
+      scale = static_cast<uint8_t>(std::min(
+          8.0, std::ceil(std::log2(static_cast<double>(max_count)) * 32 /
+                         255)));
+    }
+
+    Row row{levels_.size(), blocks_.size(), 0, scale};
+    CodeT previous = -1;
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+      if (i % kBlock == 0) {
+        blocks_.push_back({row.total, bytes_.size()});
+        previous = -1;
+      }
+      PutVarint(static_cast<uint64_t>(counts[i].to - previous - 1));
+      previous = counts[i].to;
+      uint8_t level = Quantize(scale, counts[i].delta);
+      levels_.push_back(level);
+      row.total += Weight(scale, level);
+    }
+    rows_.push_back(row);
+  }
+
+  static uint8_t Quantize(uint8_t scale, CountT count) {
+    if (scale == 0) {
+      return static_cast<uint8_t>(count);
+    }
+    double level =
+        std::round(std::log2(static_cast<double>(count)) * 32 / scale);
+    return static_cast<uint8_t>(std::clamp(level, 0.0, 255.0));
+  }
+
+  //! State of the row where cumulative weight exceeds x
+  CodeT SampleRow(std::size_t idx, double x) const {
+    const Row &row = rows_[idx];
+    std::size_t size = rows_[idx + 1].entry_begin - row.entry_begin;
+    auto first = blocks_.begin() + row.block_begin;
+    auto last = blocks_.begin() + rows_[idx + 1].block_begin;
+    auto block = std::upper_bound(first + 1, last, x,
+                                  [](double x, const Block &block) {
+                                    return x < block.before;
+                                  }) -
+                 1;
+
+    std::size_t entry = static_cast<std::size_t>(block - first) * kBlock;
+    std::size_t end = std::min(size, entry + kBlock);
+    const uint8_t *pos = bytes_.data() + block->byte_offset;
+    double sum = block->before;
+    CodeT to = -1;
+    for (; entry < end; ++entry) {
+      to += static_cast<CodeT>(GetVarint(pos)) + 1;
+      sum += Weight(row.scale, levels_[row.entry_begin + entry]);
+      if (x < sum) {
+        break;
+      }
+    }
+    return to;
+  }
+
+  std::optional<std::size_t> RowIndex(CodeT from, int depth) const {
+    if (from < 0 || static_cast<std::size_t>(from) + 1 >= row_begin_.size()) {
+      return std::nullopt;
+    }
+    std::size_t idx = row_begin_[from] + depth;
+    if (idx >= row_begin_[from + 1] ||
+        rows_[idx + 1].entry_begin == rows_[idx].entry_begin) {
+      return std::nullopt;
+    }
+    return idx;
+  }
+
+  void PutVarint(uint64_t value) {
+    for (; value >= 0x80; value >>= 7) {
+      bytes_.push_back(static_cast<uint8_t>(value | 0x80));
+    }
+    bytes_.push_back(static_cast<uint8_t>(value));
+  }
+
+  static uint64_t GetVarint(const uint8_t *&pos) {
+    uint64_t value = 0;
+    for (int shift = 0;; shift += 7) {
+      uint8_t byte = *pos++;
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+  }
+};
+
+}  // namespace evolv::internal
@@ -1,15 +1,20 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
-#include <chrono>
 #include <cstdint>
 #include <deque>
-#include <random>
-#include <unordered_map>
+#include <memory_resource>
+#include <optional>
+#include <span>
 #include <vector>
 
 #include "base_chain.h"
+#include "delta_log.h"
 #include "fenwick_tree.h"
+#include "generator.h"
+#include "random.h"
+#include "simulator.h"
 
 
 namespace evolv::internal {
@@ -22,43 +27,58 @@ namespace evolv::internal {
   That's where inner class TransitCounter comes.
   Predicting next state is based on current state and counted transitions.
 */
-template <class CodeT>
-  requires std::integral<CodeT>
-class RemberChain : public BaseChain<CodeT> {
-  using typename BaseChain<CodeT>::CountT;
-  using typename BaseChain<CodeT>::FenwickCounter;
-  using BaseChain<CodeT>::memory_size_;
-  using BaseChain<CodeT>::memory_;
-  using BaseChain<CodeT>::rng_;
+template <class CodeT, class RngT = Xoshiro256pp,
+          class MetricsT = NoMetrics>
+  requires std::integral<CodeT> && utils::is_random_generator<RngT>
+class RemberChain : public BaseChain<CodeT, RngT, MetricsT> {
+  using typename BaseChain<CodeT, RngT, MetricsT>::CountT;
+  using typename BaseChain<CodeT, RngT, MetricsT>::FenwickCounter;
+  using BaseChain<CodeT, RngT, MetricsT>::memory_size_;
+  using BaseChain<CodeT, RngT, MetricsT>::memory_;
+  using BaseChain<CodeT, RngT, MetricsT>::rng_;
+  using BaseChain<CodeT, RngT, MetricsT>::metrics_;
+  using BaseChain<CodeT, RngT, MetricsT>::deltas_;
 
  public:
-  using BaseChain<CodeT>::UpdateMemory;
-  using BaseChain<CodeT>::GetMemory;
+  using BaseChain<CodeT, RngT, MetricsT>::UpdateMemory;
+  using BaseChain<CodeT, RngT, MetricsT>::GetMemory;
 
-  //! Set curr_state_ and max_state_ to undefined, initialize memory_ and rng_
-  RemberChain(int memorize_previous, int random_state)
-      : BaseChain<CodeT>(1 + memorize_previous, random_state), max_state_(0) {
+  //! Initialize memory_ and rng_, counters allocate from given resource
+  RemberChain(int memorize_previous, uint64_t random_state,
+              std::pmr::memory_resource *resource =
+                  std::pmr::get_default_resource())
+      : BaseChain<CodeT, RngT, MetricsT>(1 + memorize_previous,
+                                         random_state),
+        transitions_(1 + memorize_previous, resource),
+        predict_counters_(1 + memorize_previous) {
   }
   
   //! Learn from sequence and move to last state in sequence if needed or if
   //! there is no memory. This is the implementation of virtual FeedSequence 
   //! in BaseChain
   void FeedSequence(EncodingIter<CodeT> it, EncodingIter<CodeT> end,
-                    bool update_memory) {
-    FeedSequenceImpl(std::move(it), std::move(end), update_memory);
+                    bool update_memory, int64_t weight) {
+    FeedSequenceImpl(std::move(it), std::move(end), update_memory, weight);
+  }
+
+  //! Learn from sequence of codes, bypassing encoding. This is the
+  //! implementation of virtual FeedCodes in BaseChain
+  void FeedCodes(std::span<const CodeT> codes, bool update_memory,
+                 int64_t weight) {
+    FeedSequenceImpl(codes.begin(), codes.end(), update_memory, weight);
   }
 
   //! Learn from sequence and move to last state in sequence if needed or if
   //! there is no memory. This is the implementation called either from
   //! virtual FeedSequence or directly (in tests, for example)
   template <class IterT>
-  void FeedSequenceImpl(IterT it, IterT end, bool update_memory = false) {
+  void FeedSequenceImpl(IterT it, IterT end, bool update_memory = false,
+                        int64_t weight = 1) {
     if (it == end) {
       return;
     }
 
     std::deque<CodeT> last_states{*it};
-    max_state_ = std::max(max_state_, *it);
     ++it;
 
     // iterate over sequence and add new transitions
@@ -67,80 +87,307 @@ class RemberChain : public BaseChain<CodeT> {
     for (; it != end; ++it) {
       for (int depth = 0; depth < static_cast<int>(last_states.size());
            ++depth) {
-        transitions_.Get(last_states[depth], depth).Add(*it, 1);
+        if (transitions_.Get(last_states[depth], depth).Add(*it, weight)) {
+          metrics_.CountResize();
+        }
+        deltas_.Record(last_states[depth], depth, *it, weight);
       }
       if (static_cast<int>(last_states.size()) >= memory_size_) {
         last_states.pop_back();
       }
       last_states.push_front(*it);
-      max_state_ = std::max(max_state_, *it);
     }
     if (update_memory || memory_.empty()) {
       UpdateMemory(last_states.rbegin(), last_states.rend());
     }
   }
 
+  //! Learn from sequence of codes from many threads at once, see
+  //! BaseChain::CountConcurrent. Transitions into the first context codes
+  //! aren't counted. Memory isn't updated
+  void FeedCodesConcurrent(std::span<const CodeT> codes,
+                           std::size_t context = 0) {
+    std::vector<TransitionDelta<CodeT>> transitions;
+    for (std::size_t i = std::max<std::size_t>(context, 1); i < codes.size();
+         ++i) {
+      for (int depth = 0; depth < memory_size_ && depth < static_cast<int>(i);
+           ++depth) {
+        transitions.push_back({codes[i - 1 - depth], depth, codes[i], 1});
+      }
+    }
+    this->CountConcurrent(
+        transitions, [this] { return transitions_.NumRows(); },
+        [this](std::size_t rows) { transitions_.Reserve(rows); },
+        [this](const TransitionDelta<CodeT> &transition) {
+          FenwickCounter *counter =
+              transitions_.Find(transition.from, transition.depth);
+          return counter != nullptr &&
+                 counter->AddConcurrent(transition.to, transition.delta);
+        },
+        [this](const TransitionDelta<CodeT> &transition) {
+          return transitions_.Get(transition.from, transition.depth)
+              .Add(transition.to, transition.delta);
+        });
+  }
+
   //! Predict the subsequent state from the current state,
   //! move to predicted state if needed
   CodeT PredictState(bool update_memory = false) {
     assert(!memory_.empty() && "Call FeedSequence at least once");
-    int64_t x = rng_() % transitions_.Sum(memory_.begin(), memory_.end());
-    CodeT next_state = UpperBound(x);
-    if (update_memory) {
-      UpdateMemory(next_state);
+    std::optional<CodeT> next_state = TryPredictState(update_memory);
+    assert(next_state && "No transitions from current memory");
+    return *next_state;
+  }
+
+  //! Predict like PredictState, but nullopt if there are no transitions
+  //! or nothing was fed yet
+  std::optional<CodeT> TryPredictState(bool update_memory = false) {
+    std::optional<CodeT> next_state =
+        memory_.empty() ? std::nullopt : SampleNext();
+    if (next_state && update_memory) {
+      UpdateMemory(*next_state);
     }
     return next_state;
   }
 
+  //! Append k samples of the subsequent state in order of codes. Counters
+  //! of memory are looked up once and all the samples are resolved in one
+  //! descent over them. Memory isn't moved
+  bool PredictStates(std::size_t k, std::vector<CodeT> &out) {
+    if (memory_.empty()) {
+      return false;
+    }
+    int depth_count = static_cast<int>(memory_.size());
+    CountT total = 0;
+    for (int depth = 0; depth < depth_count; ++depth) {
+      predict_counters_[depth] = FindCounter(memory_[depth], depth);
+      if (predict_counters_[depth] != nullptr) {
+        total += predict_counters_[depth]->TotalSum();
+      }
+    }
+    if (total == 0) {
+      return false;
+    }
+    std::span<const CountT> xs = this->DrawSortedUniforms(k, total);
+    out.resize(out.size() + k);
+    FenwickCounter::UpperBounds(
+        std::span(predict_counters_.data(), depth_count), xs,
+        std::span(out).last(k), predict_bases_);
+    return true;
+  }
+
+  //! Lazily predict subsequent states moving to each of them, ends when
+  //! there are no transitions from current memory
+  Generator<CodeT> WalkCodes() {
+    assert(!memory_.empty() && "Call FeedSequence at least once");
+    for (std::optional<CodeT> next = SampleNext(); next; next = SampleNext()) {
+      UpdateMemory(*next);
+      co_yield *next;
+    }
+  }
+
+  //! Fill the size of transition counters and memory
+  void FillStats(ChainStats &stats) const {
+    transitions_.FillStats(stats);
+    stats.bytes.counters += deltas_.MemoryUsage();
+    stats.bytes.memory += this->MemoryBytes() +
+                          VectorBytes(predict_counters_) +
+                          VectorBytes(predict_bases_);
+  }
+
+  //! Give back storage of counters and memory exceeding their size
+  void ShrinkToFit() {
+    transitions_.ShrinkToFit();
+    memory_.shrink_to_fit();
+  }
+
+  //! Add deltas to transition counts
+  void ApplyDeltas(std::span<const TransitionDelta<CodeT>> deltas) {
+    for (const TransitionDelta<CodeT> &delta : deltas) {
+      if (transitions_.Get(delta.from, delta.depth)
+              .Add(delta.to, delta.delta)) {
+        metrics_.CountResize();
+      }
+    }
+  }
+
+  //! Append all non-zero transition counts
+  void CollectCounts(std::vector<TransitionDelta<CodeT>> &counts) const {
+    transitions_.CollectCounts(counts);
+  }
+
+  //! Drop all transition counts
+  void ClearCounts() {
+    transitions_.Clear();
+  }
+
+  //! Simulate independent walkers starting from given states, see Simulator
+  void Simulate(std::span<const CodeT> starts, int steps,
+                std::span<const CodeT> targets, std::size_t num_codes,
+                SimulationCounts &counts, int threads) {
+    Simulator<RemberChain, CodeT, RngT>(*this, targets, num_codes)
+        .Run(starts, steps, rng_(), counts, threads);
+  }
+
+  //! Get counter of transitions from given state into the state coming
+  //! in depth + 1 steps, nullptr if there are none
+  const FenwickCounter *FindCounter(CodeT from, int depth) const {
+    return transitions_.Find(from, depth);
+  }
+
+  //! Sample the subsequent state from the counters of remembered states,
+  //! where counters[depth] is taken from the state seen depth steps ago,
+  //! with the given generator, nullopt if there are no transitions
+  std::optional<CodeT> SampleFrom(const FenwickCounter *const *counters,
+                                  int depth_count, RngT &rng) const {
+    CountT total = 0;
+    for (int depth = 0; depth < depth_count; ++depth) {
+      if (counters[depth] != nullptr) {
+        total += counters[depth]->TotalSum();
+      }
+    }
+    if (total == 0) {
+      return std::nullopt;
+    }
+    auto x = static_cast<CountT>(UniformBelow(rng, total));
+    return UpperBound(counters, depth_count, x);
+  }
+
  private:
+  //! Counters of transitions stored depth-major: counters_[depth] is
+  //! indexed by code of the source state, as codes are dense. Counters
+  //! of states without transitions are empty and allocate nothing
   class TransitCounters {
    public:
+    TransitCounters(int memory_size, std::pmr::memory_resource *resource)
+        : counters_(memory_size, resource) {
+    }
+
     FenwickCounter &Get(CodeT from, int depth) {
-      if (static_cast<int>(counters_[from].size()) <= depth) {
-        counters_[from].resize(depth + 1);
+      std::pmr::vector<FenwickCounter> &level = counters_[depth];
+      if (static_cast<std::size_t>(from) >= level.size()) {
+        level.resize(static_cast<std::size_t>(from) + 1);
+      }
+      return level[from];
+    }
+
+    //! Number of rows at each depth, states without transitions have
+    //! empty ones
+    std::size_t NumRows() const {
+      std::size_t rows = counters_[0].size();
+      for (const auto &level : counters_) {
+        rows = std::min(rows, level.size());
+      }
+      return rows;
+    }
+
+    //! Grow to hold at least given number of rows at each depth, taking
+    //! the slack allocated by vectors, so they're grown again only when
+    //! they're full
+    void Reserve(std::size_t rows) {
+      for (auto &level : counters_) {
+        if (level.size() < rows) {
+          level.resize(rows);
+          level.resize(level.capacity());
+        }
+      }
+    }
+
+    const FenwickCounter *Find(CodeT from, int depth) const {
+      const std::pmr::vector<FenwickCounter> &level = counters_[depth];
+      return static_cast<std::size_t>(from) < level.size() &&
+                     level[from].Size() > 0
+                 ? &level[from]
+                 : nullptr;
+    }
+
+    FenwickCounter *Find(CodeT from, int depth) {
+      std::pmr::vector<FenwickCounter> &level = counters_[depth];
+      return static_cast<std::size_t>(from) < level.size() &&
+                     level[from].Size() > 0
+                 ? &level[from]
+                 : nullptr;
+    }
+
+    //! Fill number of rows, transitions and bytes taken
+    void FillStats(ChainStats &stats) const {
+      stats.bytes.counters += sizeof(counters_) + VectorBytes(counters_);
+      for (const auto &level : counters_) {
+        stats.bytes.counters += VectorBytes(level);
+        for (const FenwickCounter &counter : level) {
+          if (counter.Size() > 0) {
+            stats.rows++;
+            stats.transitions += counter.TotalSum();
+            stats.bytes.counters += counter.MemoryUsage() - sizeof(counter);
+          }
+        }
       }
-      return counters_[from][depth];
     }
 
-    template <class IterT>
-    CountT Sum(IterT it, IterT end) {
-      int depth = 0, sum = 0;
-      for (; it != end; ++it, ++depth) {
-        sum += Get(*it, depth).TotalSum();
+    //! Append non-zero counts ordered by transition
+    void CollectCounts(std::vector<TransitionDelta<CodeT>> &counts) const {
+      std::size_t size = 0;
+      for (const auto &level : counters_) {
+        size = std::max(size, level.size());
+      }
+      for (std::size_t from = 0; from < size; ++from) {
+        for (int depth = 0; depth < static_cast<int>(counters_.size());
+             ++depth) {
+          if (from < counters_[depth].size()) {
+            AppendCounts(static_cast<CodeT>(from), depth,
+                         counters_[depth][from], counts);
+          }
+        }
+      }
+    }
+
+    void Clear() {
+      for (auto &level : counters_) {
+        level.clear();
+        level.shrink_to_fit();
+      }
+    }
+
+    void ShrinkToFit() {
+      for (auto &level : counters_) {
+        for (FenwickCounter &counter : level) {
+          counter.ShrinkToFit();
+        }
+        level.shrink_to_fit();
       }
-      return sum;
     }
 
    private:
-    std::unordered_map<CodeT, std::vector<FenwickCounter>> counters_;
+    std::pmr::vector<std::pmr::vector<FenwickCounter>> counters_;
   };
 
   //! For all seen states count transitions into subsequent states come
   //! in less than memory_size_ steps
   TransitCounters transitions_;
-  //! State with maximum number ever seen
-  CodeT max_state_;
-
-  //! Upper bound for the next state from the current one
-  CodeT UpperBound(int64_t x) {
-    // perform binary seach on answer space
-    // from lowest to highest states the sum of transitions over depth
-    int lb = 0, rb = max_state_;
-    while (lb < rb) {
-      int md = lb + (rb - lb) / 2;
-
-      // count the sum of transitions over depth
-      int sum = 0;
-      for (int depth = 0; depth < static_cast<int>(memory_.size()); ++depth) {
-        sum += transitions_.Get(memory_[depth], depth).Sum(md);
-      }
-      if (sum <= x) {
-        lb = md + 1;
-      } else {
-        rb = md;
-      }
+  //! Counters of remembered states gathered in PredictState
+  std::vector<const FenwickCounter *> predict_counters_;
+  //! Prefix sums of counters in the descent of PredictStates
+  std::vector<CountT> predict_bases_;
+
+  //! Sample the subsequent state from the remembered ones
+  std::optional<CodeT> SampleNext() {
+    int depth_count = static_cast<int>(memory_.size());
+    for (int depth = 0; depth < depth_count; ++depth) {
+      predict_counters_[depth] = FindCounter(memory_[depth], depth);
     }
-    return lb;
+    return SampleFrom(predict_counters_.data(), depth_count, rng_);
+  }
+
+  //! Upper bound for the next state from the given counters, found in
+  //! one descent over all of them
+  CodeT UpperBound(const FenwickCounter *const *counters, int depth_count,
+                   CountT x) const {
+    thread_local std::vector<CountT> bases;
+    CodeT next_state;
+    FenwickCounter::UpperBounds(std::span(counters, depth_count),
+                                std::span(&x, 1), std::span(&next_state, 1),
+                                bases);
+    return next_state;
   }
 };
 
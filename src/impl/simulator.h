@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "random.h"
+
+
+namespace evolv::internal {
+
+/*!
+  \brief Aggregated statistics of simulated walkers, indexed by state code
+
+  The first hit of target i is the first step (starting from 0) at which
+  a walker stands in targets[i]. Walkers that never hit it aren't counted.
+*/
+struct SimulationCounts {
+  //! How many times each state was visited, including the starting states
+  std::vector<int64_t> visits;
+  //! How many walkers ended in each state
+  std::vector<int64_t> end_states;
+  //! How many walkers hit each target
+  std::vector<int64_t> hits;
+  //! Sum of first hitting steps over walkers that hit each target
+  std::vector<int64_t> hit_steps;
+
+  //! Zero-filled counts for given number of codes and targets
+  SimulationCounts(std::size_t num_codes, std::size_t num_targets)
+      : visits(num_codes, 0),
+        end_states(num_codes, 0),
+        hits(num_targets, 0),
+        hit_steps(num_targets, 0) {
+  }
+
+  //! Add up counts from the other instance of the same shape
+  void Merge(const SimulationCounts &other) {
+    for (std::size_t i = 0; i < visits.size(); ++i) {
+      visits[i] += other.visits[i];
+      end_states[i] += other.end_states[i];
+    }
+    for (std::size_t i = 0; i < hits.size(); ++i) {
+      hits[i] += other.hits[i];
+      hit_steps[i] += other.hit_steps[i];
+    }
+  }
+};
+
+
+/*!
+  \brief Monte Carlo engine stepping many independent walkers over a chain
+
+  Walkers are split into blocks of fixed size, each block has its own
+  generator derived from the seed and the block index, so the result
+  doesn't depend on the number of threads. Inside the block memory of
+  walkers is kept as struct of arrays: one row of states per depth.
+  As all walkers step simultaneously, rows form a ring buffer with
+  common head, so stepping doesn't shift memory.
+
+  Each step is done in batches: first counters for the whole batch are
+  looked up and their trees are prefetched, then the next states are
+  sampled. Targets must be distinct. ChainT must provide GetMemorySize(),
+  FindCounter(from, depth) and SampleFrom(counters, depth_count, rng),
+  see ForgorChain and RemberChain.
+*/
+template <class ChainT, class CodeT, class RngT>
+  requires std::integral<CodeT>
+class Simulator {
+ public:
+  //! Walkers in one block, the unit of work for threads
+  static constexpr int kBlockSize = 1024;
+  //! Walkers resolved together before sampling
+  static constexpr int kBatchSize = 16;
+
+  Simulator(const ChainT &chain, std::span<const CodeT> targets,
+            std::size_t num_codes)
+      : chain_(chain),
+        memory_size_(chain.GetMemorySize()),
+        num_codes_(num_codes),
+        target_index_(num_codes, -1),
+        num_targets_(static_cast<int>(targets.size())) {
+    for (int i = 0; i < num_targets_; ++i) {
+      assert(target_index_[targets[i]] < 0 && "targets must be distinct");
+      target_index_[targets[i]] = i;
+    }
+  }
+
+  //! Run walkers from given states for given number of steps
+  //! and add statistics into counts. Uses all cores if threads <= 0
+  void Run(std::span<const CodeT> starts, int steps, uint64_t seed,
+           SimulationCounts &counts, int threads = 0) const {
+    int num_blocks =
+        static_cast<int>((starts.size() + kBlockSize - 1) / kBlockSize);
+    if (threads <= 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::max(1, std::min(threads, num_blocks));
+
+    std::vector<SimulationCounts> local(
+        threads, SimulationCounts(num_codes_, num_targets_));
+    std::atomic<int> next_block = 0;
+    auto work = [&](SimulationCounts &thread_counts) {
+      for (int block = next_block++; block < num_blocks; block = next_block++) {
+        auto first = static_cast<std::size_t>(block) * kBlockSize;
+        auto size = std::min<std::size_t>(kBlockSize, starts.size() - first);
+        SplitMix64 expand(seed + block);
+        RngT rng(expand());
+        RunBlock(starts.subspan(first, size), steps, rng, thread_counts);
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i) {
+      workers.emplace_back(work, std::ref(local[i]));
+    }
+    work(local[0]);
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    for (const auto &thread_counts : local) {
+      counts.Merge(thread_counts);
+    }
+  }
+
+ private:
+  using CounterPtr = decltype(std::declval<const ChainT &>().FindCounter(
+      std::declval<CodeT>(), 0));
+
+  const ChainT &chain_;
+  int memory_size_;
+  std::size_t num_codes_;
+  //! Index of target for each code or -1 if code isn't target
+  std::vector<int> target_index_;
+  int num_targets_;
+
+  //! Step the block of walkers, memory[slot * n + walker] is the state of
+  //! the walker in given ring slot
+  void RunBlock(std::span<const CodeT> starts, int steps, RngT &rng,
+                SimulationCounts &counts) const {
+    int n = static_cast<int>(starts.size());
+    std::vector<CodeT> memory(static_cast<std::size_t>(memory_size_) * n);
+    std::vector<int> first_hit(static_cast<std::size_t>(num_targets_) * n, -1);
+    std::copy(starts.begin(), starts.end(), memory.begin());
+    for (int w = 0; w < n; ++w) {
+      Visit(starts[w], w, n, 0, first_hit, counts);
+    }
+
+    std::vector<CounterPtr> counters(
+        static_cast<std::size_t>(kBatchSize) * memory_size_);
+    for (int step = 1; step <= steps; ++step) {
+      int depth_count = std::min(step, memory_size_);
+      const CodeT *prev = &memory[((step - 1) % memory_size_) * n];
+      CodeT *next = &memory[(step % memory_size_) * n];
+
+      for (int batch = 0; batch < n; batch += kBatchSize) {
+        int batch_end = std::min(n, batch + kBatchSize);
+        for (int w = batch; w < batch_end; ++w) {
+          CounterPtr *row = &counters[(w - batch) * memory_size_];
+          for (int depth = 0; depth < depth_count; ++depth) {
+            int slot = (step - 1 - depth) % memory_size_;
+            row[depth] = chain_.FindCounter(memory[slot * n + w], depth);
+            if (row[depth] != nullptr) {
+              __builtin_prefetch(row[depth]->Data());
+            }
+          }
+        }
+        for (int w = batch; w < batch_end; ++w) {
+          std::optional<CodeT> state = chain_.SampleFrom(
+              &counters[(w - batch) * memory_size_], depth_count, rng);
+          // Walker without outgoing transitions stays where it is
+          next[w] = state.value_or(prev[w]);
+          Visit(next[w], w, n, step, first_hit, counts);
+        }
+      }
+    }
+
+    const CodeT *last = &memory[(steps % memory_size_) * n];
+    for (int w = 0; w < n; ++w) {
+      counts.end_states[last[w]]++;
+    }
+  }
+
+  void Visit(CodeT state, int walker, int n, int step,
+             std::vector<int> &first_hit, SimulationCounts &counts) const {
+    counts.visits[state]++;
+    int target = target_index_[state];
+    if (target >= 0 && first_hit[target * n + walker] < 0) {
+      first_hit[target * n + walker] = step;
+      counts.hits[target]++;
+      counts.hit_steps[target] += step;
+    }
+  }
+};
+
+}  // namespace evolv::internal
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "delta_log.h"
+
+
+namespace evolv::internal {
+
+/*!
+  \brief Transitions spilled to disk in sorted runs and merged back
+
+  Transitions are buffered until they take the budget, then they are
+  merged by transition and written into the next run file. Merge reads
+  all the runs at once, each with its own buffer sharing the budget,
+  and gives transitions in order with deltas summed, so memory is set by
+  the budget, not by the number of transitions. Run files are named
+  run-<i>.bin in the given directory and removed with this object.
+*/
+template <class CodeT>
+class SortedRuns {
+ public:
+  using Transition = TransitionDelta<CodeT>;
+
+  SortedRuns(std::filesystem::path dir, std::size_t budget_bytes)
+      : dir_(std::move(dir)),
+        budget_bytes_(std::max(budget_bytes, sizeof(Transition))) {
+    std::filesystem::create_directories(dir_);
+  }
+
+  SortedRuns(const SortedRuns &) = delete;
+  SortedRuns &operator=(const SortedRuns &) = delete;
+
+  ~SortedRuns() {
+    std::error_code error;
+    for (const std::filesystem::path &path : run_paths_) {
+      std::filesystem::remove(path, error);
+    }
+  }
+
+  //! Buffer transition, spilling the buffer if it takes the budget
+  void Add(const Transition &transition) {
+    buffer_.push_back(transition);
+    if (buffer_.size() * sizeof(Transition) >= budget_bytes_) {
+      Spill();
+    }
+  }
+
+  //! Write buffered transitions into the new run
+  void Spill() {
+    if (buffer_.empty()) {
+      return;
+    }
+    MergeDeltas(buffer_);
+    std::filesystem::path path =
+        dir_ / ("run-" + std::to_string(run_paths_.size()) + ".bin");
+    std::ofstream run(path, std::ios::binary | std::ios::trunc);
+    auto bytes =
+        static_cast<std::streamsize>(buffer_.size() * sizeof(Transition));
+    run.write(reinterpret_cast<const char *>(buffer_.data()), bytes);
+    run_paths_.push_back(std::move(path));
+    buffer_.clear();
+  }
+
+  //! Number of runs written so far
+  std::size_t NumRuns() const {
+    return run_paths_.size();
+  }
+
+  //! Call fn(transition) for each transition in all the runs and the
+  //! buffer in order of transitions, with deltas of equal ones summed.
+  //! Runs are removed after
+  template <class FnT>
+  void Merge(FnT fn) {
+    Spill();
+    buffer_ = {};
+    std::size_t chunk = std::max<std::size_t>(
+        1, budget_bytes_ / sizeof(Transition) /
+               std::max<std::size_t>(1, run_paths_.size()));
+    std::vector<RunReader> readers;
+    readers.reserve(run_paths_.size());
+    for (const std::filesystem::path &path : run_paths_) {
+      readers.emplace_back(path, chunk);
+    }
+
+    // min-heap of the current transitions of runs
+    auto greater = [&readers](std::size_t lhs, std::size_t rhs) {
+      return TransitionLess{}(readers[rhs].Current(), readers[lhs].Current());
+    };
+    std::priority_queue<std::size_t, std::vector<std::size_t>,
+                        decltype(greater)>
+        heap(greater);
+    for (std::size_t run = 0; run < readers.size(); ++run) {
+      if (readers[run].Next()) {
+        heap.push(run);
+      }
+    }
+    while (!heap.empty()) {
+      std::size_t run = heap.top();
+      heap.pop();
+      Transition merged = readers[run].Current();
+      if (readers[run].Next()) {
+        heap.push(run);
+      }
+      while (!heap.empty() && SameTransition(readers[heap.top()].Current(),
+                                             merged)) {
+        run = heap.top();
+        heap.pop();
+        merged.delta += readers[run].Current().delta;
+        if (readers[run].Next()) {
+          heap.push(run);
+        }
+      }
+      fn(merged);
+    }
+
+    readers.clear();
+    std::error_code error;
+    for (const std::filesystem::path &path : run_paths_) {
+      std::filesystem::remove(path, error);
+    }
+    run_paths_.clear();
+  }
+
+ private:
+  //! Sequential reader of run file by chunks
+  class RunReader {
+   public:
+    RunReader(const std::filesystem::path &path, std::size_t chunk)
+        : file_(path, std::ios::binary), chunk_(chunk) {
+    }
+
+    //! Move to the next transition, false at the end of run
+    bool Next() {
+      if (++pos_ < buffer_.size()) {
+        return true;
+      }
+      buffer_.resize(chunk_);
+      file_.read(reinterpret_cast<char *>(buffer_.data()),
+                 static_cast<std::streamsize>(chunk_ * sizeof(Transition)));
+      buffer_.resize(static_cast<std::size_t>(file_.gcount()) /
+                     sizeof(Transition));
+      pos_ = 0;
+      return !buffer_.empty();
+    }
+
+    const Transition &Current() const {
+      return buffer_[pos_];
+    }
+
+   private:
+    std::ifstream file_;
+    std::size_t chunk_;
+    std::vector<Transition> buffer_;
+    std::size_t pos_ = 0;
+  };
+
+  std::filesystem::path dir_;
+  std::size_t budget_bytes_;
+  std::vector<Transition> buffer_;
+  std::vector<std::filesystem::path> run_paths_;
+
+  static bool SameTransition(const Transition &lhs, const Transition &rhs) {
+    return lhs.from == rhs.from && lhs.depth == rhs.depth && lhs.to == rhs.to;
+  }
+};
+
+}  // namespace evolv::internal
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+
+namespace evolv::internal {
+
+/*!
+  \brief Bounded lock-free queue for single producer and single consumer
+
+  Capacity is rounded up to the power of 2. Push waits while the queue
+  is full and Pop waits while it's empty, that gives backpressure to the
+  producer. Indices are kept on separate cache lines, so the producer and
+  the consumer don't invalidate each other's line on every operation.
+*/
+template <class T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(std::size_t capacity)
+      : slots_(std::bit_ceil(std::max<std::size_t>(capacity, 1))),
+        mask_(slots_.size() - 1) {
+  }
+
+  //! Push value, waiting while the queue is full. Called only by producer
+  void Push(T value) {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    std::size_t head = head_.load(std::memory_order_acquire);
+    while (tail - head == slots_.size()) {
+      head_.wait(head, std::memory_order_acquire);
+      head = head_.load(std::memory_order_acquire);
+    }
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    tail_.notify_one();
+  }
+
+  //! Pop value, waiting while the queue is empty. Called only by consumer
+  T Pop() {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    std::size_t tail = tail_.load(std::memory_order_acquire);
+    while (tail == head) {
+      tail_.wait(tail, std::memory_order_acquire);
+      tail = tail_.load(std::memory_order_acquire);
+    }
+    T value = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    head_.notify_one();
+    return value;
+  }
+
+  std::size_t Capacity() const {
+    return slots_.size();
+  }
+
+ private:
+  static constexpr std::size_t kCacheLine = 64;
+
+  std::vector<T> slots_;
+  std::size_t mask_;
+  //! Index of the next value to pop, written only by consumer
+  alignas(kCacheLine) std::atomic<std::size_t> head_ = 0;
+  //! Index of the next slot to push into, written only by producer
+  alignas(kCacheLine) std::atomic<std::size_t> tail_ = 0;
+};
+
+}  // namespace evolv::internal
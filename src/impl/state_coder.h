@@ -1,45 +1,413 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "memory_usage.h"
+
 
 namespace evolv::internal {
 
+//! How StateCoder stores states: as they are by default. View is how
+//! stored states are referred to without copying
+template <class StateT>
+struct StateStorage {
+  using Type = StateT;
+  using View = const StateT &;
+  using Hash = std::hash<StateT>;
+  using Equal = std::equal_to<StateT>;
+};
+
+//! Strings are stored as std::pmr::string to allocate from the coder's
+//! resource and are looked up by std::string_view without copying
+template <>
+struct StateStorage<std::string> {
+  struct Hash {
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view str) const {
+      return std::hash<std::string_view>{}(str);
+    }
+  };
+
+  struct Equal {
+    using is_transparent = void;
+
+    bool operator()(std::string_view lhs, std::string_view rhs) const {
+      return lhs == rhs;
+    }
+  };
+
+  using Type = std::pmr::string;
+  using View = std::string_view;
+};
+
+
 /*!
   \brief State encoder and decoder (into and from CodeT)
 
   This is used with BaseChain that can operate only on integral
   types. This ensures biection between arbitrary states and integral codes.
-  The StateT must be hashable.
+  The StateT must be hashable. Tables and states, if they are strings,
+  are allocated from the memory resource given in constructor.
+
+  Codes by states are split into kStripes hash tables by hash, each
+  guarded by its own lock in the concurrent methods, so threads coding
+  different states don't contend. States by codes are guarded by one
+  lock, that is taken exclusively only to append new states.
 */
 template <class StateT, class CodeT>
   requires std::copy_constructible<StateT> && std::integral<CodeT>
 class StateCoder {
  public:
-  StateCoder() = default;
+  using StateType = StateT;
+  using CodeType = CodeT;
+  //! Code of unknown state after Prune
+  static constexpr CodeT kUnknown = 0;
+  //! Number of stripes of the table of codes by states
+  static constexpr std::size_t kStripes = 16;
 
-  //! Map state to code
+  //! Construct coder allocating from given resource
+  explicit StateCoder(std::pmr::memory_resource *resource =
+                          std::pmr::get_default_resource())
+      : decoder_(resource) {
+    for (Stripe &stripe : stripes_) {
+      stripe.encoder = Encoder(resource);
+    }
+  }
+
+  //! Map state to code. After Prune new states aren't coded, they are
+  //! unknown
   CodeT Encode(const StateT &state) {
-    if (!encoder_.contains(state)) {
-      encoder_[state] = decoder_.size();
-      decoder_.push_back(state);
+    Encoder &encoder = StripeOf(state).encoder;
+    auto it = encoder.find(state);
+    if (it != encoder.end()) {
+      return it->second;
+    }
+    if (pruned_) {
+      return kUnknown;
+    }
+    auto code = static_cast<CodeT>(decoder_.size());
+    encoder.emplace(state, code);
+    decoder_.emplace_back(state);
+    return code;
+  }
+
+  //! Map state to code from many threads at once, while only concurrent
+  //! methods are called. The state is looked up under the shared lock of
+  //! its stripe, new one is coded under the exclusive locks of its stripe
+  //! and of states by codes. Strings are looked up by any type viewed as
+  //! std::string_view and copied only if they're new
+  template <class KeyT>
+  CodeT EncodeConcurrent(const KeyT &state) {
+    Stripe &stripe = StripeOf(state);
+    {
+      std::shared_lock lock(stripe.mutex);
+      auto it = stripe.encoder.find(state);
+      if (it != stripe.encoder.end()) {
+        return it->second;
+      }
+    }
+    if (pruned_) {
+      return kUnknown;
+    }
+    std::unique_lock lock(stripe.mutex);
+    auto it = stripe.encoder.find(state);
+    if (it != stripe.encoder.end()) {
+      return it->second;
+    }
+    CodeT code;
+    {
+      std::unique_lock decoder_lock(decoder_mutex_);
+      code = static_cast<CodeT>(decoder_.size());
+      decoder_.emplace_back(state);
+    }
+    stripe.encoder.emplace(state, code);
+    return code;
+  }
+
+  //! Map states to codes from many threads at once, see EncodeConcurrent
+  template <class IterT>
+  void EncodeConcurrent(IterT it, IterT end, std::vector<CodeT> &codes) {
+    for (; it != end; ++it) {
+      codes.push_back(EncodeConcurrent(*it));
+    }
+  }
+
+  //! Code of the state, nullopt if it isn't coded
+  std::optional<CodeT> Find(const StateT &state) const {
+    const Encoder &encoder = StripeOf(state).encoder;
+    auto it = encoder.find(state);
+    return it == encoder.end() ? std::nullopt : std::optional(it->second);
+  }
+
+  //! Find from many threads at once, see EncodeConcurrent
+  std::optional<CodeT> FindConcurrent(const StateT &state) const {
+    std::shared_lock lock(StripeOf(state).mutex);
+    return Find(state);
+  }
+
+  //! Recode states, new_codes[code] is the new code of code. States with
+  //! new code kUnknown are dropped, kUnknown decodes into unknown and all
+  //! states not kept are coded as kUnknown from now on. Kept states must
+  //! get codes 1, 2 and so on
+  void Prune(std::span<const CodeT> new_codes, const StateT &unknown) {
+    assert(new_codes.size() == Size());
+    std::vector<CodeT> old_codes(1);
+    for (std::size_t code = 0; code < new_codes.size(); ++code) {
+      if (new_codes[code] != kUnknown) {
+        old_codes.resize(std::max<std::size_t>(old_codes.size(),
+                                               new_codes[code] + 1));
+        old_codes[new_codes[code]] = static_cast<CodeT>(code);
+      }
+    }
+    std::pmr::vector<StoredT> decoder(decoder_.get_allocator());
+    decoder.reserve(old_codes.size());
+    decoder.emplace_back(unknown);
+    for (std::size_t code = 1; code < old_codes.size(); ++code) {
+      decoder.emplace_back(std::move(decoder_[old_codes[code]]));
+    }
+    decoder_ = std::move(decoder);
+    for (Stripe &stripe : stripes_) {
+      stripe.encoder.clear();
+    }
+    for (std::size_t code = 0; code < decoder_.size(); ++code) {
+      [[maybe_unused]] bool inserted =
+          StripeOf(decoder_[code])
+              .encoder.emplace(decoder_[code], static_cast<CodeT>(code))
+              .second;
+      assert(inserted && "Unknown state must not be kept");
+    }
+    for (Stripe &stripe : stripes_) {
+      stripe.encoder.rehash(0);
+    }
+    pruned_ = true;
+  }
+
+  //! Renumber states, new_codes[code] is the new code of code and it must
+  //! be a permutation of codes
+  void Recode(std::span<const CodeT> new_codes) {
+    assert(new_codes.size() == Size());
+    for (Stripe &stripe : stripes_) {
+      for (auto &[state, code] : stripe.encoder) {
+        code = new_codes[code];
+      }
+    }
+    std::pmr::vector<StoredT> decoder(decoder_.size(),
+                                      decoder_.get_allocator());
+    for (std::size_t code = 0; code < decoder_.size(); ++code) {
+      decoder[new_codes[code]] = std::move(decoder_[code]);
+    }
+    decoder_ = std::move(decoder);
+  }
+
+  //! Whether Prune was called, then kUnknown is reserved
+  bool Pruned() const {
+    return pruned_;
+  }
+
+  //! Check that codes fed directly were given by this coder
+  void Admit([[maybe_unused]] std::span<const CodeT> codes) const {
+    assert(std::all_of(codes.begin(), codes.end(), [this](CodeT code) {
+      return 0 <= code && static_cast<std::size_t>(code) < Size();
+    }));
+  }
+
+  //! Number of coded states, codes are in [0, Size())
+  std::size_t Size() const {
+    return decoder_.size();
+  }
+
+  //! Size from many threads at once, see EncodeConcurrent
+  std::size_t SizeConcurrent() const {
+    std::shared_lock lock(decoder_mutex_);
+    return Size();
+  }
+
+  //! Bytes taken by hash tables and the vector of states, including
+  //! heap owned by states, as they are stored twice
+  std::size_t MemoryUsage() const {
+    std::size_t bytes = sizeof(*this) + VectorBytes(decoder_);
+    for (const Stripe &stripe : stripes_) {
+      bytes += HashTableBytes(stripe.encoder);
     }
-    return encoder_[state];
+    for (const StoredT &state : decoder_) {
+      bytes += 2 * HeapBytes(state);
+    }
+    return bytes;
+  }
+
+  //! Give back storage exceeding the number of coded states
+  void ShrinkToFit() {
+    for (Stripe &stripe : stripes_) {
+      stripe.encoder.rehash(0);
+    }
+    decoder_.shrink_to_fit();
   }
 
   //! Map code to state
-  StateT Decode(CodeT code) {
-    // std::cout << "decoded to: " << decoder_[code] << std::endl;
+  StateT Decode(CodeT code) const {
+    return StateT(decoder_[code]);
+  }
+
+  //! Decode from many threads at once, see EncodeConcurrent
+  StateT DecodeConcurrent(CodeT code) const {
+    std::shared_lock lock(decoder_mutex_);
+    return Decode(code);
+  }
+
+  //! Map code to reference to the stored state, or to view of it for
+  //! strings, without copying. It's valid until new states are coded
+  typename StateStorage<StateT>::View DecodeRef(CodeT code) const {
     return decoder_[code];
   }
 
+  //! Call f with the coder, while concurrent methods wait
+  template <class F>
+  decltype(auto) Exclusive(F f) const {
+    std::array<std::unique_lock<std::shared_mutex>, kStripes> locks;
+    for (std::size_t i = 0; i < kStripes; ++i) {
+      locks[i] = std::unique_lock(stripes_[i].mutex);
+    }
+    std::unique_lock decoder_lock(decoder_mutex_);
+    return f(*this);
+  }
+
+  template <class F>
+  decltype(auto) Exclusive(F f) {
+    return std::as_const(*this).Exclusive(
+        [this, &f](const StateCoder &) -> decltype(auto) { return f(*this); });
+  }
+
  private:
+  using StoredT = typename StateStorage<StateT>::Type;
+  using Encoder =
+      std::pmr::unordered_map<StoredT, CodeT,
+                              typename StateStorage<StateT>::Hash,
+                              typename StateStorage<StateT>::Equal>;
+
+  //! Codes by states with the same stripe of hash
+  struct Stripe {
+    Encoder encoder;
+    //! Guards encoder in concurrent methods
+    mutable std::shared_mutex mutex;
+  };
+
   //! Stores mapping from state to code
-  std::unordered_map<StateT, CodeT> encoder_;
+  std::array<Stripe, kStripes> stripes_;
   //! Stores mapping from code to state
-  std::vector<StateT> decoder_;
+  std::pmr::vector<StoredT> decoder_;
+  //! Guards decoder_ in concurrent methods
+  mutable std::shared_mutex decoder_mutex_;
+  //! Whether Prune was called, so new states are unknown
+  bool pruned_ = false;
+
+  //! Stripe of the state is given by the high bits of its mixed hash, as
+  //! tables use the low ones and std::hash of integers is identity
+  template <class T>
+  static std::size_t StripeIndex(const T &state) {
+    constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15;
+    uint64_t hash = typename StateStorage<StateT>::Hash{}(state);
+    return static_cast<std::size_t>((hash * kMultiplier) >> 60) % kStripes;
+  }
+
+  template <class T>
+  Stripe &StripeOf(const T &state) {
+    return stripes_[StripeIndex(state)];
+  }
+
+  template <class T>
+  const Stripe &StripeOf(const T &state) const {
+    return stripes_[StripeIndex(state)];
+  }
+};
+
+
+/*!
+  \brief StateCoder shared by many chains, that may be used from many
+  threads at once
+
+  It's the vocabulary held by chains of many tenants over the same states,
+  so states and the hash table are stored once instead of in each chain.
+  It codes, looks up and decodes states with the concurrent methods of
+  StateCoder, so tenants contend only on the stripes of their states and
+  while new states are appended. Codes are never changed, so it can't be
+  pruned or recoded, as that would invalidate counters of other chains.
+*/
+template <class StateT, class CodeT>
+  requires std::copy_constructible<StateT> && std::integral<CodeT>
+class SharedStateCoder {
+ public:
+  using StateType = StateT;
+  using CodeType = CodeT;
+
+  //! Construct coder allocating from given resource
+  explicit SharedStateCoder(std::pmr::memory_resource *resource =
+                                std::pmr::get_default_resource())
+      : coder_(resource) {
+  }
+
+  //! Map state to code
+  CodeT Encode(const StateT &state) {
+    return coder_.EncodeConcurrent(state);
+  }
+
+  //! Map states to codes
+  template <class IterT>
+  void EncodeConcurrent(IterT it, IterT end, std::vector<CodeT> &codes) {
+    coder_.EncodeConcurrent(it, end, codes);
+  }
+
+  //! Code of the state, nullopt if it isn't coded
+  std::optional<CodeT> Find(const StateT &state) const {
+    return coder_.FindConcurrent(state);
+  }
+
+  //! Check that codes fed directly were given by this coder
+  void Admit([[maybe_unused]] std::span<const CodeT> codes) const {
+    [[maybe_unused]] std::size_t size = Size();
+    assert(std::all_of(codes.begin(), codes.end(), [size](CodeT code) {
+      return 0 <= code && static_cast<std::size_t>(code) < size;
+    }));
+  }
+
+  //! Number of coded states, codes are in [0, Size())
+  std::size_t Size() const {
+    return coder_.SizeConcurrent();
+  }
+
+  std::size_t MemoryUsage() const {
+    return coder_.Exclusive(
+        [](const auto &coder) { return coder.MemoryUsage(); });
+  }
+
+  void ShrinkToFit() {
+    coder_.Exclusive([](auto &coder) { coder.ShrinkToFit(); });
+  }
+
+  //! Map code to state
+  StateT Decode(CodeT code) const {
+    return coder_.DecodeConcurrent(code);
+  }
+
+ private:
+  StateCoder<StateT, CodeT> coder_;
 };
 
 }  // namespace evolv::internal
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "compressed_row.h"
+#include "delta_log.h"
+#include "lru_cache.h"
+#include "random.h"
+#include "utils.h"
+
+
+namespace evolv::internal {
+
+/*!
+  \brief Read-only transition counters in two tiers
+
+  Every row is kept compressed, see CompressedRow, and rows used for
+  sampling are decompressed into Fenwick trees held by the cache of the
+  given size in bytes. Skewed traffic hits the same few rows, so they
+  stay decompressed, while the long tail takes only compressed bytes.
+  Rows are laid out by source state, then by depth, and row_begin_[from]
+  is the index of the first row of the state. Large caches are sharded,
+  so concurrent readers of different rows don't contend for one lock.
+*/
+template <class CodeT>
+  requires std::integral<CodeT>
+class TieredRows {
+ public:
+  using CountT = int64_t;
+  using Row = CompressedRow<CodeT>;
+  using FenwickCounter = typename Row::FenwickCounter;
+  using CounterPtr = std::shared_ptr<const FenwickCounter>;
+
+  //! Least capacity of a cache shard, so it holds many rows
+  static constexpr std::size_t kMinShardBytes = std::size_t{1} << 20;
+  static constexpr std::size_t kMaxShards = 16;
+  //! Depths of memory whose counters are held on stack while sampling,
+  //! deeper memory allocates them
+  static constexpr int kStackDepths = 16;
+
+  //! Build rows from transition counts as given by BaseChain::CollectCounts
+  TieredRows(int memory_size, std::size_t num_states,
+             std::vector<TransitionDelta<CodeT>> counts,
+             std::size_t cache_bytes)
+      : memory_size_(memory_size),
+        row_begin_(num_states + 1, 0),
+        cache_(cache_bytes,
+               std::clamp<std::size_t>(cache_bytes / kMinShardBytes, 1,
+                                       kMaxShards)) {
+    assert(memory_size > 0);
+    MergeDeltas(counts);
+    for (const TransitionDelta<CodeT> &count : counts) {
+      row_begin_[count.from + 1] = std::max<std::size_t>(
+          row_begin_[count.from + 1], count.depth + 1);
+    }
+    for (std::size_t from = 0; from < num_states; ++from) {
+      row_begin_[from + 1] += row_begin_[from];
+    }
+    rows_.resize(row_begin_[num_states]);
+    for (const TransitionDelta<CodeT> &count : counts) {
+      if (count.delta > 0) {
+        rows_[row_begin_[count.from] + count.depth].Append(count.to,
+                                                           count.delta);
+      }
+    }
+    for (Row &row : rows_) {
+      row.ShrinkToFit();
+    }
+  }
+
+  int GetMemorySize() const {
+    return memory_size_;
+  }
+
+  //! Get decompressed counter of transitions from given state into the
+  //! state coming in depth + 1 steps, nullptr if there are none
+  CounterPtr FindCounter(CodeT from, int depth) const {
+    std::optional<std::size_t> idx = RowIndex(from, depth);
+    if (!idx) {
+      return nullptr;
+    }
+    return Load(*idx);
+  }
+
+  //! Sample the subsequent state after remembered ones, where memory[0]
+  //! is the last one, like ChainSnapshot::PredictCode. Totals are known
+  //! without decompression, so rows are decompressed only for sampling,
+  //! then they are descended at once like in RemberChain
+  template <class RngT>
+    requires utils::is_random_generator<RngT>
+  std::optional<CodeT> PredictCode(std::span<const CodeT> memory,
+                                   RngT &rng) const {
+    int depth_count =
+        std::min(static_cast<int>(memory.size()), memory_size_);
+    // decompressed rows are held until the descent ends, as the cache may
+    // evict them meanwhile
+    std::array<CounterPtr, kStackDepths> stack_held;
+    std::array<const FenwickCounter *, kStackDepths> stack_counters{};
+    std::vector<CounterPtr> heap_held;
+    std::vector<const FenwickCounter *> heap_counters;
+    std::span<CounterPtr> held(stack_held);
+    std::span<const FenwickCounter *> counters(stack_counters);
+    if (depth_count > kStackDepths) {
+      heap_held.resize(depth_count);
+      heap_counters.resize(depth_count);
+      held = heap_held;
+      counters = heap_counters;
+    }
+    counters = counters.first(std::max(depth_count, 0));
+
+    CountT total = 0;
+    for (int depth = 0; depth < depth_count; ++depth) {
+      if (std::optional<std::size_t> idx = RowIndex(memory[depth], depth)) {
+        total += rows_[*idx].TotalSum();
+        held[depth] = Load(*idx);
+        counters[depth] = held[depth].get();
+      }
+    }
+    if (total == 0) {
+      return std::nullopt;
+    }
+    auto x = static_cast<CountT>(UniformBelow(rng, total));
+    if (depth_count == 1) {
+      return static_cast<CodeT>(counters[0]->UpperBound(x));
+    }
+    thread_local std::vector<CountT> bases;
+    CodeT next_state;
+    FenwickCounter::UpperBounds(counters, std::span(&x, 1),
+                                std::span(&next_state, 1), bases);
+    return next_state;
+  }
+
+  //! Hits and misses of decompressed rows
+  CacheStats GetCacheStats() const {
+    return cache_.Stats();
+  }
+
+  //! Bytes taken by compressed rows, not including the cache
+  std::size_t MemoryUsage() const {
+    std::size_t bytes = sizeof(*this) + VectorBytes(row_begin_) +
+                        VectorBytes(rows_) - rows_.size() * sizeof(Row);
+    for (const Row &row : rows_) {
+      bytes += row.MemoryUsage();
+    }
+    return bytes;
+  }
+
+ private:
+  int memory_size_;
+  std::vector<std::size_t> row_begin_;
+  std::vector<Row> rows_;
+  mutable LruCache<std::size_t, FenwickCounter> cache_;
+
+  CounterPtr Load(std::size_t idx) const {
+    return cache_.Get(idx, [this, idx] { return rows_[idx].Decompress(); });
+  }
+
+  std::optional<std::size_t> RowIndex(CodeT from, int depth) const {
+    if (from < 0 || static_cast<std::size_t>(from) + 1 >= row_begin_.size()) {
+      return std::nullopt;
+    }
+    std::size_t idx = row_begin_[from] + depth;
+    if (idx >= row_begin_[from + 1] || rows_[idx].Targets() == 0) {
+      return std::nullopt;
+    }
+    return idx;
+  }
+};
+
+}  // namespace evolv::internal
@@ -1,7 +1,12 @@
 #pragma once
 
 #include <concepts>
+#include <cstddef>
+#include <cstdint>
 #include <iterator>
+#include <limits>
+#include <random>
+#include <type_traits>
 
 
 //! Namespace for utilities that cannot be placed in evolv::internal
@@ -16,4 +21,37 @@ concept is_iterator =
     std::is_same_v<typename std::iterator_traits<IterT>::value_type,
                    const DataT &>;
 
+//! Concept for checking if RngT is random generator producing the full range
+//! of 64-bit values and seedable with single 64-bit integer
+template <class RngT>
+concept is_random_generator =
+    std::uniform_random_bit_generator<RngT> &&
+    std::constructible_from<RngT, uint64_t> && RngT::min() == 0 &&
+    RngT::max() == std::numeric_limits<uint64_t>::max();
+
+//! Specialize with static constexpr kMin and kMax to declare that states
+//! of enum or integral StateT lie in [kMin, kMax]. Then MarkovChain codes
+//! them with internal::TableCoder, looking up a table instead of hashing
+template <class StateT>
+struct StateRange {};
+
+//! Concept for checking if StateRange is specialized for StateT
+template <class StateT>
+concept has_state_range =
+    (std::is_enum_v<StateT> || std::is_integral_v<StateT>) &&
+    requires {
+      { StateRange<StateT>::kMin } -> std::convertible_to<int64_t>;
+      { StateRange<StateT>::kMax } -> std::convertible_to<int64_t>;
+    };
+
+//! Concept for checking if CoderT maps StateT into CodeT and back
+template <class CoderT, class StateT, class CodeT>
+concept is_state_coder =
+    std::same_as<typename CoderT::StateType, StateT> &&
+    requires(CoderT coder, const StateT &state, CodeT code) {
+      { coder.Encode(state) } -> std::same_as<CodeT>;
+      { coder.Decode(code) } -> std::convertible_to<StateT>;
+      { coder.Size() } -> std::convertible_to<std::size_t>;
+    };
+
 }  // namespace evolv::utils
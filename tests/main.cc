@@ -1,12 +1,32 @@
 #include <gtest/gtest.h>
 
+#include "test_async_feeder.h"
+#include "test_concurrent_feed.h"
+#include "test_delta_log.h"
 #include "test_encoding_iter.h"
+#include "test_factorized_chain.h"
 #include "test_fenwick_tree.h"
 #include "test_forgor_chain.h"
+#include "test_frozen_chain.h"
+#include "test_generator.h"
+#include "test_integral_coders.h"
 #include "test_markov_chain.h"
+#include "test_memory_usage.h"
+#include "test_metrics.h"
+#include "test_out_of_core.h"
+#include "test_pmr.h"
+#include "test_quantized_chain.h"
+#include "test_prune.h"
+#include "test_random.h"
+#include "test_recode.h"
 #include "test_rember_chain.h"
+#include "test_serving_chain.h"
+#include "test_shared_vocabulary.h"
+#include "test_simulator.h"
 #include "test_state_coder.h"
+#include "test_tiered_chain.h"
 #include "test_utils.h"
+#include "test_weighted.h"
 
 
 int main(int argc, char *argv[]) {
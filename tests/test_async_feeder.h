@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// AsyncFeederTest is the suite for queue and pipelined feeding
+
+TEST(AsyncFeederTest, SpscQueueKeepsOrder) {
+  SpscQueue<int> queue(3);
+  EXPECT_EQ(queue.Capacity(), 4);
+  const int count = 100000;
+  std::thread producer([&] {
+    for (int i = 0; i < count; ++i) {
+      queue.Push(i);
+    }
+  });
+  bool ordered = true;
+  for (int i = 0; i < count; ++i) {
+    ordered = ordered && queue.Pop() == i;
+  }
+  producer.join();
+  EXPECT_TRUE(ordered);
+}
+
+
+TEST(AsyncFeederTest, SameAsSynchronous) {
+  std::vector<std::vector<std::string>> sequences;
+  for (int i = 0; i < 300; ++i) {
+    std::vector<std::string> seq;
+    for (int j = 0; j < 50; ++j) {
+      seq.push_back("state " + std::to_string((i * 7 + j * j) % 41));
+    }
+    sequences.push_back(seq);
+  }
+
+  evolv::MarkovChain<std::string> sync_chain(2, RANDOM_STATE),
+      async_chain(2, RANDOM_STATE);
+  {
+    evolv::AsyncFeeder feeder(async_chain, 4);
+    for (int i = 0; i < static_cast<int>(sequences.size()); ++i) {
+      sync_chain.FeedSequence(sequences[i].begin(), sequences[i].end(),
+                              i % 10 == 0);
+      feeder.FeedSequence(sequences[i].begin(), sequences[i].end(),
+                          i % 10 == 0);
+    }
+    feeder.Flush();
+    EXPECT_EQ(async_chain.GetMemory(), sync_chain.GetMemory());
+    EXPECT_EQ(async_chain.Stats().transitions, sync_chain.Stats().transitions);
+  }
+
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(async_chain.PredictState(true), sync_chain.PredictState(true));
+  }
+}
+
+
+TEST(AsyncFeederTest, DestructorApplies) {
+  std::vector<int> seq{0, 1, 2, 0, 1, 2, 0};
+  evolv::MarkovChain<int> chain(0, RANDOM_STATE);
+  {
+    evolv::AsyncFeeder feeder(chain);
+    for (int i = 0; i < 10; ++i) {
+      feeder.FeedSequence(seq.begin(), seq.end());
+    }
+  }
+  EXPECT_EQ(chain.Stats().transitions, 60);
+  EXPECT_EQ(chain.PredictState(), 1);
+}
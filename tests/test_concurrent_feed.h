@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// Sequences of codes in [0, vocabulary), the same for the same seed
+std::vector<std::vector<int>> CodeSequences(int count, int length,
+                                            int vocabulary, uint64_t seed) {
+  Xoshiro256pp rng(seed);
+  std::vector<std::vector<int>> sequences(count);
+  for (std::vector<int> &seq : sequences) {
+    for (int i = 0; i < length; ++i) {
+      seq.push_back(static_cast<int>(UniformBelow(rng, vocabulary)));
+    }
+  }
+  return sequences;
+}
+
+
+// Feed sequences on given number of threads, each takes every threads-th
+template <class FeedT>
+void FeedOnThreads(int threads, std::size_t count, FeedT feed) {
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      for (std::size_t i = t; i < count; i += threads) {
+        feed(i);
+      }
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+}
+
+
+// ConcurrentFeedTest is the suite for feeding one chain from many threads
+
+TEST(ConcurrentFeedTest, FenwickTreeAddConcurrent) {
+  FenwickTree<int64_t> tree(8);
+  EXPECT_TRUE(tree.AddConcurrent(3, 2));
+  EXPECT_FALSE(tree.AddConcurrent(8, 1));
+  EXPECT_EQ(tree.Sum(3, 3), 2);
+  EXPECT_EQ(tree.TotalSum(), 2);
+}
+
+
+TEST(ConcurrentFeedTest, SameCountsAsSequential) {
+  auto sequences = CodeSequences(400, 200, 300, RANDOM_STATE);
+  for (int memorize : {0, 2}) {
+    std::unique_ptr<BaseChain<int>> sequential, concurrent;
+    if (memorize == 0) {
+      sequential = std::make_unique<ForgorChain<int>>(RANDOM_STATE);
+      concurrent = std::make_unique<ForgorChain<int>>(RANDOM_STATE);
+    } else {
+      sequential = std::make_unique<RemberChain<int>>(memorize, RANDOM_STATE);
+      concurrent = std::make_unique<RemberChain<int>>(memorize, RANDOM_STATE);
+    }
+    for (const std::vector<int> &seq : sequences) {
+      sequential->FeedCodes(seq);
+    }
+    FeedOnThreads(16, sequences.size(), [&](std::size_t i) {
+      concurrent->FeedCodesConcurrent(sequences[i]);
+    });
+
+    std::vector<TransitionDelta<int>> expected, actual;
+    sequential->CollectCounts(expected);
+    concurrent->CollectCounts(actual);
+    MergeDeltas(expected);
+    MergeDeltas(actual);
+    EXPECT_EQ(actual, expected);
+  }
+}
+
+
+TEST(ConcurrentFeedTest, WindowsWithContext) {
+  std::vector<int> seq = CodeSequences(1, 5000, 100, RANDOM_STATE)[0];
+  for (int memorize : {0, 2}) {
+    std::unique_ptr<BaseChain<int>> whole, windowed;
+    if (memorize == 0) {
+      whole = std::make_unique<ForgorChain<int>>(RANDOM_STATE);
+      windowed = std::make_unique<ForgorChain<int>>(RANDOM_STATE);
+    } else {
+      whole = std::make_unique<RemberChain<int>>(memorize, RANDOM_STATE);
+      windowed = std::make_unique<RemberChain<int>>(memorize, RANDOM_STATE);
+    }
+    whole->FeedCodes(seq);
+    // windows are preceded by memory size codes of the previous ones
+    constexpr std::size_t kWindow = 97;
+    std::size_t context = memorize + 1;
+    FeedOnThreads(4, (seq.size() + kWindow - 1) / kWindow,
+                  [&](std::size_t i) {
+                    std::size_t first = i * kWindow;
+                    std::size_t begin = first - std::min(first, context);
+                    std::size_t end = std::min(first + kWindow, seq.size());
+                    windowed->FeedCodesConcurrent(
+                        std::span(seq).subspan(begin, end - begin),
+                        first - begin);
+                  });
+
+    std::vector<TransitionDelta<int>> expected, actual;
+    whole->CollectCounts(expected);
+    windowed->CollectCounts(actual);
+    MergeDeltas(expected);
+    MergeDeltas(actual);
+    EXPECT_EQ(actual, expected);
+  }
+}
+
+
+TEST(ConcurrentFeedTest, StateCoderCodesOnce) {
+  auto sequences = CodeSequences(200, 100, 3000, RANDOM_STATE);
+  StateCoder<std::string, int> coder;
+  std::vector<std::vector<int>> codes(sequences.size());
+  FeedOnThreads(8, sequences.size(), [&](std::size_t i) {
+    std::vector<std::string> seq;
+    for (int code : sequences[i]) {
+      seq.push_back("state " + std::to_string(code));
+    }
+    coder.EncodeConcurrent(seq.begin(), seq.end(), codes[i]);
+  });
+
+  // each state got one code and codes are dense
+  std::vector<int> states(coder.Size(), -1);
+  for (std::size_t i = 0; i < sequences.size(); ++i) {
+    for (std::size_t j = 0; j < sequences[i].size(); ++j) {
+      int code = codes[i][j];
+      ASSERT_LT(static_cast<std::size_t>(code), states.size());
+      if (states[code] == -1) {
+        states[code] = sequences[i][j];
+      }
+      ASSERT_EQ(states[code], sequences[i][j]);
+      EXPECT_EQ(coder.Decode(code), "state " + std::to_string(states[code]));
+    }
+  }
+  EXPECT_EQ(std::count(states.begin(), states.end(), -1), 0);
+}
+
+
+TEST(ConcurrentFeedTest, MarkovChainSameAsSequential) {
+  std::vector<std::vector<std::string>> sequences;
+  for (const std::vector<int> &codes : CodeSequences(300, 100, 500, 7)) {
+    std::vector<std::string> seq;
+    for (int code : codes) {
+      seq.push_back("state " + std::to_string(code));
+    }
+    sequences.push_back(std::move(seq));
+  }
+  evolv::MarkovChain<std::string> sequential(1, RANDOM_STATE),
+      concurrent(1, RANDOM_STATE);
+  for (const std::vector<std::string> &seq : sequences) {
+    sequential.FeedSequence(seq.begin(), seq.end());
+  }
+  FeedOnThreads(8, sequences.size(), [&](std::size_t i) {
+    concurrent.FeedSequenceConcurrent(sequences[i].begin(),
+                                      sequences[i].end());
+  });
+
+  ChainStats expected = sequential.Stats(), actual = concurrent.Stats();
+  EXPECT_EQ(actual.states, expected.states);
+  EXPECT_EQ(actual.rows, expected.rows);
+  EXPECT_EQ(actual.transitions, expected.transitions);
+  for (const std::vector<std::string> &seq : sequences) {
+    for (const std::string &state : seq) {
+      ASSERT_EQ(concurrent.Decode(concurrent.Encode(state)), state);
+    }
+  }
+  EXPECT_EQ(concurrent.Stats().states, expected.states);
+}
+
+
+// Throughput of concurrent feeding by number of threads, run explicitly
+// with --gtest_also_run_disabled_tests
+TEST(ConcurrentFeedTest, DISABLED_Scaling) {
+  auto sequences = CodeSequences(20000, 500, 10000, RANDOM_STATE);
+  for (int threads = 1; threads <= 64; threads *= 2) {
+    RemberChain<int> chain(1, RANDOM_STATE);
+    auto start = std::chrono::steady_clock::now();
+    FeedOnThreads(threads, sequences.size(), [&](std::size_t i) {
+      chain.FeedCodesConcurrent(sequences[i]);
+    });
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << threads << " threads: "
+              << sequences.size() * 500 / elapsed.count() / 1e6
+              << " M states/s" << std::endl;
+  }
+}
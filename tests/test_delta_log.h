@@ -0,0 +1,342 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// Sequence of words with a small vocabulary, that differs by offset
+std::vector<std::string> Words(int offset, int size) {
+  std::vector<std::string> words;
+  for (int i = 0; i < size; ++i) {
+    words.push_back("word " + std::to_string((offset + i * i) % 23));
+  }
+  return words;
+}
+
+
+// Expect chains learned the same: the same states and transitions, and
+// if they have the same random state, the same predictions
+template <class ChainT>
+void ExpectSameModel(ChainT &expected, ChainT &actual, bool predict = true) {
+  ChainStats expected_stats = expected.Stats(), actual_stats = actual.Stats();
+  EXPECT_EQ(actual_stats.states, expected_stats.states);
+  EXPECT_EQ(actual_stats.rows, expected_stats.rows);
+  EXPECT_EQ(actual_stats.transitions, expected_stats.transitions);
+  for (std::size_t code = 0; code < expected_stats.states; ++code) {
+    EXPECT_EQ(actual.Decode(code), expected.Decode(code));
+  }
+  if (!predict) {
+    return;
+  }
+  // fill the whole memory, as it is not checkpointed
+  std::vector<std::string> start = Words(0, 3);
+  expected.UpdateMemory(start.begin(), start.end());
+  actual.UpdateMemory(start.begin(), start.end());
+  for (int i = 0; i < 50; ++i) {
+    EXPECT_EQ(actual.PredictState(true), expected.PredictState(true));
+  }
+}
+
+
+// DeltaLogTest is the suite for checkpoints and replay
+
+TEST(DeltaLogTest, RecorderMergesDeltas) {
+  DeltaRecorder<int> recorder;
+  recorder.Record(1, 0, 2, 1);
+  EXPECT_TRUE(recorder.Take().empty());
+  recorder.Enable();
+  recorder.Record(3, 1, 0, 1);
+  recorder.Record(1, 0, 2, 1);
+  recorder.Record(3, 1, 0, 2);
+  recorder.Record(1, 0, 2, 1);
+  std::vector<TransitionDelta<int>> expected{{1, 0, 2, 2}, {3, 1, 0, 3}};
+  EXPECT_EQ(recorder.Take(), expected);
+  EXPECT_TRUE(recorder.Take().empty());
+}
+
+
+TEST(DeltaLogTest, RecorderGrowsWithCells) {
+  DeltaRecorder<int> recorder;
+  recorder.Enable();
+  for (int i = 0; i < 1000; ++i) {
+    recorder.Record(i % 4, 0, 1, 1);
+  }
+  std::size_t bytes = recorder.MemoryUsage();
+  for (int i = 0; i < 100000; ++i) {
+    recorder.Record(i % 4, 0, 1, 1);
+  }
+  // the same cells are counted in place
+  EXPECT_EQ(recorder.MemoryUsage(), bytes);
+  std::vector<TransitionDelta<int>> deltas = recorder.Take();
+  ASSERT_EQ(deltas.size(), 4);
+  EXPECT_EQ(deltas[3].delta, 101000 / 4);
+}
+
+
+TEST(DeltaLogTest, ReplicaCatchesUp) {
+  evolv::MarkovChain<std::string> primary(2, RANDOM_STATE),
+      replica(2, RANDOM_STATE);
+  std::stringstream log;
+  for (int i = 0; i < 5; ++i) {
+    std::vector<std::string> words = Words(i, 40 + i);
+    primary.FeedSequence(words.begin(), words.end());
+    primary.Checkpoint(log);
+    EXPECT_EQ(replica.Replay(log), 1);
+    EXPECT_EQ(replica.CheckpointSeq(), primary.CheckpointSeq());
+  }
+  EXPECT_EQ(replica.Replay(log), 0);
+  ExpectSameModel(primary, replica);
+}
+
+
+TEST(DeltaLogTest, DeltaIsProportionalToChanges) {
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  std::vector<std::string> words = Words(0, 5000);
+  chain.FeedSequence(words.begin(), words.end());
+  std::stringstream snapshot, delta;
+  chain.Checkpoint(snapshot);
+  words = Words(1, 3);
+  chain.FeedSequence(words.begin(), words.end());
+  chain.Checkpoint(delta);
+  EXPECT_LT(delta.str().size(), 200);
+  EXPECT_GT(snapshot.str().size(), delta.str().size());
+}
+
+
+TEST(DeltaLogTest, CutBlockIsNotApplied) {
+  evolv::MarkovChain<std::string> primary(1, RANDOM_STATE),
+      replica(1, RANDOM_STATE);
+  std::stringstream log;
+  std::vector<std::string> words = Words(0, 50);
+  primary.FeedSequence(words.begin(), words.end());
+  primary.Checkpoint(log);
+  std::size_t complete = log.str().size();
+  words = Words(3, 50);
+  primary.FeedSequence(words.begin(), words.end());
+  primary.Checkpoint(log);
+
+  std::string cut = log.str();
+  cut.resize(cut.size() - 5);
+  std::stringstream cut_log(cut);
+  EXPECT_EQ(replica.Replay(cut_log), 1);
+  EXPECT_EQ(static_cast<std::size_t>(cut_log.tellg()), complete);
+  EXPECT_EQ(replica.CheckpointSeq(), 1);
+}
+
+
+TEST(DeltaLogTest, SnapshotCoversLog) {
+  evolv::MarkovChain<std::string> primary(1, RANDOM_STATE),
+      replica(1, RANDOM_STATE);
+  std::stringstream log, snapshot;
+  for (int i = 0; i < 3; ++i) {
+    std::vector<std::string> words = Words(i, 30);
+    primary.FeedSequence(words.begin(), words.end());
+    primary.Checkpoint(log);
+  }
+  primary.Compact(snapshot);
+  std::vector<std::string> words = Words(7, 30);
+  primary.FeedSequence(words.begin(), words.end());
+  primary.Checkpoint(log);
+
+  // blocks of log before the snapshot are skipped, the last one is applied
+  EXPECT_EQ(replica.Replay(snapshot), 1);
+  EXPECT_EQ(replica.Replay(log), 1);
+  EXPECT_EQ(replica.CheckpointSeq(), 5);
+  ExpectSameModel(primary, replica);
+}
+
+
+TEST(DeltaLogTest, MissingBlockStopsReplay) {
+  evolv::MarkovChain<int> primary(0, RANDOM_STATE), replica(0, RANDOM_STATE);
+  std::stringstream first, second, third;
+  std::vector<int> seq{1, 2, 3, 1, 2};
+  primary.FeedSequence(seq.begin(), seq.end());
+  primary.Checkpoint(first);
+  primary.FeedSequence(seq.begin(), seq.end());
+  primary.Checkpoint(second);
+  primary.FeedSequence(seq.begin(), seq.end());
+  primary.Checkpoint(third);
+  EXPECT_EQ(replica.Replay(first), 1);
+  EXPECT_EQ(replica.Replay(third), 0);
+  EXPECT_EQ(third.tellg(), 0);
+  EXPECT_EQ(replica.Replay(second), 1);
+  EXPECT_EQ(replica.Replay(third), 1);
+  EXPECT_EQ(replica.Stats().transitions, primary.Stats().transitions);
+}
+
+
+TEST(DeltaLogTest, OtherMemorySizeIsNotApplied) {
+  evolv::MarkovChain<std::string> primary(2, RANDOM_STATE),
+      replica(1, RANDOM_STATE);
+  std::stringstream log;
+  std::vector<std::string> words = Words(0, 30);
+  primary.FeedSequence(words.begin(), words.end());
+  primary.Checkpoint(log);
+  EXPECT_EQ(replica.Replay(log), 0);
+  EXPECT_EQ(log.tellg(), 0);
+  EXPECT_EQ(replica.Stats().states, 0);
+}
+
+
+TEST(DeltaLogTest, TransitionsOutOfChainAreNotApplied) {
+  using Format = DeltaLogFormat<std::string, int>;
+  std::vector<TransitionDelta<int>> broken[] = {
+      {{0, 2, 1, 1}}, {{0, -1, 1, 1}}, {{0, 0, 2, 1}}, {{0, 0, 1, 0}}};
+  for (const auto &transitions : broken) {
+    evolv::MarkovChain<std::string> replica(1, RANDOM_STATE);
+    std::stringstream log;
+    Format::Write(log, {1, true, false, 2, 0, {"a", "b"}, transitions});
+    EXPECT_EQ(replica.Replay(log), 0);
+    EXPECT_EQ(log.tellg(), 0);
+    EXPECT_EQ(replica.Stats().states, 0);
+  }
+  evolv::MarkovChain<std::string> replica(1, RANDOM_STATE);
+  std::stringstream log;
+  Format::Write(log, {1, true, false, 2, 0, {"a", "b"}, {{0, 1, 1, 1}}});
+  EXPECT_EQ(replica.Replay(log), 1);
+  EXPECT_EQ(replica.Stats().transitions, 1);
+}
+
+
+TEST(DeltaLogTest, CountsBeyondPayloadAreNotRead) {
+  using Format = DeltaLogFormat<std::string, int>;
+  std::stringstream log;
+  Format::Write(log, {1, true, false, 1, 0, {"a"}, {{0, 0, 0, 1}}});
+  std::string bytes = log.str();
+  // num_transitions follows magic, flags, memory_size, seq and first_code
+  uint64_t num_transitions = uint64_t{1} << 60;
+  std::memcpy(bytes.data() + 36, &num_transitions, sizeof(num_transitions));
+  std::stringstream broken(bytes);
+  DeltaBlock<std::string, int> block;
+  EXPECT_FALSE(Format::Read(broken, block));
+  EXPECT_EQ(broken.tellg(), 0);
+}
+
+
+TEST(DeltaLogTest, RecoverFromFiles) {
+  auto dir = std::filesystem::temp_directory_path() / "evolv_delta_log_test";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto snapshot_path = dir / "model.snapshot", log_path = dir / "model.log";
+
+  evolv::MarkovChain<std::string> primary(1, RANDOM_STATE);
+  evolv::CheckpointLog checkpoints(primary, snapshot_path, log_path, 3);
+  for (int i = 0; i < 8; ++i) {
+    std::vector<std::string> words = Words(i, 20);
+    primary.FeedSequence(words.begin(), words.end());
+    checkpoints.Checkpoint();
+  }
+  // crash in the middle of appending the block
+  std::ofstream(log_path, std::ios::binary | std::ios::app) << "EVDL";
+  std::size_t log_bytes = std::filesystem::file_size(log_path);
+
+  evolv::MarkovChain<std::string> recovered(1, RANDOM_STATE);
+  evolv::CheckpointLog recovery(recovered, snapshot_path, log_path, 3);
+  // snapshot of checkpoint 7 and the block of checkpoint 8
+  EXPECT_EQ(recovery.Recover(), 2);
+  EXPECT_EQ(std::filesystem::file_size(log_path), log_bytes - 4);
+  EXPECT_EQ(recovered.CheckpointSeq(), 8);
+
+  std::vector<std::string> words = Words(11, 20);
+  primary.FeedSequence(words.begin(), words.end());
+  checkpoints.Checkpoint();
+  recovered.FeedSequence(words.begin(), words.end());
+  recovery.Checkpoint();
+  ExpectSameModel(primary, recovered);
+
+  evolv::MarkovChain<std::string> replica(1, RANDOM_STATE);
+  EXPECT_EQ(evolv::CheckpointLog(replica, snapshot_path, log_path).Recover(),
+            3);
+  ExpectSameModel(primary, replica, false);
+  std::filesystem::remove_all(dir);
+}
+
+
+TEST(DeltaLogTest, RecoverAfterPrune) {
+  auto dir = std::filesystem::temp_directory_path() / "evolv_prune_log_test";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto snapshot_path = dir / "model.snapshot", log_path = dir / "model.log";
+
+  evolv::MarkovChain<std::string> primary(1, RANDOM_STATE);
+  evolv::CheckpointLog checkpoints(primary, snapshot_path, log_path, 100);
+  for (int i = 0; i < 3; ++i) {
+    std::vector<std::string> words = Words(i, 20);
+    primary.FeedSequence(words.begin(), words.end());
+    checkpoints.Checkpoint();
+  }
+  primary.Prune(1, 10, "<UNK>");
+  EXPECT_TRUE(primary.NextCheckpointIsSnapshot());
+  checkpoints.Checkpoint();
+  std::vector<std::string> words = Words(5, 20);
+  words.push_back("word never seen");
+  primary.FeedSequence(words.begin(), words.end());
+  checkpoints.Checkpoint();
+
+  evolv::MarkovChain<std::string> recovered(1, RANDOM_STATE);
+  // snapshot taken after Prune and the block of the last checkpoint
+  EXPECT_EQ(evolv::CheckpointLog(recovered, snapshot_path, log_path)
+                .Recover(),
+            2);
+  ExpectSameModel(primary, recovered, false);
+  EXPECT_EQ(recovered.Encode("another word never seen"), 0);
+  EXPECT_EQ(recovered.Decode(0), "<UNK>");
+  std::filesystem::remove_all(dir);
+}
+
+
+TEST(DeltaLogTest, SnapshotAfterBlocksIsNotApplied) {
+  evolv::MarkovChain<std::string> primary(1, RANDOM_STATE);
+  std::stringstream log;
+  std::vector<std::string> words = Words(0, 20);
+  primary.FeedSequence(words.begin(), words.end());
+  primary.Checkpoint(log);
+  std::streampos end = log.tellp();
+  primary.Prune(1, 10, "<UNK>");
+  primary.Checkpoint(log);
+
+  evolv::MarkovChain<std::string> replica(1, RANDOM_STATE);
+  EXPECT_EQ(replica.Replay(log), 1);
+  EXPECT_EQ(log.tellg(), end);
+}
+
+
+TEST(DeltaLogTest, RecoverAfterRecode) {
+  auto dir = std::filesystem::temp_directory_path() / "evolv_recode_log_test";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  auto snapshot_path = dir / "model.snapshot", log_path = dir / "model.log";
+
+  evolv::MarkovChain<std::string> primary(1, RANDOM_STATE);
+  evolv::CheckpointLog checkpoints(primary, snapshot_path, log_path, 100);
+  for (int i = 0; i < 3; ++i) {
+    std::vector<std::string> words = Words(i, 20);
+    primary.FeedSequence(words.begin(), words.end());
+    checkpoints.Checkpoint();
+  }
+  primary.Recode(evolv::RecodeOrder::kCoOccurrence);
+  checkpoints.Checkpoint();
+  std::vector<std::string> words = Words(5, 30);
+  primary.FeedSequence(words.begin(), words.end());
+  checkpoints.Checkpoint();
+
+  evolv::MarkovChain<std::string> recovered(1, RANDOM_STATE);
+  // snapshot taken after Recode and the block of the last checkpoint
+  EXPECT_EQ(evolv::CheckpointLog(recovered, snapshot_path, log_path)
+                .Recover(),
+            2);
+  ExpectSameModel(primary, recovered);
+  std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cmath>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// FactorizedChainTest is the suite for chain sampling class, then state
+
+TEST(FactorizedChainTest, ClassPerStateIsExact) {
+  std::vector<std::string> seq{"a", "b", "a", "c", "a", "b", "a", "b"};
+  evolv::FactorizedChain<std::string> chain(
+      0, 3, {{"a", 0}, {"b", 1}, {"c", 2}});
+  chain.FeedSequence(seq.begin(), seq.end());
+  EXPECT_EQ(chain.NumStates(), 3);
+
+  Xoshiro256pp rng(RANDOM_STATE);
+  std::vector<std::string> memory{"a"};
+  std::map<std::string, int> count;
+  for (int i = 0; i < 30000; ++i) {
+    count[*chain.PredictState<Xoshiro256pp>(memory, rng)]++;
+  }
+  EXPECT_EQ(count.size(), 2);
+  EXPECT_NEAR(count["b"] / 30000., 0.75, 0.01);
+  memory = {"b"};
+  EXPECT_EQ(chain.PredictState<Xoshiro256pp>(memory, rng), "a");
+  memory = {"never seen"};
+  EXPECT_EQ(chain.PredictState<Xoshiro256pp>(memory, rng), std::nullopt);
+}
+
+
+TEST(FactorizedChainTest, SamplesClassThenState) {
+  // "x" is followed by class of "a" and "b" twice and by class of "c"
+  // and "x" once. As targets "a" comes 5 times, "b" twice, "c" 4 times
+  // and "x" twice
+  std::vector<std::string> seq{"x", "a", "x", "c", "x", "b", "a",
+                               "a", "c", "c", "a", "b", "a", "c"};
+  for (int memorize_previous : {0, 1}) {
+    evolv::FactorizedChain<std::string> chain(
+        memorize_previous, 2, {{"a", 0}, {"b", 0}, {"c", 1}, {"x", 1}});
+    chain.FeedSequence(seq.begin(), seq.end());
+    EXPECT_EQ(chain.ClassOf(*chain.Find("b")), 0);
+
+    Xoshiro256pp rng(RANDOM_STATE);
+    std::vector<std::string> memory{"x", "c"};
+    std::map<std::string, int> count;
+    for (int i = 0; i < 60000; ++i) {
+      count[*chain.PredictState<Xoshiro256pp>(memory, rng)]++;
+    }
+    // with memory "c" adds class of "a" and "b" 3 times in 2 steps
+    double first = memorize_previous == 0 ? 2. / 3 : 5. / 6;
+    EXPECT_NEAR(count["a"] / 60000., first * 5 / 7, 0.01);
+    EXPECT_NEAR(count["b"] / 60000., first * 2 / 7, 0.01);
+    EXPECT_NEAR(count["c"] / 60000., (1 - first) * 4 / 6, 0.01);
+    EXPECT_NEAR(count["x"] / 60000., (1 - first) * 2 / 6, 0.01);
+  }
+}
+
+
+TEST(FactorizedChainTest, FrequencyClasses) {
+  std::vector<std::string> sample{"a", "a", "a", "a", "b", "b",
+                                  "c", "d", "e", "f"};
+  auto classes =
+      evolv::FactorizedChain<std::string>::FrequencyClasses(sample.begin(),
+                                                            sample.end(), 3);
+  // bins of about 10 / 3 occurrences by descending frequency
+  EXPECT_EQ(classes["a"], 0);
+  EXPECT_EQ(classes["b"], 1);
+  EXPECT_EQ(classes["c"], 1);
+  EXPECT_EQ(classes["d"], 2);
+  EXPECT_EQ(classes["f"], 2);
+}
+
+
+TEST(FactorizedChainTest, SmallerThanChain) {
+  // long tail of words, the i-th comes every i + 1 rounds
+  std::vector<std::string> words;
+  for (int round = 0; round < 300; ++round) {
+    for (int i = 0; i < 3000; ++i) {
+      if (round % (i + 1) == 0) {
+        words.push_back("word " + std::to_string(i));
+      }
+    }
+  }
+  for (int memorize_previous : {0, 2}) {
+    evolv::MarkovChain<std::string> chain(memorize_previous, RANDOM_STATE);
+    chain.FeedSequence(words.begin(), words.end());
+    std::size_t num_classes = std::sqrt(3000);
+    evolv::FactorizedChain<std::string> factorized(
+        memorize_previous, num_classes,
+        evolv::FactorizedChain<std::string>::FrequencyClasses(
+            words.begin(), words.end(), num_classes));
+    factorized.FeedSequence(words.begin(), words.end());
+    EXPECT_EQ(factorized.NumStates(), 3000);
+    EXPECT_LT(factorized.MemoryUsage(), chain.MemoryUsage().Total() / 10);
+
+    Xoshiro256pp rng(RANDOM_STATE);
+    std::vector<std::string> memory{"word 0", "word 1", "word 2"};
+    for (int i = 0; i < 100; ++i) {
+      ASSERT_TRUE(factorized.PredictState<Xoshiro256pp>(memory, rng));
+    }
+  }
+}
@@ -17,6 +17,17 @@ TEST(FenwickTreeTest, ConstructEmpty) {
 }
 
 
+TEST(FenwickTreeTest, EmptyAllocatesNothing) {
+  FenwickTree<int> ft;
+  EXPECT_EQ(ft.MemoryUsage(), sizeof(ft));
+  EXPECT_EQ(ft.Sum(5), 0);
+  EXPECT_EQ(ft.UpperBound(0), 0);
+  EXPECT_TRUE(ft.Add(3, 2));
+  EXPECT_EQ(ft.Size(), 4);
+  EXPECT_EQ(ft.Sum(3), 2);
+}
+
+
 TEST(FenwickTreeTest, ConstructZero) {
   FenwickTree<int> ft(10);
   EXPECT_EQ(ft.Size(), 10);
@@ -70,6 +81,16 @@ TEST(FenwickTreeTest, UpperBound) {
 }
 
 
+TEST(FenwickTreeTest, ConstructFromCounts) {
+  std::vector<int> counts{0, 3, 5, 1, 4, 3, 2, 4, 0, 1, 6};
+  FenwickTree<int> ft(counts);
+  EXPECT_EQ(ft.Size(), counts.size());
+  EXPECT_EQ(ft.TotalSum(), 29);
+  EXPECT_EQ(ft.AsCounter(), counts);
+  EXPECT_EQ(ft.UpperBound(8), 3);
+}
+
+
 // FenwickTreeFixtTest is the suite for FenwickTree built on NUMS
 
 //                    index 0  1  2  3  4  5  6  7  8  9
@@ -129,3 +150,27 @@ TEST_F(FenwickTreeFixtTest, UpperBound) {
   EXPECT_EQ(ft.UpperBound(22), 9);
   EXPECT_EQ(ft.UpperBound(23), 10);
 }
+
+
+TEST_F(FenwickTreeFixtTest, UpperBounds) {
+  std::vector<int> xs{-1, 0, 0, 1, 3, 15, 18, 18, 21, 22, 23};
+  std::vector<int64_t> out(xs.size());
+  ft.UpperBounds(xs, out);
+  for (std::size_t i = 0; i < xs.size(); ++i) {
+    EXPECT_EQ(out[i], ft.UpperBound(xs[i])) << xs[i];
+  }
+}
+
+
+TEST(FenwickTreeTest, UpperBoundsOverTrees) {
+  std::vector<int> short_counts{2, 0, 1}, long_counts{0, 3, 0, 0, 4, 1};
+  FenwickTree<int> short_tree(short_counts), long_tree(long_counts);
+  std::vector<const FenwickTree<int> *> trees{&short_tree, nullptr,
+                                              &long_tree};
+  // prefix sums of counts added up: 2 5 6 6 10 11
+  std::vector<int> xs{0, 1, 2, 4, 5, 6, 9, 10};
+  std::vector<int64_t> out(xs.size()), expected{0, 0, 1, 1, 2, 4, 4, 5};
+  std::vector<int> bases;
+  FenwickTree<int>::UpperBounds(trees, xs, out, bases);
+  EXPECT_EQ(out, expected);
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <array>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// Model written by WriteFrozenHeader for chain remembering one previous
+// state, that learned "GET OK GET DATA GET OK CLOSE"
+inline constexpr evolv::FrozenChain<std::string_view, int, 2, 4, 9>
+    kFrozenProtocol(
+        // states by codes
+        {"GET", "OK", "DATA", "CLOSE"},
+        // codes ordered by states
+        {3, 2, 0, 1},
+        // first entries of rows, targets and prefix sums
+        {{0, 2, 4, 6, 7, 8, 9, 9, 9},
+         {1, 2, 0, 3, 0, 3, 2, 0, 1},
+         {2, 3, 2, 3, 1, 2, 1, 1, 1}});
+
+constexpr std::string_view kFrozenProtocolHeader =
+    R"(// Generated by evolv::WriteFrozenHeader, do not edit
+#pragma once
+
+#include "src/evolv.h"
+
+inline constexpr evolv::FrozenChain<std::string_view, int, 2, 4, 9>
+    kFrozenProtocol(
+        // states by codes
+        {"GET", "OK", "DATA", "CLOSE"},
+        // codes ordered by states
+        {3, 2, 0, 1},
+        // first entries of rows, targets and prefix sums
+        {{0, 2, 4, 6, 7, 8, 9, 9, 9},
+         {1, 2, 0, 3, 0, 3, 2, 0, 1},
+         {2, 3, 2, 3, 1, 2, 1, 1, 1}});
+)";
+
+
+// FrozenChainTest is the suite for chains generated as constexpr headers
+
+TEST(FrozenChainTest, WritesHeader) {
+  std::vector<std::string> seq{"GET", "OK", "GET", "DATA",
+                               "GET", "OK", "CLOSE"};
+  evolv::MarkovChain<std::string> chain(1, RANDOM_STATE);
+  chain.FeedSequence(seq.begin(), seq.end());
+  std::ostringstream os;
+  evolv::WriteFrozenHeader(os, chain, "kFrozenProtocol");
+  EXPECT_EQ(os.str(), kFrozenProtocolHeader);
+}
+
+
+TEST(FrozenChainTest, WritesLiterals) {
+  std::ostringstream os;
+  FrozenState<std::string>::Write(os, "say \"hi\"\\\n\xff");
+  EXPECT_EQ(os.str(), R"("say \"hi\"\\\012\377")");
+  os.str("");
+  FrozenState<int64_t>::Write(os, std::numeric_limits<int64_t>::min());
+  EXPECT_EQ(os.str(), "(-9223372036854775807 - 1)");
+  EXPECT_EQ(IntegralTypeName<uint16_t>(), "uint16_t");
+}
+
+
+TEST(FrozenChainTest, ConstantExpressions) {
+  static_assert(kFrozenProtocol.NumStates() == 4);
+  static_assert(kFrozenProtocol.Find("DATA") == 2);
+  static_assert(!kFrozenProtocol.Find("PUT"));
+  static_assert(kFrozenProtocol.Decode(3) == "CLOSE");
+  // "DATA" is followed only by "GET"
+  constexpr std::optional<std::string_view> next = [] {
+    Xoshiro256pp rng(RANDOM_STATE);
+    std::array<std::string_view, 1> memory{"DATA"};
+    return kFrozenProtocol.PredictState<Xoshiro256pp>(memory, rng);
+  }();
+  static_assert(next == "GET");
+  EXPECT_EQ(kFrozenProtocol.MemoryUsage(), sizeof(kFrozenProtocol));
+}
+
+
+TEST(FrozenChainTest, SamplesLikeChain) {
+  Xoshiro256pp rng(RANDOM_STATE);
+  // "GET" is followed by "OK" twice and "DATA" once, "OK" is followed by
+  // "DATA" once in 2 steps
+  std::array<std::string_view, 2> memory{"GET", "OK"};
+  std::map<std::string_view, int> count;
+  for (int i = 0; i < 40000; ++i) {
+    count[*kFrozenProtocol.PredictState<Xoshiro256pp>(memory, rng)]++;
+  }
+  EXPECT_EQ(count.size(), 2);
+  EXPECT_NEAR(count["OK"] / 40000., 0.5, 0.01);
+
+  memory = {"CLOSE", "OK"};
+  EXPECT_EQ(kFrozenProtocol.PredictState<Xoshiro256pp>(
+                std::span(memory).first(1), rng),
+            std::nullopt);
+  memory = {"PUT", "GET"};
+  for (int i = 0; i < 100; ++i) {
+    std::optional<std::string_view> next =
+        kFrozenProtocol.PredictState<Xoshiro256pp>(memory, rng);
+    EXPECT_TRUE(next == "GET" || next == "CLOSE");
+  }
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+Generator<int> CountTo(int limit) {
+  for (int i = 0; i < limit; ++i) {
+    co_yield i;
+  }
+}
+
+
+// GeneratorTest is the suite for coroutine generator and chain walks
+
+TEST(GeneratorTest, YieldsInOrder) {
+  std::vector<int> values;
+  for (int value : CountTo(5)) {
+    values.push_back(value);
+  }
+  EXPECT_EQ(values, (std::vector<int>{0, 1, 2, 3, 4}));
+}
+
+
+TEST(GeneratorTest, RangeAdaptors) {
+  static_assert(std::ranges::input_range<Generator<int>>);
+  static_assert(std::ranges::view<Generator<const std::string &>>);
+  std::vector<int> values;
+  for (int value : CountTo(100) | std::views::take_while(
+                                      [](int value) { return value < 3; })) {
+    values.push_back(value);
+  }
+  EXPECT_EQ(values, (std::vector<int>{0, 1, 2}));
+}
+
+
+TEST(GeneratorTest, WalkCodesEndsAtDeadEnd) {
+  std::vector<int> seq{0, 1, 2, 3};
+  ForgorChain<int> chain(RANDOM_STATE);
+  chain.FeedSequenceImpl(seq.begin(), seq.end());
+  chain.UpdateMemory(0);
+  std::vector<int> walked;
+  for (int code : chain.WalkCodes()) {
+    walked.push_back(code);
+  }
+  EXPECT_EQ(walked, (std::vector<int>{1, 2, 3}));
+  EXPECT_EQ(chain.GetMemory(), std::deque<int>{3});
+}
+
+
+TEST(GeneratorTest, WalkSameAsPredictState) {
+  std::vector<std::string> sentenses{"The", "day",   "follows", "night", ".",
+                                     "The", "night", "follows", "day",   "."};
+  evolv::MarkovChain<std::string> walked(1, RANDOM_STATE),
+      predicted(1, RANDOM_STATE);
+  walked.FeedSequence(sentenses.begin(), sentenses.end());
+  predicted.FeedSequence(sentenses.begin(), sentenses.end());
+
+  // Walk is suspended at yield, so the memory is already updated
+  int steps = 0;
+  for (std::string_view state : walked.Walk()) {
+    EXPECT_EQ(state, predicted.PredictState(true));
+    if (++steps == 30) {
+      break;
+    }
+  }
+  EXPECT_EQ(walked.GetMemory(), predicted.GetMemory());
+}
+
+
+TEST(GeneratorTest, WalkUntilTerminal) {
+  std::vector<std::string> sentenses{"The", "day",   "follows", "night", ".",
+                                     "The", "night", "follows", "day",   "."};
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  chain.FeedSequence(sentenses.begin(), sentenses.end());
+  chain.UpdateMemory("The");
+  std::vector<std::string> sentence;
+  for (std::string_view word :
+       chain.Walk() | std::views::take_while([](std::string_view word) {
+         return word != ".";
+       })) {
+    sentence.emplace_back(word);
+  }
+  // "The" is never followed by "."
+  ASSERT_FALSE(sentence.empty());
+  EXPECT_TRUE(sentence[0] == "day" || sentence[0] == "night");
+  EXPECT_EQ(chain.GetMemory().front(), ".");
+}
+
+
+TEST(GeneratorTest, WalkRefersToStoredStates) {
+  std::vector<int> seq{7, 8, 7, 8};
+  evolv::MarkovChain<int> chain(0, RANDOM_STATE);
+  chain.FeedSequence(seq.begin(), seq.end());
+  auto walk = chain.Walk();
+  auto it = walk.begin();
+  const int *first = &*it;
+  EXPECT_EQ(*it, 7);
+  ++it;
+  ++it;
+  EXPECT_EQ(&*it, first);
+}
+
+
+TEST(GeneratorTest, WalkViewsStoredStrings) {
+  std::vector<std::string> seq{"a state too long for small strings",
+                               "another state too long for small strings"};
+  seq.push_back(seq[0]);
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  chain.FeedSequence(seq.begin(), seq.end());
+  auto walk = chain.Walk();
+  auto it = walk.begin();
+  std::string_view first = *it;
+  EXPECT_EQ(first, seq[1]);
+  ++it;
+  ++it;
+  EXPECT_EQ((*it).data(), first.data());
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+enum class Event : uint8_t { kOpen = 10, kRead, kWrite, kClose };
+
+template <>
+struct evolv::utils::StateRange<Event> {
+  static constexpr int64_t kMin = 10;
+  static constexpr int64_t kMax = 13;
+};
+
+
+using namespace evolv::internal;
+
+
+// IntegralCodersTest is the suite for coders that don't hash states
+
+TEST(IntegralCodersTest, DefaultCoderSelection) {
+  EXPECT_TRUE((std::is_same_v<DefaultCoderOf<Event, int>::Type,
+                              TableCoder<Event, int>>));
+  EXPECT_TRUE((std::is_same_v<DefaultCoderOf<int, int>::Type,
+                              StateCoder<int, int>>));
+  EXPECT_TRUE((std::is_same_v<DefaultCoderOf<std::string, int>::Type,
+                              StateCoder<std::string, int>>));
+}
+
+
+TEST(IntegralCodersTest, IdentityCoder) {
+  IdentityCoder<int64_t, int> coder;
+  EXPECT_EQ(coder.Size(), 0);
+  EXPECT_EQ(coder.Encode(5), 5);
+  EXPECT_EQ(coder.Encode(2), 2);
+  EXPECT_EQ(coder.Size(), 6);
+  EXPECT_EQ(coder.Decode(5), 5);
+
+  std::vector<int> codes{1, 9, 3};
+  coder.Admit(codes);
+  EXPECT_EQ(coder.Size(), 10);
+}
+
+
+TEST(IntegralCodersTest, TableCoder) {
+  TableCoder<Event, int> coder;
+  EXPECT_EQ(coder.Encode(Event::kClose), 0);
+  EXPECT_EQ(coder.Encode(Event::kOpen), 1);
+  EXPECT_EQ(coder.Encode(Event::kClose), 0);
+  EXPECT_EQ(coder.Decode(1), Event::kOpen);
+  EXPECT_EQ(coder.Size(), 2);
+  EXPECT_GT(coder.MemoryUsage(), sizeof(coder));
+}
+
+
+TEST(IntegralCodersTest, MarkovChainOnEnum) {
+  std::vector<Event> seq{Event::kOpen,  Event::kRead, Event::kWrite,
+                         Event::kClose, Event::kOpen, Event::kRead};
+  evolv::MarkovChain<Event> chain(0, RANDOM_STATE);
+  chain.FeedSequence(seq.begin(), seq.end());
+  EXPECT_EQ(chain.PredictState(true), Event::kWrite);
+  EXPECT_EQ(chain.PredictState(true), Event::kClose);
+  EXPECT_EQ(chain.Stats().states, 4);
+}
+
+
+TEST(IntegralCodersTest, FeedCodesWithIdentity) {
+  using Chain = evolv::MarkovChain<int, int, Xoshiro256pp, NoMetrics,
+                                   IdentityCoder<int, int>>;
+  std::vector<int> seq{0, 1, 2, 0, 1, 2, 0};
+  Chain fed_codes(1, RANDOM_STATE), fed_states(1, RANDOM_STATE);
+  fed_codes.FeedCodes(seq);
+  std::deque<int> states(seq.begin(), seq.end());
+  fed_states.FeedSequence(states.begin(), states.end());
+  EXPECT_EQ(fed_codes.GetMemory(), fed_states.GetMemory());
+  EXPECT_EQ(fed_codes.Stats().transitions, fed_states.Stats().transitions);
+  EXPECT_EQ(fed_codes.Stats().states, 3);
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(fed_codes.PredictState(true), (i + 1) % 3);
+  }
+}
+
+
+TEST(IntegralCodersTest, FeedCodesWithStateCoder) {
+  std::vector<std::string> words{"a", "b", "c"};
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  std::vector<int> codes;
+  for (int i = 0; i < 7; ++i) {
+    codes.push_back(chain.Encode(words[i % 3]));
+  }
+  chain.FeedCodes(codes, true);
+  EXPECT_EQ(chain.GetMemory(), std::deque<std::string>{"a"});
+  EXPECT_EQ(chain.PredictState(), "b");
+  EXPECT_EQ(chain.Decode(codes[2]), "c");
+}
+
+
+TEST(IntegralCodersTest, EncodeConcurrent) {
+  auto sequences = CodeSequences(100, 50, 4, 3);
+  evolv::MarkovChain<int, int, Xoshiro256pp, NoMetrics, IdentityCoder<int, int>>
+      identity(0, RANDOM_STATE);
+  evolv::MarkovChain<Event> table(0, RANDOM_STATE);
+  FeedOnThreads(4, sequences.size(), [&](std::size_t i) {
+    identity.FeedSequenceConcurrent(sequences[i].begin(), sequences[i].end());
+    std::vector<Event> events;
+    for (int code : sequences[i]) {
+      events.push_back(static_cast<Event>(code + 10));
+    }
+    table.FeedSequenceConcurrent(events.begin(), events.end());
+  });
+  EXPECT_EQ(identity.Stats().states, 4);
+  EXPECT_EQ(table.Stats().states, 4);
+  EXPECT_EQ(identity.Stats().transitions, 100 * 49);
+  EXPECT_EQ(table.Stats().transitions, 100 * 49);
+  for (int state = 0; state < 4; ++state) {
+    auto event = static_cast<Event>(state + 10);
+    EXPECT_EQ(table.Decode(table.Encode(event)), event);
+  }
+}
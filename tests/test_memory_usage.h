@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// MemoryUsageTest is the suite for memory accounting and compaction
+
+TEST(MemoryUsageTest, AllocatedBytes) {
+  EXPECT_EQ(AllocatedBytes(0), 0);
+  EXPECT_EQ(AllocatedBytes(1), 32);
+  EXPECT_EQ(AllocatedBytes(24), 32);
+  EXPECT_EQ(AllocatedBytes(25), 48);
+  EXPECT_EQ(AllocatedBytes(100), 112);
+}
+
+
+TEST(MemoryUsageTest, StringHeapBytes) {
+  std::string small = "day", large(100, 'x');
+  EXPECT_EQ(HeapBytes(small), 0);
+  EXPECT_GE(HeapBytes(large), 101);
+  EXPECT_EQ(HeapBytes(42), 0);
+}
+
+
+TEST(MemoryUsageTest, ContainersSlack) {
+  std::vector<int64_t> vec;
+  EXPECT_EQ(VectorBytes(vec), 0);
+  vec.reserve(100);
+  EXPECT_EQ(VectorBytes(vec), AllocatedBytes(800));
+
+  std::unordered_map<int, int> map;
+  EXPECT_EQ(HashTableBytes(map), 0);
+  map.reserve(1000);
+  std::size_t empty_bytes = HashTableBytes(map);
+  EXPECT_GE(empty_bytes, 1000 * sizeof(void *));
+  map[1] = 1;
+  EXPECT_GT(HashTableBytes(map), empty_bytes);
+  map.rehash(0);
+  EXPECT_LT(HashTableBytes(map), empty_bytes);
+}
+
+
+TEST(MemoryUsageTest, FenwickTreeShrinkToFit) {
+  FenwickTree<int64_t> ft(1000);
+  ft.Add(3, 5);
+  ft.Resize(10);
+  std::size_t before = ft.MemoryUsage();
+  ft.ShrinkToFit();
+  EXPECT_LT(ft.MemoryUsage(), before);
+  EXPECT_EQ(ft.Sum(0, 9), 5);
+}
+
+
+TEST(MemoryUsageTest, MarkovChainShrinkToFit) {
+  std::vector<std::string> seq;
+  for (int i = 0; i < 2000; ++i) {
+    seq.push_back("state number " + std::to_string(i % 300));
+  }
+  evolv::MarkovChain<std::string> chain(2, RANDOM_STATE);
+  chain.FeedSequence(seq.begin(), seq.end());
+
+  MemoryReport before = chain.MemoryUsage();
+  EXPECT_GT(before.coder, 300 * 2 * 32);
+  EXPECT_GT(before.counters, 0);
+  EXPECT_GT(before.memory, 0);
+  EXPECT_EQ(before.Total(), before.coder + before.counters + before.memory);
+
+  std::deque<std::string> memory = chain.GetMemory();
+  chain.ShrinkToFit();
+  MemoryReport after = chain.MemoryUsage();
+  EXPECT_LE(after.coder, before.coder);
+  EXPECT_LT(after.counters, before.counters);
+  EXPECT_EQ(chain.GetMemory(), memory);
+  EXPECT_EQ(chain.PredictState(), "state number 200");
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// MetricsTest is the suite for latency histogram and chain statistics
+
+TEST(MetricsTest, HistogramPercentiles) {
+  LatencyHistogram hist;
+  EXPECT_EQ(hist.Percentile(0.5), 0);
+  for (int i = 1; i <= 1000; ++i) {
+    hist.Record(i * 100);
+  }
+  EXPECT_EQ(hist.Count(), 1000);
+  const int sub = LatencyHistogram::kSubBuckets;
+  EXPECT_NEAR(hist.Percentile(0.5), 50000, 50000 / sub);
+  EXPECT_NEAR(hist.Percentile(0.99), 99000, 99000 / sub);
+  EXPECT_LE(hist.Percentile(0.5), hist.Percentile(0.99));
+}
+
+
+TEST(MetricsTest, HistogramSmallValues) {
+  LatencyHistogram hist;
+  for (int i = 0; i < 8; ++i) {
+    hist.Record(i);
+  }
+  EXPECT_EQ(hist.Percentile(0.0), 0);
+  EXPECT_EQ(hist.Percentile(1.0), 7);
+}
+
+
+TEST(MetricsTest, HistogramMerge) {
+  LatencyHistogram low, high;
+  for (int i = 0; i < 900; ++i) {
+    low.Record(100);
+  }
+  for (int i = 0; i < 100; ++i) {
+    high.Record(100000);
+  }
+  low.Merge(high);
+  EXPECT_EQ(low.Count(), 1000);
+  EXPECT_NEAR(low.Percentile(0.5), 100, 100 / LatencyHistogram::kSubBuckets);
+  EXPECT_NEAR(low.Percentile(0.95), 100000,
+              100000 / LatencyHistogram::kSubBuckets);
+}
+
+
+TEST(MetricsTest, NoMetricsIsFree) {
+  EXPECT_TRUE(std::is_empty_v<NoMetrics>);
+  EXPECT_EQ(sizeof(ForgorChain<int>),
+            sizeof(ForgorChain<int, Xoshiro256pp, NoMetrics>));
+  EXPECT_LT(sizeof(ForgorChain<int>),
+            sizeof(ForgorChain<int, Xoshiro256pp, Metrics>));
+}
+
+
+TEST(MetricsTest, FenwickTreeReportsResize) {
+  FenwickTree<int> ft(2);
+  EXPECT_FALSE(ft.Add(1, 1));
+  EXPECT_TRUE(ft.Add(5, 1));
+  EXPECT_FALSE(ft.Add(5, 1));
+}
+
+
+TEST(MetricsTest, SizesWithoutMetrics) {
+  std::vector<std::string> seq{"a", "b", "c", "a", "b", "a"};
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  chain.FeedSequence(seq.begin(), seq.end());
+  chain.PredictState();
+
+  ChainStats stats = chain.Stats();
+  EXPECT_EQ(stats.states, 3);
+  EXPECT_EQ(stats.rows, 3);
+  EXPECT_EQ(stats.transitions, 5);
+  EXPECT_GT(stats.bytes.coder, 0);
+  EXPECT_GT(stats.bytes.counters, 0);
+  EXPECT_GT(stats.bytes.memory, 0);
+  EXPECT_EQ(stats.feeds, 0);
+  EXPECT_EQ(stats.predictions, 0);
+  EXPECT_EQ(stats.row_resizes, 0);
+}
+
+
+TEST(MetricsTest, CollectedMetrics) {
+  std::vector<int> seq{0, 1, 2, 0, 1, 2, 0};
+  evolv::MarkovChain<int, int, Xoshiro256pp, Metrics> chain(2, RANDOM_STATE);
+  chain.FeedSequence(seq.begin(), seq.end());
+  chain.FeedSequence(seq.begin(), seq.end());
+  for (int i = 0; i < 10; ++i) {
+    chain.PredictState(true);
+  }
+
+  ChainStats stats = chain.Stats();
+  EXPECT_EQ(stats.states, 3);
+  EXPECT_EQ(stats.rows, 9);
+  EXPECT_EQ(stats.transitions, 2 * (6 + 5 + 4));
+  EXPECT_EQ(stats.feeds, 2);
+  EXPECT_EQ(stats.predictions, 10);
+  EXPECT_GT(stats.row_resizes, 0);
+  EXPECT_GT(stats.feed_p50_ns, 0);
+  EXPECT_LE(stats.predict_p50_ns, stats.predict_p99_ns);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// OutOfCoreTest is the suite for training through sorted runs on disk
+
+TEST(OutOfCoreTest, SortedRunsMerge) {
+  auto dir = std::filesystem::temp_directory_path() / "evolv_sorted_runs_test";
+  std::filesystem::remove_all(dir);
+  std::vector<TransitionDelta<int>> all;
+  {
+    // buffer of 100 transitions
+    SortedRuns<int> runs(dir, 100 * sizeof(TransitionDelta<int>));
+    Xoshiro256pp rng(RANDOM_STATE);
+    for (int i = 0; i < 5000; ++i) {
+      TransitionDelta<int> transition{static_cast<int>(rng() % 30),
+                                      static_cast<int32_t>(rng() % 3),
+                                      static_cast<int>(rng() % 30), 1};
+      all.push_back(transition);
+      runs.Add(transition);
+    }
+    EXPECT_EQ(runs.NumRuns(), 50);
+    EXPECT_EQ(std::distance(std::filesystem::directory_iterator(dir),
+                            std::filesystem::directory_iterator()),
+              50);
+
+    std::vector<TransitionDelta<int>> merged;
+    runs.Merge([&merged](const TransitionDelta<int> &transition) {
+      merged.push_back(transition);
+    });
+    MergeDeltas(all);
+    EXPECT_EQ(merged, all);
+    EXPECT_EQ(runs.NumRuns(), 0);
+  }
+  EXPECT_TRUE(std::filesystem::is_empty(dir));
+  std::filesystem::remove_all(dir);
+}
+
+
+TEST(OutOfCoreTest, BlockWriter) {
+  using Format = DeltaLogFormat<std::string, int>;
+  DeltaBlock<std::string, int> block{3, true, false, 2, 0, {"a", "b"}, {}};
+  std::stringstream stream;
+  Format::BlockWriter writer(stream, block);
+  for (int to = 0; to < 2; ++to) {
+    writer.Append({0, 0, to, to + 1});
+    block.transitions.push_back({0, 0, to, to + 1});
+  }
+  // unfinished block isn't read
+  DeltaBlock<std::string, int> read;
+  EXPECT_FALSE(Format::Read(stream, read));
+  writer.Finish();
+  ASSERT_TRUE(Format::Read(stream, read));
+  EXPECT_EQ(read.seq, 3);
+  EXPECT_TRUE(read.snapshot);
+  EXPECT_EQ(read.memory_size, 2);
+  EXPECT_EQ(read.states, block.states);
+  EXPECT_EQ(read.transitions, block.transitions);
+}
+
+
+TEST(OutOfCoreTest, TrainsLikeMarkovChain) {
+  auto dir = std::filesystem::temp_directory_path() / "evolv_out_of_core_test";
+  std::filesystem::remove_all(dir);
+  std::vector<std::string> words;
+  Xoshiro256pp rng(RANDOM_STATE);
+  for (int i = 0; i < 20000; ++i) {
+    words.push_back("word " + std::to_string(rng() % (i % 7 == 0 ? 500 : 20)));
+  }
+  for (int memorize_previous : {0, 2}) {
+    evolv::MarkovChain<std::string> chain(memorize_previous, RANDOM_STATE);
+    evolv::OutOfCoreTrainer<std::string> trainer(memorize_previous,
+                                                 dir / "runs", 16 * 1024);
+    for (std::size_t first = 0; first < words.size(); first += 1000) {
+      auto last = words.begin() + std::min(first + 1000, words.size());
+      chain.FeedSequence(words.begin() + first, last);
+      trainer.FeedSequence(words.begin() + first, last);
+    }
+    EXPECT_GT(trainer.NumRuns(), 10);
+    {
+      std::ofstream model(dir / "model.bin", std::ios::binary);
+      trainer.WriteModel(model);
+    }
+
+    evolv::MarkovChain<std::string> loaded(memorize_previous, RANDOM_STATE);
+    std::ifstream model(dir / "model.bin", std::ios::binary);
+    EXPECT_EQ(loaded.Replay(model), 1);
+    DeltaBlock<std::string, int> expected = chain.Export();
+    DeltaBlock<std::string, int> actual = loaded.Export();
+    MergeDeltas(expected.transitions);
+    MergeDeltas(actual.transitions);
+    EXPECT_EQ(actual.states, expected.states);
+    EXPECT_EQ(actual.transitions, expected.transitions);
+    EXPECT_EQ(loaded.Stats().transitions, chain.Stats().transitions);
+  }
+  std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// Memory resource counting allocated bytes and passing them upstream
+class CountingResource : public std::pmr::memory_resource {
+ public:
+  std::size_t allocated = 0;
+  int allocations = 0;
+
+ private:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+    allocated += bytes;
+    allocations++;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void *ptr, std::size_t bytes,
+                     std::size_t alignment) override {
+    std::pmr::new_delete_resource()->deallocate(ptr, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+
+// PmrTest is the suite for allocating from memory resources
+
+TEST(PmrTest, FenwickTreeInPmrVector) {
+  CountingResource resource;
+  std::pmr::vector<FenwickTree<int>> trees(&resource);
+  trees.resize(3);
+  int before = resource.allocations;
+  trees[1].Add(100, 1);
+  EXPECT_GT(resource.allocations, before);
+  EXPECT_EQ(trees[1].Sum(0, 100), 1);
+}
+
+
+TEST(PmrTest, StateCoderAllocatesStrings) {
+  CountingResource resource;
+  StateCoder<std::string, int> coder(&resource);
+  std::string long_state(100, 'x');
+  EXPECT_EQ(coder.Encode(long_state), 0);
+  EXPECT_EQ(coder.Encode("short"), 1);
+  EXPECT_EQ(coder.Encode(long_state), 0);
+  EXPECT_EQ(coder.Decode(0), long_state);
+  EXPECT_GE(resource.allocated, 2 * long_state.size());
+}
+
+
+TEST(PmrTest, ForgorChainAllocatesCounters) {
+  CountingResource resource;
+  std::vector<int> seq{0, 1, 2, 0, 1, 2, 0};
+  ForgorChain<int> chain(RANDOM_STATE, &resource);
+  chain.FeedSequenceImpl(seq.begin(), seq.end());
+  EXPECT_GT(resource.allocations, 0);
+  EXPECT_EQ(chain.PredictState(), 1);
+}
+
+
+TEST(PmrTest, MarkovChainInArena) {
+  std::vector<std::string> seq;
+  for (int i = 0; i < 500; ++i) {
+    seq.push_back("long enough state to allocate " + std::to_string(i % 50));
+  }
+  CountingResource upstream;
+  std::pmr::monotonic_buffer_resource arena(&upstream);
+  evolv::MarkovChain<std::string> arena_chain(2, RANDOM_STATE, &arena);
+  evolv::MarkovChain<std::string> heap_chain(2, RANDOM_STATE);
+  arena_chain.FeedSequence(seq.begin(), seq.end());
+  heap_chain.FeedSequence(seq.begin(), seq.end());
+  EXPECT_GT(upstream.allocated, 50 * 2 * seq[0].size());
+  EXPECT_EQ(arena_chain.Stats().transitions, heap_chain.Stats().transitions);
+  for (int i = 0; i < 20; ++i) {
+    EXPECT_EQ(arena_chain.PredictState(true), heap_chain.PredictState(true));
+  }
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// Words with Zipf-like long tail: word i repeats about 1000 / (i + 1) times
+std::vector<std::string> LongTailWords(int vocabulary) {
+  std::vector<std::string> words;
+  for (int round = 0; round < 1000; ++round) {
+    for (int i = 0; i < vocabulary; ++i) {
+      if (round % (i + 1) == 0) {
+        words.push_back("word " + std::to_string(i));
+      }
+    }
+  }
+  return words;
+}
+
+
+// PruneTest is the suite for vocabulary pruning
+
+TEST(PruneTest, StateCoderPrune) {
+  StateCoder<std::string, int> coder;
+  for (std::string state : {"a", "b", "c", "d"}) {
+    coder.Encode(state);
+  }
+  std::vector<int> new_codes{1, 0, 2, 0};
+  coder.Prune(new_codes, "<UNK>");
+  EXPECT_EQ(coder.Size(), 3);
+  EXPECT_EQ(coder.Decode(0), "<UNK>");
+  EXPECT_EQ(coder.Decode(1), "a");
+  EXPECT_EQ(coder.Decode(2), "c");
+  EXPECT_EQ(coder.Encode("c"), 2);
+  EXPECT_EQ(coder.Encode("b"), 0);
+  EXPECT_EQ(coder.Encode("never seen"), 0);
+  EXPECT_EQ(coder.Encode("<UNK>"), 0);
+  EXPECT_EQ(coder.Size(), 3);
+  EXPECT_EQ(coder.Find("d"), std::nullopt);
+}
+
+
+TEST(PruneTest, MinCount) {
+  std::vector<std::string> words = LongTailWords(500);
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  chain.FeedSequence(words.begin(), words.end());
+  ChainStats before = chain.Stats();
+  EXPECT_EQ(before.states, 500);
+
+  // words with index up to 110 repeat at least 10 times
+  EXPECT_EQ(chain.Prune(10, std::numeric_limits<std::size_t>::max(),
+                        "<UNK>"),
+            111);
+  ChainStats after = chain.Stats();
+  EXPECT_EQ(after.states, 112);
+  EXPECT_EQ(after.transitions, before.transitions);
+  EXPECT_LT(after.bytes.Total(), before.bytes.Total() / 2);
+  EXPECT_EQ(chain.Decode(0), "<UNK>");
+  EXPECT_EQ(chain.Decode(1), "word 0");
+  EXPECT_EQ(chain.Encode("word 110"), 111);
+  EXPECT_EQ(chain.Encode("word 111"), 0);
+  EXPECT_EQ(chain.Encode("word 100500"), 0);
+
+  // unknown states are learned as the same state
+  std::vector<std::string> unseen{"new 1", "new 2", "new 3"};
+  chain.FeedSequence(unseen.begin(), unseen.end());
+  EXPECT_EQ(chain.Stats().states, 112);
+  EXPECT_EQ(chain.Stats().transitions, before.transitions + 2);
+}
+
+
+TEST(PruneTest, TopK) {
+  std::vector<std::string> words = LongTailWords(50);
+  evolv::MarkovChain<std::string> chain(2, RANDOM_STATE);
+  chain.FeedSequence(words.begin(), words.end());
+  EXPECT_EQ(chain.Prune(0, 3, "<UNK>"), 3);
+  EXPECT_EQ(chain.Stats().states, 4);
+  EXPECT_EQ(chain.Decode(1), "word 0");
+  EXPECT_EQ(chain.Decode(3), "word 2");
+  for (const std::string &state : chain.GetMemory()) {
+    EXPECT_TRUE(state == "<UNK>" || state.starts_with("word "));
+  }
+  for (int i = 0; i < 100; ++i) {
+    std::string state = chain.PredictState(true);
+    EXPECT_TRUE(state == "<UNK>" || state == "word 0" || state == "word 1" ||
+                state == "word 2");
+  }
+
+  // pruning again keeps the unknown state
+  EXPECT_EQ(chain.Prune(0, 1, "<UNK>"), 1);
+  EXPECT_EQ(chain.Stats().states, 2);
+  EXPECT_EQ(chain.Decode(0), "<UNK>");
+  EXPECT_EQ(chain.Decode(1), "word 0");
+}
+
+
+TEST(PruneTest, TableCoder) {
+  std::vector<Event> events{Event::kOpen,  Event::kRead, Event::kRead,
+                            Event::kRead,  Event::kRead, Event::kClose,
+                            Event::kWrite, Event::kOpen, Event::kRead};
+  evolv::MarkovChain<Event> chain(0, RANDOM_STATE);
+  chain.FeedSequence(events.begin(), events.end());
+  EXPECT_EQ(chain.Prune(2, 10, Event::kClose), 2);
+  EXPECT_EQ(chain.Decode(0), Event::kClose);
+  EXPECT_EQ(chain.Encode(Event::kOpen), 1);
+  EXPECT_EQ(chain.Encode(Event::kRead), 2);
+  EXPECT_EQ(chain.Encode(Event::kWrite), 0);
+  EXPECT_EQ(chain.Stats().transitions, events.size() - 1);
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// QuantizedChainTest is the suite for serving chain with 8-bit counts
+
+TEST(QuantizedChainTest, SmallCountsAreExact) {
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  chain.AddTransition("a", "b", 3);
+  chain.AddTransition("a", "c", 255);
+  chain.AddTransition("b", "a", 1);
+  evolv::QuantizedChain<std::string> quantized(chain);
+  EXPECT_EQ(quantized.NumStates(), 3);
+  EXPECT_DOUBLE_EQ(quantized.KlDivergence(chain), 0);
+
+  Xoshiro256pp rng(RANDOM_STATE);
+  std::vector<std::string> memory{"b"};
+  EXPECT_EQ(quantized.PredictState<Xoshiro256pp>(memory, rng), "a");
+  std::vector<std::string> unknown{"never seen"};
+  EXPECT_EQ(quantized.PredictState<Xoshiro256pp>(unknown, rng),
+            std::nullopt);
+  std::vector<std::string> dead_end{"c"};
+  EXPECT_EQ(quantized.PredictState<Xoshiro256pp>(dead_end, rng),
+            std::nullopt);
+}
+
+
+TEST(QuantizedChainTest, LargeCountsOnLogScale) {
+  // counts spanning 40 bits, more than kBlock targets in a row
+  evolv::MarkovChain<int> chain(0, RANDOM_STATE);
+  std::vector<int64_t> counts;
+  for (int to = 0; to < 200; ++to) {
+    counts.push_back(to % 7 == 0 ? (int64_t{1} << 40) / (to + 1) : to + 1);
+    chain.AddTransition(-1, to * 3, counts.back());
+  }
+  evolv::QuantizedChain<int> quantized(chain);
+  double divergence = quantized.KlDivergence(chain);
+  EXPECT_GT(divergence, 0);
+  EXPECT_LT(divergence, 1e-3);
+
+  Xoshiro256pp rng(RANDOM_STATE);
+  std::vector<int> memory{-1};
+  std::map<int, int> samples;
+  for (int i = 0; i < 100000; ++i) {
+    std::optional<int> next = quantized.PredictState<Xoshiro256pp>(memory,
+                                                                    rng);
+    ASSERT_TRUE(next);
+    samples[*next]++;
+  }
+  double total = 0;
+  for (int64_t count : counts) {
+    total += static_cast<double>(count);
+  }
+  for (int to : {0, 3, 21, 42}) {
+    EXPECT_NEAR(samples[to * 3] / 100000., counts[to] / total, 0.01) << to;
+  }
+  for (auto [state, count] : samples) {
+    EXPECT_EQ(state % 3, 0);
+  }
+}
+
+
+TEST(QuantizedChainTest, SmallerThanChain) {
+  // long tail of words, the i-th comes every i + 1 rounds
+  std::vector<std::string> words;
+  for (int round = 0; round < 1000; ++round) {
+    for (int i = 0; i < 2000; ++i) {
+      if (round % (i + 1) == 0) {
+        words.push_back("word " + std::to_string(i));
+      }
+    }
+  }
+  for (int memorize_previous : {0, 2}) {
+    evolv::MarkovChain<std::string> chain(memorize_previous, RANDOM_STATE);
+    chain.FeedSequence(words.begin(), words.end());
+    evolv::QuantizedChain<std::string> quantized(chain);
+    EXPECT_EQ(quantized.GetMemorySize(), memorize_previous + 1);
+    EXPECT_LT(quantized.MemoryUsage(), chain.Stats().bytes.counters / 4);
+    EXPECT_LT(quantized.KlDivergence(chain), 1e-3);
+
+    Xoshiro256pp rng(RANDOM_STATE);
+    std::vector<std::string> memory{"word 1", "word 0", "word 1"};
+    for (int i = 0; i < 100; ++i) {
+      std::optional<std::string> next =
+          quantized.PredictState<Xoshiro256pp>(memory, rng);
+      ASSERT_TRUE(next);
+      EXPECT_TRUE(quantized.Find(*next));
+    }
+  }
+}
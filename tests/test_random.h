@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// RandomTest is the suite for generators and bounded sampling
+
+TEST(RandomTest, SameSeedSameSequence) {
+  Xoshiro256pp rng1(RANDOM_STATE), rng2(RANDOM_STATE), rng3(RANDOM_STATE + 1);
+  bool differs = false;
+  for (int i = 0; i < 100; ++i) {
+    uint64_t x1 = rng1(), x2 = rng2(), x3 = rng3();
+    EXPECT_EQ(x1, x2);
+    differs = differs || x1 != x3;
+  }
+  EXPECT_TRUE(differs);
+}
+
+
+TEST(RandomTest, FullSeedIsKept) {
+  Xoshiro256pp rng1(1), rng2(1 + (uint64_t(1) << 32));
+  EXPECT_NE(rng1(), rng2());
+}
+
+
+TEST(RandomTest, UniformBelowInRange) {
+  Xoshiro256pp rng(RANDOM_STATE);
+  for (uint64_t bound : {1ULL, 2ULL, 3ULL, 7ULL, 1000ULL, 1ULL << 63}) {
+    for (int i = 0; i < 1000; ++i) {
+      EXPECT_LT(UniformBelow(rng, bound), bound);
+    }
+  }
+}
+
+
+TEST(RandomTest, UniformBelowIsUniform) {
+  Xoshiro256pp rng(RANDOM_STATE);
+  const int bound = 6, draws = 60000;
+  std::vector<int> count(bound, 0);
+  for (int i = 0; i < draws; ++i) {
+    count[UniformBelow(rng, bound)]++;
+  }
+  for (int c : count) {
+    EXPECT_LT(std::abs(c - draws / bound), 300);
+  }
+}
+
+
+TEST(RandomTest, PluggableGenerator) {
+  std::vector<int> seq{0, 1, 0, 2, 0, 1, 0, 2, 0};
+  ForgorChain<int, std::mt19937_64> chain(RANDOM_STATE);
+  chain.FeedSequenceImpl(seq.begin(), seq.end(), true);
+  int next = chain.PredictState();
+  EXPECT_TRUE(next == 1 or next == 2);
+}
+
+
+TEST(RandomTest, MarkovChainSeededWithTime) {
+  std::vector<int> seq{0, 1, 0, 1};
+  evolv::MarkovChain<int> chain;
+  chain.FeedSequence(seq.begin(), seq.end());
+  EXPECT_EQ(chain.PredictState(), 0);
+}
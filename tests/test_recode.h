@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// RecodeTest is the suite for renumbering states by frequency
+
+TEST(RecodeTest, StateCoderRecode) {
+  StateCoder<std::string, int> coder;
+  for (std::string state : {"a", "b", "c"}) {
+    coder.Encode(state);
+  }
+  std::vector<int> new_codes{2, 0, 1};
+  coder.Recode(new_codes);
+  EXPECT_EQ(coder.Size(), 3);
+  EXPECT_EQ(coder.Decode(0), "b");
+  EXPECT_EQ(coder.Decode(1), "c");
+  EXPECT_EQ(coder.Decode(2), "a");
+  EXPECT_EQ(coder.Encode("a"), 2);
+  EXPECT_EQ(coder.Encode("d"), 3);
+  EXPECT_FALSE(coder.Pruned());
+}
+
+
+TEST(RecodeTest, FrequentStatesFirst) {
+  // rare words are seen first, so they get small codes before recoding
+  std::vector<std::string> words = LongTailWords(100);
+  std::reverse(words.begin(), words.end());
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  chain.FeedSequence(words.begin(), words.end());
+  ChainStats before = chain.Stats();
+  EXPECT_NE(chain.Encode("word 0"), 0);
+
+  chain.Recode();
+  ChainStats after = chain.Stats();
+  EXPECT_EQ(after.states, before.states);
+  EXPECT_EQ(after.transitions, before.transitions);
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(chain.Decode(i), "word " + std::to_string(i));
+  }
+  EXPECT_EQ(chain.Encode("word 0"), 0);
+  EXPECT_EQ(chain.Encode("new word"), 100);
+}
+
+
+TEST(RecodeTest, SameCounts) {
+  std::vector<std::string> words = LongTailWords(50);
+  std::reverse(words.begin(), words.end());
+  for (int memory_size : {1, 3}) {
+    evolv::MarkovChain<std::string> chain(memory_size, RANDOM_STATE);
+    chain.FeedSequence(words.begin(), words.end());
+
+    auto decoded_counts = [&chain, memory_size]() {
+      std::map<std::string, int64_t> counts;
+      for (std::string word : {"word 0", "word 3", "word 49"}) {
+        std::vector<std::string> memory(memory_size + 1, word);
+        chain.UpdateMemory(memory.begin(), memory.end());
+        for (int i = 0; i < 2000; ++i) {
+          counts[word + " -> " + chain.PredictState()]++;
+        }
+      }
+      return counts;
+    };
+    auto before = decoded_counts();
+    chain.Recode(evolv::RecodeOrder::kCoOccurrence);
+    auto after = decoded_counts();
+    // the same distribution is sampled, though in different order, rare
+    // transitions may be sampled only before or after
+    for (const auto &[transition, count] : before) {
+      EXPECT_NEAR(after[transition], count, 150) << transition;
+    }
+    for (const auto &[transition, count] : after) {
+      EXPECT_NEAR(before[transition], count, 150) << transition;
+    }
+  }
+}
+
+
+TEST(RecodeTest, CoOccurrence) {
+  // pairs "a i", "b i" always follow each other, while "a i" are frequent
+  std::vector<std::string> words;
+  for (int round = 0; round < 100; ++round) {
+    for (int i = 0; i < 10; ++i) {
+      words.push_back("a " + std::to_string(i));
+      words.push_back("b " + std::to_string(i));
+      words.push_back("a " + std::to_string(i));
+    }
+  }
+  evolv::MarkovChain<std::string> by_frequency(0, RANDOM_STATE);
+  by_frequency.FeedSequence(words.begin(), words.end());
+  by_frequency.Recode();
+  EXPECT_EQ(by_frequency.Decode(1).substr(0, 1), "a");
+
+  evolv::MarkovChain<std::string> by_co_occurrence(0, RANDOM_STATE);
+  by_co_occurrence.FeedSequence(words.begin(), words.end());
+  by_co_occurrence.Recode(evolv::RecodeOrder::kCoOccurrence);
+  for (int i = 0; i < 10; ++i) {
+    std::string index = std::to_string(i);
+    EXPECT_EQ(by_co_occurrence.Encode("b " + index),
+              by_co_occurrence.Encode("a " + index) + 1);
+  }
+}
+
+
+TEST(RecodeTest, KeepsUnknown) {
+  std::vector<std::string> words = LongTailWords(200);
+  std::reverse(words.begin(), words.end());
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  chain.FeedSequence(words.begin(), words.end());
+  chain.Prune(10, std::numeric_limits<std::size_t>::max(), "<UNK>");
+  chain.Recode(evolv::RecodeOrder::kCoOccurrence);
+  EXPECT_EQ(chain.Decode(0), "<UNK>");
+  EXPECT_EQ(chain.Decode(1), "word 0");
+  EXPECT_EQ(chain.Encode("word 199"), 0);
+}
+
+
+TEST(RecodeTest, TableCoder) {
+  std::vector<Event> events{Event::kOpen,  Event::kRead, Event::kRead,
+                            Event::kRead,  Event::kRead, Event::kClose,
+                            Event::kWrite, Event::kOpen, Event::kRead};
+  evolv::MarkovChain<Event> chain(0, RANDOM_STATE);
+  chain.FeedSequence(events.begin(), events.end());
+  ChainStats before = chain.Stats();
+  chain.Recode();
+  EXPECT_EQ(chain.Stats().transitions, before.transitions);
+  EXPECT_EQ(chain.Decode(0), Event::kRead);
+  EXPECT_EQ(chain.Decode(1), Event::kOpen);
+  EXPECT_EQ(chain.Encode(Event::kRead), 0);
+}
@@ -120,7 +120,7 @@ TEST(RemberChainTest, PredictHillsWithMemory1) {
   EXPECT_EQ(chain.GetMemory(), (std::deque{0, 1}));
 
   int count_1 = 0, count_3 = 0;
-  for (int i = 0; i < 100; ++i) {
+  for (int i = 0; i < 10000; ++i) {
     int pred = chain.PredictState();
     ASSERT_TRUE(pred == 1 or pred == 3);
     switch (pred) {
@@ -132,7 +132,7 @@ TEST(RemberChainTest, PredictHillsWithMemory1) {
     }
   }
   EXPECT_GT(count_1, count_3);
-  EXPECT_GT(count_1 - count_3, 20);
+  EXPECT_NEAR(count_1 / 10000., 0.6, 0.02);
   EXPECT_GT(count_3, 0);
 }
 
@@ -212,7 +212,7 @@ TEST(RemberChainTest, PredictRhytmWithMemory2) {
   EXPECT_EQ(chain.GetMemory(), (std::deque{3, 3, 3}));
 
   std::vector<int> count(7, 0);
-  for (int i = 0; i < 100; ++i) {
+  for (int i = 0; i < 10000; ++i) {
     int pred = chain.PredictState();
     std::set<int> possible_val{0, 1, 2, 3, 4, 5, 6};
     ASSERT_PRED1([&](int pred) { return possible_val.contains(pred); }, pred);
@@ -242,7 +242,7 @@ TEST(RemberChainTest, PredictRhytmWithMemory3) {
   EXPECT_EQ(chain.GetMemory(), (std::deque{3, 3, 3, 2}));
 
   std::vector<int> count(7, 0);
-  for (int i = 0; i < 100; ++i) {
+  for (int i = 0; i < 10000; ++i) {
     int pred = chain.PredictState();
     std::set<int> possible_val{0, 1, 2, 3, 4, 5, 6};
     ASSERT_PRED1([&](int pred) { return possible_val.contains(pred); }, pred);
@@ -255,7 +255,8 @@ TEST(RemberChainTest, PredictRhytmWithMemory3) {
   
   ASSERT_GT(count[5], count[0]);
   ASSERT_GT(count[5], count[1]);
-  ASSERT_GT(count[5], count[2]);
+  // "5" and "2" come equally often
+  ASSERT_NEAR(count[5], count[2], 400);
   ASSERT_GT(count[5], count[6]);
   
   ASSERT_GT(count[0], 0);
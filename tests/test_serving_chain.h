@@ -0,0 +1,211 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// ServingChainTest is the suite for versioned snapshots of chain
+
+TEST(ServingChainTest, PersistentArraySharesPages) {
+  using Array = PersistentArray<int>;
+  Array::Editor editor{Array()};
+  for (int i = 0; i < 1000; ++i) {
+    editor[i] = i;
+  }
+  Array first = editor.Finish();
+  Array::Editor next_editor(first);
+  next_editor[300] = -1;
+  next_editor[1200] = 7;
+  Array second = next_editor.Finish();
+
+  EXPECT_EQ(first.Size(), 1000);
+  EXPECT_EQ(second.Size(), 1201);
+  EXPECT_EQ(first[300], 300);
+  EXPECT_EQ(second[300], -1);
+  EXPECT_EQ(second[1000], 0);
+  EXPECT_TRUE(second.SharesPage(first, 0));
+  EXPECT_FALSE(second.SharesPage(first, 300));
+  EXPECT_TRUE(second.SharesPage(first, 999));
+}
+
+
+TEST(ServingChainTest, PersistentArrayCopiesPaths) {
+  using Array = PersistentArray<int>;
+  Array::Editor editor{Array()};
+  editor[0] = 1;
+  Array first = editor.Finish();
+  // the tree grows above the first page
+  Array::Editor next_editor(first);
+  next_editor[1 << 20] = 2;
+  Array second = next_editor.Finish();
+
+  EXPECT_EQ(first.Size(), 1);
+  EXPECT_EQ(second.Size(), (1 << 20) + 1);
+  EXPECT_EQ(second[0], 1);
+  EXPECT_EQ(second[1 << 19], 0);
+  EXPECT_EQ(second[1 << 20], 2);
+  EXPECT_TRUE(second.SharesPage(first, 0));
+  // pages between aren't allocated
+  EXPECT_LT(second.MemoryUsage(), 4 * Array::kPageSize * sizeof(int) +
+                                      16 * Array::kFanout * sizeof(void *));
+}
+
+
+TEST(ServingChainTest, SnapshotIsImmutable) {
+  evolv::ServingChain<std::string> chain;
+  std::vector<std::string> seq{"a", "b", "a", "c"};
+  chain.FeedSequence(seq.begin(), seq.end());
+  auto empty = chain.GetSnapshot();
+  EXPECT_EQ(chain.Publish(), 1);
+  auto first = chain.GetSnapshot();
+  seq = {"c", "d", "a", "b"};
+  chain.FeedSequence(seq.begin(), seq.end());
+  EXPECT_EQ(chain.Publish(), 2);
+  auto second = chain.GetSnapshot();
+
+  EXPECT_EQ(empty->NumStates(), 0);
+  EXPECT_EQ(first->NumStates(), 3);
+  EXPECT_EQ(second->NumStates(), 4);
+  EXPECT_EQ(first->Find("d"), std::nullopt);
+  EXPECT_EQ(second->Find("d"), 3);
+  EXPECT_EQ(second->Decode(3), "d");
+  EXPECT_EQ(first->FindCounter(0, 0)->TotalSum(), 2);
+  EXPECT_EQ(second->FindCounter(0, 0)->TotalSum(), 3);
+  EXPECT_EQ(first->FindCounter(2, 0), nullptr);
+  EXPECT_EQ(second->FindCounter(2, 0)->TotalSum(), 1);
+}
+
+
+TEST(ServingChainTest, SameAsMarkovChain) {
+  std::vector<std::string> sentenses{"The", "day",   "follows", "night", ".",
+                                     "The", "night", "follows", "day",   "."};
+  for (int memorize : {0, 2}) {
+    evolv::MarkovChain<std::string> chain(memorize, RANDOM_STATE);
+    evolv::ServingChain<std::string> serving(memorize);
+    chain.FeedSequence(sentenses.begin(), sentenses.end());
+    serving.FeedSequence(sentenses.begin(), sentenses.end());
+    serving.Publish();
+
+    auto snapshot = serving.GetSnapshot();
+    std::deque<std::string> memory = chain.GetMemory();
+    Xoshiro256pp rng(RANDOM_STATE);
+    for (int i = 0; i < 100; ++i) {
+      std::vector<std::string> states(memory.begin(), memory.end());
+      std::optional<std::string> state =
+          snapshot->PredictState<Xoshiro256pp>(states, rng);
+      ASSERT_TRUE(state);
+      EXPECT_EQ(*state, chain.PredictState(true));
+      if (static_cast<int>(memory.size()) > memorize) {
+        memory.pop_back();
+      }
+      memory.push_front(*state);
+    }
+  }
+}
+
+
+TEST(ServingChainTest, PublishCopiesChangedPages) {
+  evolv::ServingChain<int> chain;
+  std::vector<int> seq;
+  for (int i = 0; i < 5000; ++i) {
+    seq.push_back(i);
+  }
+  chain.FeedSequence(seq.begin(), seq.end());
+  chain.Publish();
+  auto before = chain.GetSnapshot();
+  seq = {10, 20};
+  chain.FeedSequence(seq.begin(), seq.end());
+  chain.Publish();
+  auto after = chain.GetSnapshot();
+  EXPECT_EQ(after->FindCounter(10, 0)->TotalSum(), 2);
+  EXPECT_EQ(before->FindCounter(10, 0)->TotalSum(), 1);
+  // unchanged rows are shared, even on the copied page
+  EXPECT_EQ(after->FindCounter(4000, 0), before->FindCounter(4000, 0));
+  EXPECT_EQ(after->FindCounter(11, 0), before->FindCounter(11, 0));
+  EXPECT_NE(after->FindCounter(10, 0), before->FindCounter(10, 0));
+}
+
+
+TEST(ServingChainTest, ReadersDontBlockWriter) {
+  evolv::ServingChain<int> chain(1);
+  std::atomic<bool> done = false;
+  std::vector<std::thread> readers;
+  std::atomic<int64_t> predictions = 0;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&, t] {
+      Xoshiro256pp rng(t);
+      uint64_t version = 0;
+      while (!done.load()) {
+        auto snapshot = chain.GetSnapshot();
+        EXPECT_GE(snapshot->Version(), version);
+        version = snapshot->Version();
+        std::vector<int> memory{1, 0};
+        if (snapshot->PredictState<Xoshiro256pp>(memory, rng)) {
+          predictions++;
+        }
+      }
+    });
+  }
+  for (int round = 0; round < 200; ++round) {
+    std::vector<int> seq;
+    for (int i = 0; i < 100; ++i) {
+      seq.push_back((round * 31 + i * 7) % 50);
+    }
+    chain.FeedSequence(seq.begin(), seq.end());
+    chain.Publish();
+  }
+  done = true;
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+  auto snapshot = chain.GetSnapshot();
+  EXPECT_EQ(snapshot->Version(), 200);
+  int64_t transitions = 0;
+  for (int from = 0; from < 50; ++from) {
+    if (auto counter = snapshot->FindCounter(from, 0)) {
+      transitions += counter->TotalSum();
+    }
+  }
+  EXPECT_EQ(transitions, 200 * 99);
+}
+
+
+TEST(ServingChainTest, SnapshotIndexesManyStates) {
+  evolv::ServingChain<std::string> chain;
+  std::vector<std::string> seq;
+  std::vector<std::shared_ptr<const ChainSnapshot<std::string, int>>>
+      versions;
+  for (int publish = 0; publish < 10; ++publish) {
+    seq.clear();
+    for (int i = 0; i < 1000; ++i) {
+      seq.push_back("state " + std::to_string(publish * 1000 + i));
+    }
+    chain.FeedSequence(seq.begin(), seq.end());
+    chain.Publish();
+    versions.push_back(chain.GetSnapshot());
+  }
+  for (int publish = 0; publish < 10; ++publish) {
+    const auto &version = *versions[publish];
+    EXPECT_EQ(version.NumStates(), (publish + 1) * 1000);
+    for (int state = 0; state < 10000; state += 7) {
+      std::optional<int> code = version.Find("state " + std::to_string(state));
+      if (state < (publish + 1) * 1000) {
+        ASSERT_TRUE(code);
+        EXPECT_EQ(version.Decode(*code), "state " + std::to_string(state));
+      } else {
+        EXPECT_EQ(code, std::nullopt);
+      }
+    }
+  }
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// Transition counts of chain by states, comparable between chains coded
+// differently
+template <class ChainT>
+std::map<std::tuple<std::string, int, std::string>, int64_t> CountsByStates(
+    const ChainT &chain) {
+  auto block = chain.Export();
+  std::map<std::tuple<std::string, int, std::string>, int64_t> counts;
+  for (const auto &count : block.transitions) {
+    counts[{block.states[count.from], count.depth, block.states[count.to]}] +=
+        count.delta;
+  }
+  return counts;
+}
+
+
+// SharedVocabularyTest is the suite for chains sharing one vocabulary
+
+TEST(SharedVocabularyTest, ChainsShareCodes) {
+  using Registry = evolv::ChainRegistry<std::string>;
+  auto vocabulary = std::make_shared<Registry::Vocabulary>();
+  Registry::Chain first(0, RANDOM_STATE, vocabulary);
+  Registry::Chain second(1, RANDOM_STATE, vocabulary);
+  std::vector<std::string> seq{"a", "b", "a", "b"};
+  first.FeedSequence(seq.begin(), seq.end());
+  seq = {"c", "a", "c"};
+  second.FeedSequence(seq.begin(), seq.end());
+
+  EXPECT_EQ(vocabulary->Size(), 3);
+  EXPECT_EQ(first.Encode("c"), second.Encode("c"));
+  EXPECT_EQ(first.Decode(second.Encode("a")), "a");
+  // counters aren't shared
+  first.UpdateMemory("a");
+  EXPECT_EQ(first.PredictState(), "b");
+  second.UpdateMemory("a");
+  EXPECT_EQ(second.PredictState(), "c");
+  EXPECT_EQ(first.MemoryUsage().coder, 0);
+}
+
+
+TEST(SharedVocabularyTest, RegistryCreatesChainsOnce) {
+  evolv::ChainRegistry<std::string> registry(1, RANDOM_STATE);
+  EXPECT_EQ(registry.Find("tenant"), nullptr);
+  auto chain = registry.Get("tenant");
+  EXPECT_EQ(registry.Get("tenant"), chain);
+  EXPECT_EQ(registry.Find("tenant"), chain);
+  EXPECT_EQ(chain->GetMemorySize(), 2);
+  EXPECT_EQ(registry.Size(), 1);
+
+  std::vector<std::string> seq{"x", "y"};
+  chain->FeedSequence(seq.begin(), seq.end());
+  EXPECT_TRUE(registry.Erase("tenant"));
+  EXPECT_FALSE(registry.Erase("tenant"));
+  EXPECT_EQ(registry.Size(), 0);
+  // the erased chain lives while it's held, states stay in vocabulary
+  EXPECT_EQ(chain->Decode(chain->Encode("y")), "y");
+  EXPECT_EQ(registry.GetVocabulary()->Size(), 2);
+}
+
+
+TEST(SharedVocabularyTest, TenantsFedConcurrently) {
+  constexpr int kTenants = 16;
+  evolv::ChainRegistry<std::string, int, int> registry(1, RANDOM_STATE);
+  std::vector<std::vector<std::string>> sequences(400);
+  for (std::size_t i = 0; i < sequences.size(); ++i) {
+    Xoshiro256pp rng(RANDOM_STATE + i);
+    for (int j = 0; j < 100; ++j) {
+      sequences[i].push_back("event " +
+                             std::to_string(UniformBelow(rng, 1000)));
+    }
+  }
+
+  // each thread feeds its own tenants, all of them code new states
+  FeedOnThreads(8, kTenants, [&](std::size_t tenant) {
+    auto chain = registry.Get(static_cast<int>(tenant));
+    for (std::size_t i = tenant; i < sequences.size(); i += kTenants) {
+      chain->FeedSequence(sequences[i].begin(), sequences[i].end());
+    }
+  });
+
+  EXPECT_EQ(registry.Size(), kTenants);
+  for (int tenant = 0; tenant < kTenants; ++tenant) {
+    evolv::MarkovChain<std::string> expected(1, RANDOM_STATE);
+    for (std::size_t i = tenant; i < sequences.size(); i += kTenants) {
+      expected.FeedSequence(sequences[i].begin(), sequences[i].end());
+    }
+    auto counts = CountsByStates(*registry.Get(tenant));
+    EXPECT_EQ(counts, CountsByStates(expected));
+  }
+}
+
+
+TEST(SharedVocabularyTest, TenantsTakeOnlyCounters) {
+  constexpr int kTenants = 20;
+  evolv::ChainRegistry<std::string, int, int> registry(0, RANDOM_STATE);
+  std::size_t own_coders = 0, own_total = 0;
+  for (int tenant = 0; tenant < kTenants; ++tenant) {
+    // tenants see the same events in their own order
+    Xoshiro256pp rng(RANDOM_STATE + tenant);
+    std::vector<std::string> events;
+    for (int i = 0; i < 2000; ++i) {
+      events.push_back("checkout.payment.provider.event." +
+                       std::to_string(UniformBelow(rng, 100)));
+    }
+    evolv::MarkovChain<std::string> own(0, RANDOM_STATE);
+    own.FeedSequence(events.begin(), events.end());
+    own_coders += own.MemoryUsage().coder;
+    own_total += own.MemoryUsage().Total();
+    registry.Get(tenant)->FeedSequence(events.begin(), events.end());
+  }
+
+  MemoryReport report = registry.MemoryUsage();
+  EXPECT_EQ(report.coder, registry.GetVocabulary()->MemoryUsage());
+  EXPECT_EQ(registry.Get(0)->MemoryUsage().coder, 0);
+  // vocabulary is stored once instead of in each chain
+  EXPECT_LT(report.coder * (kTenants / 2), own_coders);
+  EXPECT_LT(report.Total(), own_total);
+}
+
+
+TEST(SharedVocabularyTest, ReplayTenantSnapshots) {
+  evolv::ChainRegistry<std::string, int, int> registry(1, RANDOM_STATE);
+  std::vector<std::stringstream> snapshots(3);
+  for (int tenant = 0; tenant < 3; ++tenant) {
+    std::vector<std::string> words = Words(tenant * 5, 30);
+    registry.Get(tenant)->FeedSequence(words.begin(), words.end());
+  }
+  for (int tenant = 0; tenant < 3; ++tenant) {
+    registry.Get(tenant)->Compact(snapshots[tenant]);
+  }
+
+  // each snapshot holds the whole vocabulary, that the first one codes
+  evolv::ChainRegistry<std::string, int, int> restored(1, RANDOM_STATE);
+  for (int tenant = 0; tenant < 3; ++tenant) {
+    EXPECT_EQ(restored.Get(tenant)->Replay(snapshots[tenant]), 1);
+    EXPECT_EQ(CountsByStates(*restored.Get(tenant)),
+              CountsByStates(*registry.Get(tenant)));
+  }
+  EXPECT_EQ(restored.GetVocabulary()->Size(),
+            registry.GetVocabulary()->Size());
+
+  // vocabulary coding the states differently isn't replayed into
+  evolv::ChainRegistry<std::string, int, int> other(1, RANDOM_STATE);
+  other.GetVocabulary()->Encode("word 22");
+  snapshots[0].clear();
+  snapshots[0].seekg(0);
+  EXPECT_EQ(other.Get(0)->Replay(snapshots[0]), 0);
+  EXPECT_EQ(snapshots[0].tellg(), 0);
+  EXPECT_EQ(other.Get(0)->Stats().transitions, 0);
+}
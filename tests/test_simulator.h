@@ -0,0 +1,137 @@
+#pragma once
+
+#include <span>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// SimulatorTest is the suite for Monte Carlo simulation of walkers
+
+TEST(SimulatorTest, ForgorCycle) {
+  std::vector<int> seq{0, 1, 2, 0, 1, 2, 0};
+  ForgorChain<int> chain(RANDOM_STATE);
+  chain.FeedSequenceImpl(seq.begin(), seq.end());
+
+  const int walkers = 3000;
+  std::vector<int> starts(walkers, 0), targets{2};
+  SimulationCounts counts(3, targets.size());
+  chain.Simulate(starts, 5, targets, 3, counts, 4);
+  EXPECT_EQ(counts.visits, (std::vector<int64_t>{2 * walkers, 2 * walkers,
+                                                 2 * walkers}));
+  EXPECT_EQ(counts.end_states, (std::vector<int64_t>{0, 0, walkers}));
+  EXPECT_EQ(counts.hits[0], walkers);
+  EXPECT_EQ(counts.hit_steps[0], 2 * walkers);
+}
+
+
+TEST(SimulatorTest, WalkerWithoutTransitionsStays) {
+  std::vector<int> seq{0, 1};
+  ForgorChain<int> chain(RANDOM_STATE);
+  chain.FeedSequenceImpl(seq.begin(), seq.end());
+
+  std::vector<int> starts(10, 0), targets;
+  SimulationCounts counts(2, 0);
+  chain.Simulate(starts, 3, targets, 2, counts, 1);
+  EXPECT_EQ(counts.visits, (std::vector<int64_t>{10, 30}));
+  EXPECT_EQ(counts.end_states, (std::vector<int64_t>{0, 10}));
+}
+
+
+TEST(SimulatorTest, RemberCycle) {
+  std::vector<int> seq{0, 1, 2, 0, 1, 2, 0, 1, 2};
+  RemberChain<int> chain(1, RANDOM_STATE);
+  chain.FeedSequenceImpl(seq.begin(), seq.end());
+
+  const int walkers = 5000;
+  std::vector<int> starts(walkers, 0), targets{2};
+  SimulationCounts counts(3, targets.size());
+  chain.Simulate(starts, 4, targets, 3, counts, 0);
+  EXPECT_EQ(counts.visits,
+            (std::vector<int64_t>{2 * walkers, 2 * walkers, walkers}));
+  EXPECT_EQ(counts.end_states, (std::vector<int64_t>{0, walkers, 0}));
+  EXPECT_EQ(counts.hits[0], walkers);
+  EXPECT_EQ(counts.hit_steps[0], 2 * walkers);
+}
+
+
+TEST(SimulatorTest, SameResultOnAnyThreads) {
+  std::vector<int> seq{0, 1, 0, 2, 1, 1, 2, 0, 2, 2, 1, 0};
+  std::vector<int> starts(10000, 0), targets{2};
+  std::vector<SimulationCounts> counts;
+  for (int threads : {1, 3, 8}) {
+    RemberChain<int> chain(2, RANDOM_STATE);
+    chain.FeedSequenceImpl(seq.begin(), seq.end());
+    counts.emplace_back(3, targets.size());
+    chain.Simulate(starts, 20, targets, 3, counts.back(), threads);
+  }
+  for (const auto &other : counts) {
+    EXPECT_EQ(other.visits, counts[0].visits);
+    EXPECT_EQ(other.end_states, counts[0].end_states);
+    EXPECT_EQ(other.hit_steps, counts[0].hit_steps);
+  }
+}
+
+
+TEST(SimulatorTest, MarkovChainSimulate) {
+  std::vector<std::string> sentenses{"The", "day",   "follows", "night", ".",
+                                     "The", "night", "follows", "day",   "."};
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  chain.FeedSequence(sentenses.begin(), sentenses.end());
+
+  const int walkers = 2000;
+  std::vector<std::string> starts(walkers, "The");
+  evolv::SimulationStats<std::string> stats;
+  stats.targets = {".", "follows"};
+  chain.Simulate(starts.begin(), starts.end(), 6, stats);
+  chain.Simulate(starts.begin(), starts.end(), 6, stats);
+
+  EXPECT_EQ(stats.visits["The"] >= 2 * walkers, true);
+  int64_t ended = 0;
+  for (const auto &[state, count] : stats.end_states) {
+    ended += count;
+  }
+  EXPECT_EQ(ended, 2 * walkers);
+  EXPECT_GT(stats.hits[0], walkers);
+  EXPECT_GE(stats.MeanHitStep(0), 2.0);
+  EXPECT_GE(stats.MeanHitStep(1), 2.0);
+  EXPECT_EQ(chain.GetMemory(), std::deque<std::string>{"."});
+}
+
+
+TEST(SimulatorTest, MarkovChainSkipsUnknownStates) {
+  std::vector<std::string> seq{"a", "b", "a", "c"};
+  evolv::MarkovChain<std::string> chain(1, RANDOM_STATE);
+  chain.FeedSequence(seq.begin(), seq.end());
+
+  std::vector<std::string> starts{"a", "unseen", "b"};
+  evolv::SimulationStats<std::string> stats;
+  stats.targets = {"missing", "c"};
+  EXPECT_EQ(chain.Simulate(starts.begin(), starts.end(), 3, stats, 1), 2);
+  // unknown states aren't coded
+  EXPECT_EQ(chain.Stats().states, 3);
+  EXPECT_FALSE(stats.visits.contains("unseen"));
+  ASSERT_EQ(stats.hits.size(), 2);
+  EXPECT_EQ(stats.hits[0], 0);
+  EXPECT_GT(stats.visits["a"], 0);
+}
+
+
+TEST(SimulatorTest, RepeatedTargetsGetSameHits) {
+  std::vector<std::string> seq{"a", "b", "c", "a", "c", "b", "a"};
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  chain.FeedSequence(seq.begin(), seq.end());
+
+  std::vector<std::string> starts(500, "a");
+  evolv::SimulationStats<std::string> stats;
+  stats.targets = {"c", "b", "c"};
+  chain.Simulate(starts.begin(), starts.end(), 5, stats, 1);
+  EXPECT_GT(stats.hits[0], 0);
+  EXPECT_EQ(stats.hits[2], stats.hits[0]);
+  EXPECT_EQ(stats.hit_steps[2], stats.hit_steps[0]);
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// TieredChainTest is the suite for compressed rows with cache of hot ones
+
+TEST(TieredChainTest, CompressedRow) {
+  FenwickTree<int64_t, int> counter;
+  counter.Add(0, 5);
+  counter.Add(3, 1);
+  counter.Add(200, 300);
+  counter.Add(100000, 1ll << 40);
+  CompressedRow<int> row(counter);
+  EXPECT_EQ(row.Size(), 100001);
+  EXPECT_EQ(row.Targets(), 4);
+  EXPECT_EQ(row.TotalSum(), counter.TotalSum());
+  EXPECT_LT(row.MemoryUsage(), 100);
+
+  FenwickTree<int64_t, int> decompressed = row.Decompress();
+  EXPECT_EQ(decompressed.Size(), row.Size());
+  EXPECT_EQ(decompressed.TotalSum(), counter.TotalSum());
+  for (int to : {0, 2, 3, 199, 200, 99999, 100000}) {
+    EXPECT_EQ(decompressed.Sum(to), counter.Sum(to));
+  }
+}
+
+
+TEST(TieredChainTest, LruCacheEvictsByBytes) {
+  using Row = FenwickTree<int64_t, int>;
+  std::size_t row_bytes = Row(100).MemoryUsage();
+  // three rows fit along with bookkeeping, but not four
+  LruCache<int, Row> cache(3 * row_bytes + 1000);
+  int loads = 0;
+  auto load = [&loads] {
+    loads++;
+    return Row(100);
+  };
+  auto first = cache.Get(1, load);
+  cache.Get(2, load);
+  cache.Get(1, load);
+  cache.Get(3, load);
+  // 2 is the least recently used one
+  cache.Get(4, load);
+  EXPECT_EQ(loads, 4);
+  cache.Get(1, load);
+  EXPECT_EQ(loads, 4);
+  cache.Get(2, load);
+  EXPECT_EQ(loads, 5);
+
+  CacheStats stats = cache.Stats();
+  EXPECT_EQ(stats.hits, 2);
+  EXPECT_EQ(stats.misses, 5);
+  EXPECT_EQ(stats.evictions, 2);
+  EXPECT_LE(stats.bytes, stats.capacity);
+  EXPECT_DOUBLE_EQ(stats.HitRate(), 2.0 / 7);
+  EXPECT_EQ(first->Size(), 100);
+}
+
+
+TEST(TieredChainTest, LruCacheLoadsKeyOnce) {
+  using Row = FenwickTree<int64_t, int>;
+  std::size_t row_bytes = Row(100).MemoryUsage();
+  LruCache<int, Row> cache(64 * row_bytes, 4);
+  std::atomic<int> loads = 0;
+  auto load = [&loads] {
+    loads++;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return Row(100);
+  };
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&cache, &load, i] {
+      for (int key = 0; key < 8; ++key) {
+        EXPECT_EQ(cache.Get((key + i) % 8, load)->Size(), 100);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  // threads missing the key being loaded wait for it
+  EXPECT_EQ(loads, 8);
+  CacheStats stats = cache.Stats();
+  EXPECT_EQ(stats.hits + stats.misses, 64);
+  EXPECT_EQ(stats.misses, 8);
+  EXPECT_LE(stats.bytes, stats.capacity);
+}
+
+
+TEST(TieredChainTest, PredictsLikeSnapshot) {
+  std::vector<std::string> words = LongTailWords(300);
+  for (int memorize_previous : {0, 2}) {
+    evolv::MarkovChain<std::string> chain(memorize_previous, RANDOM_STATE);
+    chain.FeedSequence(words.begin(), words.end());
+    evolv::ServingChain<std::string> serving(memorize_previous);
+    serving.FeedSequence(words.begin(), words.end());
+    serving.Publish();
+    auto snapshot = serving.GetSnapshot();
+    // cache of a few rows, so rows are evicted and decompressed again
+    evolv::TieredChain<std::string> tiered(chain, 4096);
+    EXPECT_EQ(tiered.NumStates(), 300);
+    EXPECT_EQ(tiered.GetMemorySize(), memorize_previous + 1);
+
+    Xoshiro256pp snapshot_rng(RANDOM_STATE), tiered_rng(RANDOM_STATE);
+    std::vector<std::string> memory{"word 0", "word 7", "word 1"};
+    for (int i = 0; i < 1000; ++i) {
+      memory[i % 3] = "word " + std::to_string(i % 50 * i % 300);
+      std::optional<std::string> expected =
+          snapshot->PredictState<Xoshiro256pp>(memory, snapshot_rng);
+      ASSERT_EQ(tiered.PredictState<Xoshiro256pp>(memory, tiered_rng),
+                expected);
+    }
+    std::vector<std::string> unknown{"never seen"};
+    EXPECT_EQ(tiered.PredictState<Xoshiro256pp>(unknown, tiered_rng),
+              std::nullopt);
+  }
+}
+
+
+TEST(TieredChainTest, HotRowsStayCached) {
+  std::vector<std::string> words = LongTailWords(2000);
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  chain.FeedSequence(words.begin(), words.end());
+  evolv::TieredChain<std::string> tiered(chain, 64 * 1024);
+  EXPECT_LT(tiered.MemoryUsage(), chain.MemoryUsage().Total() / 3);
+
+  // most queries come from a few frequent states
+  Xoshiro256pp rng(RANDOM_STATE);
+  for (int i = 0; i < 10000; ++i) {
+    std::vector<std::string> memory{
+        "word " + std::to_string(i % 10 == 0 ? i % 2000 : i % 8)};
+    tiered.PredictState<Xoshiro256pp>(memory, rng);
+  }
+  CacheStats stats = tiered.GetCacheStats();
+  EXPECT_EQ(stats.hits + stats.misses, 10000);
+  EXPECT_GT(stats.HitRate(), 0.85);
+  EXPECT_LE(stats.bytes, stats.capacity);
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "instantiate.h"
+
+
+using namespace evolv::internal;
+
+
+// WeightedTest is the suite for weighted transitions and count import
+
+// Transition counts of chain ordered by transition
+template <class ChainT>
+auto SortedCounts(const ChainT &chain) {
+  auto block = chain.Export();
+  MergeDeltas(block.transitions);
+  return block;
+}
+
+
+TEST(WeightedTest, AddTransition) {
+  evolv::MarkovChain<std::string> added(1, RANDOM_STATE);
+  added.AddTransition("a", "b", 3);
+  added.AddTransition("b", "c", 2);
+  added.AddTransition("a", "c", 2, 1);
+  evolv::MarkovChain<std::string> fed(1, RANDOM_STATE);
+  std::vector<std::string> seq{"a", "b", "c"};
+  fed.FeedSequence(seq.begin(), seq.end());
+  fed.FeedSequence(seq.begin(), seq.end());
+  seq = {"a", "b"};
+  fed.FeedSequence(seq.begin(), seq.end());
+
+  EXPECT_EQ(SortedCounts(added).states, SortedCounts(fed).states);
+  EXPECT_EQ(SortedCounts(added).transitions, SortedCounts(fed).transitions);
+  EXPECT_EQ(added.Stats().transitions, 7);
+}
+
+
+TEST(WeightedTest, FeedSequenceWeighted) {
+  std::vector<std::string> seq{"a", "b", "a", "c", "a", "b"};
+  for (int memorize_previous : {0, 2}) {
+    evolv::MarkovChain<std::string> weighted(memorize_previous, RANDOM_STATE);
+    weighted.FeedSequenceWeighted(seq.begin(), seq.end(), 1000);
+    evolv::MarkovChain<std::string> repeated(memorize_previous, RANDOM_STATE);
+    for (int i = 0; i < 1000; ++i) {
+      repeated.FeedSequence(seq.begin(), seq.end());
+    }
+    EXPECT_EQ(SortedCounts(weighted).transitions,
+              SortedCounts(repeated).transitions);
+    EXPECT_EQ(weighted.GetMemory(), repeated.GetMemory());
+  }
+
+  // codes are fed directly with IdentityCoder
+  std::vector<int> codes{0, 1, 0, 2};
+  evolv::MarkovChain<int> chain(0, RANDOM_STATE);
+  chain.FeedSequenceWeighted(codes.begin(), codes.end(), 7);
+  EXPECT_EQ(chain.Stats().transitions, 21);
+}
+
+
+TEST(WeightedTest, ImportCountsTsv) {
+  std::stringstream tsv;
+  tsv << "# from\tto\tcount\tdepth\n"
+      << "a\tb\t48213\n"
+      << "\n"
+      << "b\ta\t5\r\n"
+      << "a\ta\t7\t1\n"
+      << "a\tb\tmany\n"
+      << "b\tb\t1\n";
+  evolv::MarkovChain<std::string> chain(1, RANDOM_STATE);
+  EXPECT_EQ(chain.ImportCountsTsv(tsv), 3);
+  EXPECT_EQ(chain.Stats().transitions, 48213 + 5 + 7);
+  EXPECT_EQ(chain.Stats().states, 2);
+
+  // the stream is left at the malformed line
+  std::string line;
+  std::getline(tsv, line);
+  EXPECT_EQ(line, "a\tb\tmany");
+
+  std::stringstream ints("1\t2\t10\n2\t1\t-3\n");
+  evolv::MarkovChain<int64_t> int_chain(0, RANDOM_STATE);
+  EXPECT_EQ(int_chain.ImportCountsTsv(ints), 1);
+  EXPECT_EQ(int_chain.Stats().transitions, 10);
+}
+
+
+TEST(WeightedTest, ImportRejectsInvalidRecords) {
+  // depth beyond the memory and non-positive counts are malformed
+  for (std::string bad : {"a\tc\t3\t7", "a\tc\t3\t-1", "a\tc\t0"}) {
+    std::stringstream tsv("a\tb\t2\n" + bad + "\nb\ta\t1\n");
+    evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+    EXPECT_EQ(chain.ImportCountsTsv(tsv), 1);
+    EXPECT_EQ(chain.Stats().transitions, 2);
+    std::string line;
+    std::getline(tsv, line);
+    EXPECT_EQ(line, bad);
+  }
+
+  using Format = CountFormat<std::string>;
+  std::stringstream binary;
+  Format::WriteBinary(binary, {"a", "b", 2, 0});
+  std::streamoff good_bytes = binary.tellp();
+  Format::WriteBinary(binary, {"a", "c", 3, 7});
+  Format::WriteBinary(binary, {"b", "a", 1, 0});
+  evolv::MarkovChain<std::string> chain(0, RANDOM_STATE);
+  EXPECT_EQ(chain.ImportCountsBinary(binary), 1);
+  EXPECT_EQ(binary.tellg(), good_bytes);
+  EXPECT_EQ(chain.Stats().transitions, 2);
+
+  EXPECT_FALSE(chain.AddTransition("a", "c", 3, 1));
+  EXPECT_FALSE(chain.AddTransition("a", "c", 3, -1));
+  EXPECT_FALSE(chain.AddTransition("a", "c", -3));
+  EXPECT_TRUE(chain.AddTransition("a", "c", 3));
+  EXPECT_EQ(chain.Stats().transitions, 5);
+  std::vector<std::string> seq{"a", "b", "c"};
+  EXPECT_FALSE(chain.FeedSequenceWeighted(seq.begin(), seq.end(), 0, true));
+  EXPECT_FALSE(chain.FeedSequenceWeighted(seq.begin(), seq.end(), -2));
+  EXPECT_EQ(chain.Stats().transitions, 5);
+  EXPECT_TRUE(chain.GetMemory().empty());
+  std::vector<int> codes{0, 1, 0};
+  evolv::MarkovChain<int, int, Xoshiro256pp, NoMetrics,
+                     IdentityCoder<int, int>>
+      int_chain(0, RANDOM_STATE);
+  EXPECT_FALSE(int_chain.FeedCodes(codes, true, -1));
+  EXPECT_FALSE(int_chain.FeedSequenceWeighted(codes.begin(), codes.end(), 0));
+  EXPECT_EQ(int_chain.Stats().transitions, 0);
+  EXPECT_TRUE(int_chain.FeedCodes(codes, true, 2));
+  EXPECT_EQ(int_chain.Stats().transitions, 4);
+}
+
+
+TEST(WeightedTest, ImportCountsBinary) {
+  using Format = CountFormat<std::string>;
+  std::stringstream binary;
+  std::vector<StateCount<std::string>> records;
+  for (int i = 0; i < 100000; ++i) {
+    records.push_back({"state " + std::to_string(i % 100),
+                       "state " + std::to_string(i % 37), i % 5 + 1, i % 2});
+    Format::WriteBinary(binary, records.back());
+  }
+  std::string cut = binary.str();
+  binary.str(cut + cut.substr(0, 10));
+
+  evolv::MarkovChain<std::string> imported(1, RANDOM_STATE);
+  EXPECT_EQ(imported.ImportCountsBinary(binary), records.size());
+  EXPECT_EQ(binary.tellg(), cut.size());
+
+  evolv::MarkovChain<std::string> added(1, RANDOM_STATE);
+  for (const auto &record : records) {
+    added.AddTransition(record.from, record.to, record.count, record.depth);
+  }
+  EXPECT_EQ(SortedCounts(imported).states, SortedCounts(added).states);
+  EXPECT_EQ(SortedCounts(imported).transitions,
+            SortedCounts(added).transitions);
+}
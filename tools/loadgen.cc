@@ -0,0 +1,511 @@
+// Load generator replaying a workload of concurrent FeedSequence,
+// PredictState and UpdateMemory calls and reporting sustained throughput
+// and latency percentiles of each call.
+//
+// Workload is either read from the trace or synthesized: states drawn
+// from Zipf distribution over the vocabulary, operations mixed by ratio.
+// Trace has one operation per line, its kind and states separated by
+// spaces:
+//
+//   feed s1 s2 s3 ...    learn from sequence
+//   predict s1 s2 ...    push states into memory and predict the next one
+//   update s1 ...        push states into memory
+//
+// Operations before the line "measure" warm the chain up and aren't
+// measured. If the trace has no such line, warmup is synthesized.
+//
+// Each thread keeps its own memory of the last --memory + 1 states, that
+// updates and predictions push into and predictions are made from. In
+// mutex mode threads share MarkovChain guarded by mutex, predicting after
+// setting memory of the chain to the memory of the thread. In serving
+// mode they share ServingChain: feeds are published every --publish-every
+// feeds, and predictions are done from snapshots without locking.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "src/evolv.h"
+
+
+namespace {
+
+using State = std::string;
+using evolv::internal::LatencyHistogram;
+using evolv::internal::Xoshiro256pp;
+
+constexpr const char *kUsage = R"(Usage: evolv_loadgen [--option=value ...]
+
+  --trace=PATH          replay workload from trace instead of synthesizing
+  --write-trace=PATH    write warmup and workload into trace and exit
+  --mode=mutex|serving  shared MarkovChain under mutex or ServingChain
+  --threads=N           number of threads, all cores by default
+  --ops=N               operations to synthesize, 1000000 by default
+  --read-ratio=F        fraction of predictions, 0.9 by default
+  --update-ratio=F      fraction of memory updates, 0.05 by default,
+                        the rest are feeds
+  --vocabulary=N        number of distinct states, 10000 by default
+  --zipf=F              exponent of state distribution, 1.0 by default
+  --memory=N            number of previous states remembered, 1 by default
+  --seq-len=N           states in fed sequence, 32 by default
+  --warmup=N            sequences fed before measurement, 10000 by default
+  --publish-every=N     feeds between publishes in serving mode, 100
+  --seed=N              seed of workload and chain, 1 by default
+)";
+
+struct Options {
+  std::string trace;
+  std::string write_trace;
+  std::string mode = "mutex";
+  int threads = 0;
+  int64_t ops = 1000000;
+  double read_ratio = 0.9;
+  double update_ratio = 0.05;
+  int vocabulary = 10000;
+  double zipf = 1.0;
+  int memory = 1;
+  int seq_len = 32;
+  int warmup = 10000;
+  int publish_every = 100;
+  uint64_t seed = 1;
+};
+
+enum OpKind { kFeed, kPredict, kUpdate, kNumKinds };
+
+constexpr const char *kKindNames[kNumKinds] = {"feed", "predict", "update"};
+
+struct Op {
+  OpKind kind;
+  std::vector<State> states;
+};
+
+
+//! Parse --name=value arguments, false on unknown or malformed one
+bool ParseOptions(int argc, char *argv[], Options &options) try {
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    std::size_t eq = arg.find('=');
+    if (!arg.starts_with("--") || eq == std::string_view::npos) {
+      return false;
+    }
+    std::string_view name = arg.substr(2, eq - 2);
+    std::string value(arg.substr(eq + 1));
+    if (name == "trace") {
+      options.trace = value;
+    } else if (name == "write-trace") {
+      options.write_trace = value;
+    } else if (name == "mode" && (value == "mutex" || value == "serving")) {
+      options.mode = value;
+    } else if (name == "threads") {
+      options.threads = std::stoi(value);
+    } else if (name == "ops") {
+      options.ops = std::stoll(value);
+    } else if (name == "read-ratio") {
+      options.read_ratio = std::stod(value);
+    } else if (name == "update-ratio") {
+      options.update_ratio = std::stod(value);
+    } else if (name == "vocabulary") {
+      options.vocabulary = std::max(1, std::stoi(value));
+    } else if (name == "zipf") {
+      options.zipf = std::stod(value);
+    } else if (name == "memory") {
+      options.memory = std::max(0, std::stoi(value));
+    } else if (name == "seq-len") {
+      options.seq_len = std::max(2, std::stoi(value));
+    } else if (name == "warmup") {
+      options.warmup = std::max(0, std::stoi(value));
+    } else if (name == "publish-every") {
+      options.publish_every = std::max(1, std::stoi(value));
+    } else if (name == "seed") {
+      options.seed = std::stoull(value);
+    } else {
+      return false;
+    }
+  }
+  if (options.threads <= 0) {
+    options.threads =
+        static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  }
+  return true;
+} catch (const std::logic_error &) {
+  // std::invalid_argument or std::out_of_range of number conversion
+  return false;
+}
+
+
+//! Sampler of states with probability of the i-th proportional to
+//! 1 / (i + 1)^exponent
+class ZipfSampler {
+ public:
+  ZipfSampler(int vocabulary, double exponent) : cdf_(vocabulary) {
+    double sum = 0;
+    for (int i = 0; i < vocabulary; ++i) {
+      sum += 1 / std::pow(i + 1, exponent);
+      cdf_[i] = sum;
+    }
+    for (double &value : cdf_) {
+      value /= sum;
+    }
+  }
+
+  State Sample(Xoshiro256pp &rng) const {
+    double x = static_cast<double>(rng() >> 11) * 0x1.0p-53;
+    auto idx = std::upper_bound(cdf_.begin(), cdf_.end(), x) - cdf_.begin();
+    return "s" + std::to_string(std::min<std::size_t>(idx, cdf_.size() - 1));
+  }
+
+ private:
+  std::vector<double> cdf_;
+};
+
+
+std::vector<State> SampleStates(const ZipfSampler &sampler, int count,
+                                Xoshiro256pp &rng) {
+  std::vector<State> states;
+  for (int i = 0; i < count; ++i) {
+    states.push_back(sampler.Sample(rng));
+  }
+  return states;
+}
+
+std::vector<Op> SynthesizeOps(const Options &options, int64_t count,
+                              Xoshiro256pp &rng, bool feeds_only) {
+  ZipfSampler sampler(options.vocabulary, options.zipf);
+  std::vector<Op> ops;
+  ops.reserve(count);
+  for (int64_t i = 0; i < count; ++i) {
+    double x = static_cast<double>(rng() >> 11) * 0x1.0p-53;
+    if (feeds_only || x >= options.read_ratio + options.update_ratio) {
+      ops.push_back({kFeed, SampleStates(sampler, options.seq_len, rng)});
+    } else if (x < options.read_ratio) {
+      ops.push_back({kPredict, SampleStates(sampler, options.memory + 1, rng)});
+    } else {
+      ops.push_back({kUpdate, SampleStates(sampler, 1, rng)});
+    }
+  }
+  return ops;
+}
+
+
+constexpr std::string_view kMeasure = "measure";
+
+//! Read trace, false with the number of malformed line. Operations
+//! before the measure line are moved into warmup, that is set if there
+//! is such line
+bool ReadTrace(std::istream &is, std::optional<std::vector<Op>> &warmup,
+               std::vector<Op> &ops, int64_t &line_no) {
+  std::string line;
+  for (line_no = 1; std::getline(is, line); ++line_no) {
+    std::istringstream fields(line);
+    std::string kind;
+    if (!(fields >> kind)) {
+      continue;
+    }
+    if (kind == kMeasure) {
+      if (warmup || fields >> kind) {
+        return false;
+      }
+      warmup = std::move(ops);
+      ops.clear();
+      continue;
+    }
+    Op op;
+    auto it = std::find(kKindNames, kKindNames + kNumKinds, kind);
+    if (it == kKindNames + kNumKinds) {
+      return false;
+    }
+    op.kind = static_cast<OpKind>(it - kKindNames);
+    for (State state; fields >> state;) {
+      op.states.push_back(state);
+    }
+    if (op.states.empty()) {
+      return false;
+    }
+    ops.push_back(std::move(op));
+  }
+  return true;
+}
+
+void WriteTrace(std::ostream &os, std::span<const Op> ops) {
+  for (const Op &op : ops) {
+    os << kKindNames[op.kind];
+    for (const State &state : op.states) {
+      os << ' ' << state;
+    }
+    os << '\n';
+  }
+}
+
+
+//! Push states into memory of the thread, where memory[0] is the last
+//! one, keeping memory_size last states
+void Remember(std::span<const State> states, int memory_size,
+              std::vector<State> &memory) {
+  for (const State &state : states) {
+    if (static_cast<int>(memory.size()) >= memory_size) {
+      memory.pop_back();
+    }
+    memory.insert(memory.begin(), state);
+  }
+}
+
+
+//! MarkovChain shared by threads under mutex
+class MutexTarget {
+ public:
+  explicit MutexTarget(const Options &options)
+      : chain_(options.memory, options.seed),
+        memory_size_(options.memory + 1) {
+  }
+
+  void Feed(std::span<const State> states) {
+    std::lock_guard lock(mutex_);
+    chain_.FeedSequence(states.begin(), states.end());
+  }
+
+  bool Predict(std::span<const State> states) {
+    std::vector<State> &memory = Local();
+    Remember(states, memory_size_, memory);
+    std::lock_guard lock(mutex_);
+    // the chain is shared, so it takes memory of the thread, oldest first
+    chain_.UpdateMemory(memory.rbegin(), memory.rend());
+    return chain_.TryPredictState().has_value();
+  }
+
+  void Update(std::span<const State> states) {
+    Remember(states, memory_size_, Local());
+  }
+
+  void Flush() {
+  }
+
+ private:
+  evolv::MarkovChain<State> chain_;
+  int memory_size_;
+  std::mutex mutex_;
+
+  std::vector<State> &Local() {
+    thread_local std::vector<State> memory;
+    return memory;
+  }
+};
+
+
+//! ServingChain with single writer under mutex and lock-free readers
+class ServingTarget {
+ public:
+  explicit ServingTarget(const Options &options)
+      : chain_(options.memory),
+        memory_size_(options.memory + 1),
+        publish_every_(options.publish_every),
+        seed_(options.seed) {
+  }
+
+  void Feed(std::span<const State> states) {
+    std::lock_guard lock(writer_mutex_);
+    chain_.FeedSequence(states.begin(), states.end());
+    if (++unpublished_ >= publish_every_) {
+      chain_.Publish();
+      unpublished_ = 0;
+    }
+  }
+
+  bool Predict(std::span<const State> states) {
+    ThreadState &state = Local();
+    Remember(states, memory_size_, state.memory);
+    return chain_.GetSnapshot()
+        ->PredictState<Xoshiro256pp>(state.memory, state.rng)
+        .has_value();
+  }
+
+  void Update(std::span<const State> states) {
+    Remember(states, memory_size_, Local().memory);
+  }
+
+  void Flush() {
+    std::lock_guard lock(writer_mutex_);
+    chain_.Publish();
+    unpublished_ = 0;
+  }
+
+ private:
+  struct ThreadState {
+    Xoshiro256pp rng;
+    std::vector<State> memory;
+  };
+
+  evolv::ServingChain<State> chain_;
+  int memory_size_;
+  int publish_every_;
+  uint64_t seed_;
+  std::mutex writer_mutex_;
+  int unpublished_ = 0;
+
+  ThreadState &Local() {
+    thread_local ThreadState state{
+        Xoshiro256pp(seed_ + std::hash<std::thread::id>{}(
+                                 std::this_thread::get_id())),
+        {}};
+    return state;
+  }
+};
+
+
+struct RunResult {
+  double seconds = 0;
+  LatencyHistogram latency[kNumKinds];
+  int64_t empty_predictions = 0;
+};
+
+//! Run operations on threads taking them in small chunks in order
+template <class TargetT>
+RunResult Run(TargetT &target, std::span<const Op> ops, int threads) {
+  constexpr std::size_t kChunk = 64;
+  std::atomic<std::size_t> next = 0;
+  std::vector<RunResult> local(threads);
+  auto work = [&](RunResult &result) {
+    for (std::size_t first = next.fetch_add(kChunk); first < ops.size();
+         first = next.fetch_add(kChunk)) {
+      std::size_t last = std::min(first + kChunk, ops.size());
+      for (const Op &op : ops.subspan(first, last - first)) {
+        auto start = std::chrono::steady_clock::now();
+        switch (op.kind) {
+          case kFeed:
+            target.Feed(op.states);
+            break;
+          case kPredict:
+            result.empty_predictions += !target.Predict(op.states);
+            break;
+          default:
+            target.Update(op.states);
+        }
+        result.latency[op.kind].Record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count());
+      }
+    }
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threads; ++i) {
+    workers.emplace_back(work, std::ref(local[i]));
+  }
+  work(local[0]);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  RunResult total;
+  total.seconds = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+  for (const RunResult &result : local) {
+    for (int kind = 0; kind < kNumKinds; ++kind) {
+      total.latency[kind].Merge(result.latency[kind]);
+    }
+    total.empty_predictions += result.empty_predictions;
+  }
+  return total;
+}
+
+void Report(const Options &options, const RunResult &result) {
+  int64_t ops = 0;
+  for (const LatencyHistogram &latency : result.latency) {
+    ops += latency.Count();
+  }
+  std::printf("mode %s, threads %d, memory %d\n", options.mode.c_str(),
+              options.threads, options.memory);
+  std::printf("%lld ops in %.3f s, %.0f ops/s\n",
+              static_cast<long long>(ops), result.seconds,
+              ops / result.seconds);
+  std::printf("%-8s %12s %12s %10s %10s %10s\n", "op", "count", "ops/s",
+              "p50 ns", "p99 ns", "p999 ns");
+  for (int kind = 0; kind < kNumKinds; ++kind) {
+    const LatencyHistogram &latency = result.latency[kind];
+    std::printf("%-8s %12lld %12.0f %10lld %10lld %10lld\n",
+                kKindNames[kind], static_cast<long long>(latency.Count()),
+                latency.Count() / result.seconds,
+                static_cast<long long>(latency.Percentile(0.5)),
+                static_cast<long long>(latency.Percentile(0.99)),
+                static_cast<long long>(latency.Percentile(0.999)));
+  }
+  if (result.empty_predictions > 0) {
+    std::printf("%lld predictions had no transitions\n",
+                static_cast<long long>(result.empty_predictions));
+  }
+}
+
+template <class TargetT>
+void WarmUpAndRun(const Options &options, std::span<const Op> warmup,
+                  std::span<const Op> ops) {
+  TargetT target(options);
+  for (const Op &op : warmup) {
+    target.Feed(op.states);
+  }
+  target.Flush();
+  Report(options, Run(target, ops, options.threads));
+}
+
+}  // namespace
+
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if (!ParseOptions(argc, argv, options)) {
+    std::cerr << kUsage;
+    return 2;
+  }
+
+  std::optional<std::vector<Op>> warmup;
+  std::vector<Op> ops;
+  if (!options.trace.empty()) {
+    std::ifstream trace(options.trace);
+    int64_t line_no = 0;
+    if (!trace) {
+      std::cerr << "Can't open trace " << options.trace << '\n';
+      return 1;
+    }
+    if (!ReadTrace(trace, warmup, ops, line_no)) {
+      std::cerr << "Malformed line " << line_no << " of trace\n";
+      return 1;
+    }
+  }
+  Xoshiro256pp rng(options.seed);
+  if (!warmup) {
+    warmup = SynthesizeOps(options, options.warmup, rng, true);
+  }
+  if (options.trace.empty()) {
+    ops = SynthesizeOps(options, options.ops, rng, false);
+  }
+  if (!options.write_trace.empty()) {
+    std::ofstream trace(options.write_trace);
+    WriteTrace(trace, *warmup);
+    trace << kMeasure << '\n';
+    WriteTrace(trace, ops);
+    return trace ? 0 : 1;
+  }
+
+  if (options.mode == "serving") {
+    WarmUpAndRun<ServingTarget>(options, *warmup, ops);
+  } else {
+    WarmUpAndRun<MutexTarget>(options, *warmup, ops);
+  }
+  return 0;
+}
@@ -0,0 +1,458 @@
+// Trainer learning MarkovChain from a tokenized corpus on all cores and
+// writing the model file, that MarkovChain::Replay reads and TieredChain
+// or QuantizedChain are built from. The file records --memory + 1, and
+// only a chain of the same memory size replays it.
+//
+// Corpus is memory-mapped and never read into heap buffers: tokens are
+// looked up by StateCoder as views of the mapping. It's split into chunks
+// at token boundaries, taken by threads in order, and threads feed the
+// shared chain with FeedSequenceConcurrent. Sequences are fed by windows
+// of bounded length, each preceded by the last --memory + 1 tokens of
+// the sequence as context, so a sequence longer than a window, or than
+// a chunk, is learned in pieces on any threads, like it's fed at once.
+// Pages of processed chunks are dropped from the process, so resident
+// memory is taken by the model, not by the corpus.
+//
+// Text corpus has one sequence per line of tokens separated by spaces or
+// tabs. Binary corpus is a sequence of native-endian int32 tokens, where
+// sequences end with the delimiter token.
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "src/evolv.h"
+
+
+namespace {
+
+constexpr const char *kUsage =
+    R"(Usage: evolv_train --input=PATH [--option=value ...]
+
+  --input=PATH          corpus to learn from
+  --output=PATH         model file, model.evl by default
+  --format=text|binary  lines of tokens or int32 tokens, text by default
+  --delimiter=N         token ending sequences in binary corpus, -1 by
+                        default
+  --memory=N            number of previous states remembered, 0 by default
+  --threads=N           number of threads, all cores by default
+)";
+
+struct Options {
+  std::string input;
+  std::string output = "model.evl";
+  std::string format = "text";
+  int32_t delimiter = -1;
+  int memory = 0;
+  int threads = 0;
+};
+
+
+//! Parse --name=value arguments, false on unknown or malformed one
+bool ParseOptions(int argc, char *argv[], Options &options) try {
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    std::size_t eq = arg.find('=');
+    if (!arg.starts_with("--") || eq == std::string_view::npos) {
+      return false;
+    }
+    std::string_view name = arg.substr(2, eq - 2);
+    std::string value(arg.substr(eq + 1));
+    if (name == "input") {
+      options.input = value;
+    } else if (name == "output") {
+      options.output = value;
+    } else if (name == "format" && (value == "text" || value == "binary")) {
+      options.format = value;
+    } else if (name == "delimiter") {
+      options.delimiter = std::stoi(value);
+    } else if (name == "memory") {
+      options.memory = std::stoi(value);
+      if (options.memory < 0) {
+        return false;
+      }
+    } else if (name == "threads") {
+      options.threads = std::stoi(value);
+    } else {
+      return false;
+    }
+  }
+  if (options.threads <= 0) {
+    options.threads =
+        static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  }
+  return !options.input.empty();
+} catch (const std::logic_error &) {
+  // std::invalid_argument or std::out_of_range of number conversion
+  return false;
+}
+
+
+//! Read-only private mapping of the whole file
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size > 0) {
+      void *data = mmap(nullptr, static_cast<std::size_t>(size), PROT_READ,
+                        MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = static_cast<const char *>(data);
+        size_ = static_cast<std::size_t>(size);
+        madvise(data, size_, MADV_SEQUENTIAL);
+      }
+    } else if (size == 0) {
+      data_ = "";
+    }
+    close(fd);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+    if (size_ > 0) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+  }
+
+  bool IsOpen() const {
+    return data_ != nullptr;
+  }
+
+  const char *Data() const {
+    return data_;
+  }
+
+  std::size_t Size() const {
+    return size_;
+  }
+
+  //! Let the pages of [first, last) bytes go, they are read again from the
+  //! file if they are touched
+  void Drop(std::size_t first, std::size_t last) const {
+    std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    first = (first + page - 1) / page * page;
+    last = std::min(last, size_) / page * page;
+    if (first < last) {
+      madvise(const_cast<char *>(data_) + first, last - first,
+              MADV_DONTNEED);
+    }
+  }
+
+ private:
+  const char *data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+
+//! Iterator over tokens of the line as std::string states, that are
+//! dereferenced into views of the mapping, so StateCoder looks them up
+//! without copying and copies only the new ones
+class TokenIter {
+ public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = std::string;
+  using reference = std::string_view;
+  using pointer = void;
+  using difference_type = std::ptrdiff_t;
+
+  TokenIter() = default;
+
+  explicit TokenIter(const std::string_view *token) : token_(token) {
+  }
+
+  std::string_view operator*() const {
+    return *token_;
+  }
+
+  TokenIter &operator++() {
+    ++token_;
+    return *this;
+  }
+
+  TokenIter operator++(int) {
+    TokenIter copy = *this;
+    ++token_;
+    return copy;
+  }
+
+  bool operator==(const TokenIter &other) const = default;
+
+ private:
+  const std::string_view *token_ = nullptr;
+};
+
+
+//! Text corpus: sequences are lines, tokens are separated by whitespace
+struct TextFormat {
+  using TokenT = char;
+  using StateT = std::string;
+
+  explicit TextFormat(const Options &) {
+  }
+
+  bool IsDelimiter(char token) const {
+    return token == '\n';
+  }
+
+  //! The first position at pos or after it that isn't inside a token
+  std::size_t TokenBoundary(std::span<const char> corpus,
+                            std::size_t pos) const {
+    while (pos > 0 && pos < corpus.size() && !IsSeparator(corpus[pos - 1]) &&
+           !IsSeparator(corpus[pos])) {
+      ++pos;
+    }
+    return std::min(pos, corpus.size());
+  }
+
+  //! Start of the last count tokens of the sequence before pos, that is on
+  //! token boundary
+  std::size_t ContextStart(std::span<const char> corpus, std::size_t pos,
+                           int count) const {
+    for (; pos > 0 && !IsDelimiter(corpus[pos - 1]); --pos) {
+      if (!IsSeparator(corpus[pos - 1]) &&
+          (pos == 1 || IsSeparator(corpus[pos - 2])) && --count == 0) {
+        return pos - 1;
+      }
+    }
+    return pos;
+  }
+
+  //! Feed tokens of [first, last) characters after the ones of [context,
+  //! first) as context, return number of the fed ones
+  template <class ChainT>
+  std::size_t Feed(ChainT &chain, const char *context, const char *first,
+                   const char *last) {
+    tokens_.clear();
+    std::size_t num_context = 0;
+    for (const char *pos = context; pos != last;) {
+      pos = std::find_if(pos, last, [](char c) { return !IsSpace(c); });
+      const char *end = std::find_if(pos, last, IsSpace);
+      if (pos != end) {
+        tokens_.emplace_back(pos, static_cast<std::size_t>(end - pos));
+        num_context += pos < first;
+      }
+      pos = end;
+    }
+    if (tokens_.size() > num_context) {
+      chain.FeedSequenceConcurrent(
+          TokenIter(tokens_.data()),
+          TokenIter(tokens_.data() + tokens_.size()), num_context);
+    }
+    return tokens_.size() - num_context;
+  }
+
+ private:
+  std::vector<std::string_view> tokens_;
+
+  static bool IsSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+  }
+
+  static bool IsSeparator(char c) {
+    return IsSpace(c) || c == '\n';
+  }
+};
+
+
+//! Binary corpus: int32 tokens, sequences end with the delimiter one
+struct BinaryFormat {
+  using TokenT = int32_t;
+  using StateT = int32_t;
+
+  explicit BinaryFormat(const Options &options)
+      : delimiter_(options.delimiter) {
+  }
+
+  bool IsDelimiter(int32_t token) const {
+    return token == delimiter_;
+  }
+
+  std::size_t TokenBoundary(std::span<const int32_t> corpus,
+                            std::size_t pos) const {
+    return std::min(pos, corpus.size());
+  }
+
+  std::size_t ContextStart(std::span<const int32_t> corpus, std::size_t pos,
+                           int count) const {
+    for (; count > 0 && pos > 0 && !IsDelimiter(corpus[pos - 1]); --count) {
+      --pos;
+    }
+    return pos;
+  }
+
+  template <class ChainT>
+  std::size_t Feed(ChainT &chain, const int32_t *context,
+                   const int32_t *first, const int32_t *last) {
+    if (first != last) {
+      chain.FeedSequenceConcurrent(context, last,
+                                   static_cast<std::size_t>(first - context));
+    }
+    return static_cast<std::size_t>(last - first);
+  }
+
+ private:
+  int32_t delimiter_;
+};
+
+
+struct TrainResult {
+  int64_t tokens = 0;
+  int64_t sequences = 0;
+  double seconds = 0;
+};
+
+//! Feed the chain from the corpus on threads taking chunks in order.
+//! Chunks and windows of sequences start at token boundaries, and each
+//! window is fed after the tokens of the sequence it needs as context
+template <class FormatT, class ChainT>
+TrainResult Train(const Options &options, const MappedFile &file,
+                  ChainT &chain) {
+  using TokenT = typename FormatT::TokenT;
+  constexpr std::size_t kChunkBytes = std::size_t{16} << 20;
+  constexpr std::size_t kChunk = kChunkBytes / sizeof(TokenT);
+  // bounds codes and transitions of the window held by the thread
+  constexpr std::size_t kWindow = std::size_t{1} << 16;
+  std::span<const TokenT> corpus(
+      reinterpret_cast<const TokenT *>(file.Data()),
+      file.Size() / sizeof(TokenT));
+  std::size_t num_chunks = (corpus.size() + kChunk - 1) / kChunk;
+  int context = options.memory + 1;
+
+  std::atomic<std::size_t> next = 0;
+  std::vector<TrainResult> local(options.threads);
+  auto work = [&](TrainResult &result) {
+    FormatT format(options);
+    for (std::size_t chunk = next++; chunk < num_chunks; chunk = next++) {
+      std::size_t pos = format.TokenBoundary(corpus, chunk * kChunk);
+      std::size_t chunk_end =
+          format.TokenBoundary(corpus, (chunk + 1) * kChunk);
+      while (pos < chunk_end) {
+        bool starts_sequence = pos == 0 || format.IsDelimiter(corpus[pos - 1]);
+        auto it = std::find_if(
+            corpus.begin() + pos, corpus.begin() + chunk_end,
+            [&format](TokenT token) { return format.IsDelimiter(token); });
+        auto end = static_cast<std::size_t>(it - corpus.begin());
+        std::size_t fed = 0;
+        while (pos < end) {
+          std::size_t window_end =
+              std::min(end, format.TokenBoundary(corpus, pos + kWindow));
+          const TokenT *data = corpus.data();
+          fed += format.Feed(chain,
+                             data + format.ContextStart(corpus, pos, context),
+                             data + pos, data + window_end);
+          pos = window_end;
+        }
+        result.tokens += static_cast<int64_t>(fed);
+        result.sequences += starts_sequence && fed > 0;
+        // past the delimiter, if the sequence ends in the chunk
+        pos = end + (end < chunk_end);
+      }
+      file.Drop(chunk * kChunkBytes, (chunk + 1) * kChunkBytes);
+    }
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int i = 1; i < options.threads; ++i) {
+    workers.emplace_back(work, std::ref(local[i]));
+  }
+  work(local[0]);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  TrainResult total;
+  total.seconds = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+  for (const TrainResult &result : local) {
+    total.tokens += result.tokens;
+    total.sequences += result.sequences;
+  }
+  return total;
+}
+
+//! Peak resident memory of the process in MiB
+double PeakRssMiB() {
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<double>(usage.ru_maxrss) / 1024;
+}
+
+template <class FormatT>
+int TrainAndWrite(const Options &options, const MappedFile &file) {
+  evolv::MarkovChain<typename FormatT::StateT> chain(options.memory, 1);
+  TrainResult result = Train<FormatT>(options, file, chain);
+  evolv::internal::ChainStats stats = chain.Stats();
+  std::printf("format %s, threads %d, memory %d\n", options.format.c_str(),
+              options.threads, options.memory);
+  std::printf("%lld tokens in %lld sequences in %.3f s, %.0f tokens/s\n",
+              static_cast<long long>(result.tokens),
+              static_cast<long long>(result.sequences), result.seconds,
+              result.tokens / result.seconds);
+  std::printf("%zu states, %zu rows, %lld transitions\n", stats.states,
+              stats.rows, static_cast<long long>(stats.transitions));
+
+  auto start = std::chrono::steady_clock::now();
+  std::ofstream os(options.output, std::ios::binary);
+  chain.Compact(os);
+  os.close();
+  if (!os) {
+    std::cerr << "Can't write model " << options.output << '\n';
+    return 1;
+  }
+  std::printf("model written to %s in %.3f s\n", options.output.c_str(),
+              std::chrono::duration<double>(
+                  std::chrono::steady_clock::now() - start)
+                  .count());
+  std::printf("peak RSS %.1f MiB\n", PeakRssMiB());
+  return 0;
+}
+
+}  // namespace
+
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if (!ParseOptions(argc, argv, options)) {
+    std::cerr << kUsage;
+    return 2;
+  }
+
+  MappedFile file(options.input);
+  if (!file.IsOpen()) {
+    std::cerr << "Can't map corpus " << options.input << '\n';
+    return 1;
+  }
+  if (options.format == "binary") {
+    if (file.Size() % sizeof(int32_t) != 0) {
+      std::cerr << "Binary corpus size isn't a multiple of 4 bytes\n";
+      return 1;
+    }
+    return TrainAndWrite<BinaryFormat>(options, file);
+  }
+  return TrainAndWrite<TextFormat>(options, file);
+}